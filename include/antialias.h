@@ -0,0 +1,54 @@
+#ifndef ANTIALIAS_H
+#define ANTIALIAS_H
+
+#include "vector.h"
+#include "cl_util.h"
+
+/**
+ Primary visibility of a single pixel as written by the
+ ray_tracer kernel during the first pass of adaptive
+ anti-aliasing. The format of this struct aligns with the
+ 'pixel_sample' struct in the OpenCL code for the ray tracer.
+ */
+typedef struct {
+    vector4 color;
+    cl_int hit;
+    cl_float depth;
+    cl_float padding[2];
+} pixel_sample;
+
+/**
+ Kernel tracing the extra sub-pixel rays for pixels flagged
+ as edges. It shares the camera and scene arguments (see kernel_args.h)
+ of the ray_tracer kernel, the caller is responsible for
+ setting those.
+ */
+extern cl_kernel refine_kernel;
+
+/**
+ Creates the adaptive anti-aliasing kernels and buffers for
+ a w * h output and binds the pixel_sample buffer to the
+ ray_tracer kernel.
+ \param w Width of the output image.
+ \param h Height of the output image.
+ */
+void init_antialias(unsigned w, unsigned h);
+
+/**
+ Enqueues the edge detection and refinement passes. Must be
+ called after the ray_tracer kernel has been enqueued while
+ the output image is still acquired.
+ \param w Width of the output image.
+ \param h Height of the output image.
+ \param threshold Discontinuity threshold for detecting edges.
+ \param sub_samples Sub-pixel rays along each axis for edge pixels.
+ \return The number of pixels that were refined.
+ */
+unsigned render_antialias(unsigned w, unsigned h, float threshold, unsigned sub_samples);
+
+/**
+ Releases all memory allocated by init_antialias(...).
+ */
+void release_antialias();
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// alignment of every allocation unless a larger one is asked for, a cache line
+#define ARENA_ALIGNMENT 64
+
+// default size of the blocks an arena allocates from
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+typedef struct arena_block {
+    struct arena_block * next;
+    size_t size;
+    size_t used;
+    // 'size' bytes of storage follow the header
+} arena_block;
+
+/**
+ Linear allocator for data that lives and dies together, such as
+ the arrays of an imported scene. Allocations are bump allocated
+ from large blocks and can not be freed individually, release_arena(...)
+ frees all of them at once. Not thread safe, give every thread its own.
+ */
+typedef struct {
+    arena_block * head; // block currently allocated from
+    size_t block_size;
+    size_t allocated;   // bytes handed out
+} arena;
+
+/**
+ \param a (output) The empty arena, no memory is allocated yet.
+ \param block_size Size of the blocks to allocate, 0 for ARENA_BLOCK_SIZE.
+ */
+void init_arena(arena * a, size_t block_size);
+
+/**
+ Allocates 'size' bytes aligned to 'alignment', which must be a power
+ of two. Requests larger than the block size get a block of their own.
+ \return The uninitialized memory, valid until release_arena(...).
+ */
+void * arena_alloc_aligned(arena * a, size_t size, size_t alignment);
+
+/**
+ Allocates 'size' bytes aligned to ARENA_ALIGNMENT.
+ */
+void * arena_alloc(arena * a, size_t size);
+
+/**
+ Frees every block of the arena, it may be used again afterwards.
+ */
+void release_arena(arena * a);
+
+#endif
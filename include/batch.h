@@ -0,0 +1,96 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+
+#include "vector.h"
+#include "cl_util.h"
+#include "thread_pool.h"
+
+// image formats written by the frame writer
+#define FRAME_PPM 0
+#define FRAME_PFM 1
+
+// pinned host buffers frames are read back into, frames in flight
+#define FRAME_SLOTS 3
+
+/**
+ Camera and light placement at a point in time, see load_keyframes(...).
+ */
+typedef struct {
+    float time;
+    vector4 camera;
+    vector4 target;
+    vector4 light;
+} keyframe;
+
+/**
+ Reads a list of keyframes from a text file, one per line as
+    time camera_x camera_y camera_z target_x target_y target_z light_x light_y light_z
+ in increasing time. Empty lines and lines starting with '#' are ignored.
+ The caller will be responsible for freeing the returned memory.
+ \param filename Name of the file to read.
+ \param count (output) The number of keyframes read, at least one.
+ \return Array of 'count' keyframes.
+ */
+keyframe * load_keyframes(const char * filename, size_t * count);
+
+/**
+ Linearly interpolates the keyframes at 'time', clamped to the first and last.
+ \param keys Keyframes in increasing time.
+ \param count Number of keyframes.
+ \param time Time to sample at.
+ \return The interpolated keyframe.
+ */
+keyframe sample_keyframes(const keyframe * keys, size_t count, float time);
+
+/**
+ Writes an 8 bit RGBA frame as '<prefix><frame>.ppm', dropping alpha.
+ \param prefix Path prefix of the written file.
+ \param frame Number of the frame.
+ \param pixels w * h pixels, rows top to bottom.
+ \param w Width of the frame.
+ \param h Height of the frame.
+ */
+void save_ppm_frame(const char * prefix, unsigned frame,
+                    const cl_uchar * pixels, unsigned w, unsigned h);
+
+/**
+ Prepares FRAME_SLOTS pinned host buffers to read 'image' back into and
+ writes each frame on 'pool', named by 'prefix' and the frame number.
+ The image is already resolved by the tonemap pass, so only its
+ compact encoding crosses the bus.
+ \param image RGBA image of w by h pixels, 8 bit sRGB for FRAME_PPM
+              or linear half floats for FRAME_PFM.
+ \param w Width of the written frames.
+ \param h Height of the written frames.
+ \param prefix Path prefix of the written files.
+ \param format FRAME_PPM or FRAME_PFM.
+ \param pool Thread pool running the writers.
+ */
+void init_frame_writer(cl_mem image, unsigned w, unsigned h,
+                       const char * prefix, int format, thread_pool * pool);
+
+/**
+ Blocks until the slot used by 'frame' has been written out, after which
+ the host memory of any of its commands enqueued before may be reused.
+ \param frame Number of the frame about to be rendered.
+ \return The slot of the frame, in [0, FRAME_SLOTS).
+ */
+unsigned acquire_frame_slot(unsigned frame);
+
+/**
+ Enqueues a non-blocking read of the image into the frame's slot
+ and queues the write of the frame once the read completes. Must
+ be called after the frame's kernels have been enqueued.
+ \param frame Number of the frame, its slot must be acquired.
+ */
+void write_frame(unsigned frame);
+
+/**
+ Waits for every frame to be written and releases the
+ buffers allocated by init_frame_writer(...).
+ */
+void release_frame_writer();
+
+#endif
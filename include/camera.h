@@ -24,6 +24,26 @@ typedef struct {
  */
 cam_data init_camera(float field_of_view, float near_dist, float aspect_ratio);
 
+/**
+ Places the camera at 'pos' looking towards 'target' with
+ the world y axis up, keeping its field of view.
+ \param camera The camera representation to be placed.
+ \param pos The new camera position.
+ \param target Point the camera looks at.
+ */
+void look_at_camera(cam_data * camera, vector4 pos, vector4 target);
+
+/**
+ Creates a camera seeing only a rectangle of the image of 'camera',
+ rendering it at any resolution gives the same rays as that part of
+ the whole image.
+ \param camera The camera of the whole image.
+ \param rect Rectangle (x, y, width, height) in fractions of the image,
+             y pointing down like the image rows.
+ \return The camera of the rectangle.
+ */
+cam_data crop_camera(const cam_data * camera, vector4 rect);
+
 /**
  Moves the camera by the input Velocity vector over
  the given time.
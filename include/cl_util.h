@@ -21,7 +21,7 @@ extern cl_device_id device_id;
 extern cl_context context;
 extern cl_command_queue command_queue;
 extern cl_program program;
-extern cl_kernel kernel;
+extern cl_kernel kernel; // the ray_tracer kernel, NULL in headless modes
 
 /**
  Utility method for checking an error code as returned by 
@@ -38,14 +38,47 @@ void cl_check_err(int err, const char * msg);
 
 /**
  Setup the OpenCL device and program representations.
-For each reference we need, we will call the appropriate
- OpenCL initialization function, then check if
- any error occurred.
+ Runs init_cl_context(), build_program(...) and
+ wait_program() back to back. Kernels are created
+ afterwards with create_kernel(...).
  
  \param sources Array of file names to be used for the program.
  \param count The number of items in the input array.
+ \param build_options Options passed to clBuildProgram(...), may be NULL.
  */
-void init_cl(const char ** sources, int count);
+void init_cl(const char ** sources, int count, const char * build_options);
+
+/**
+ Creates the device, context and command queue. The context
+ shares the OpenGL context of 'window', or stands alone if no
+ window has been created.
+ */
+void init_cl_context();
+
+/**
+ Starts building the program from the source files. The build is
+ requested with a completion callback, so drivers that compile in
+ the background return right away and the caller keeps working
+ until wait_program().
+ \param sources Array of file names to be used for the program.
+ \param count The number of items in the input array.
+ \param build_options Options passed to clBuildProgram(...), may be NULL.
+ */
+void build_program(const char ** sources, int count, const char * build_options);
+
+/**
+ Blocks until the program started by build_program(...) is built.
+ Prints the build log and terminates with EXIT_FAILURE if it failed.
+ */
+void wait_program();
+
+/**
+ Creates the kernel 'name' from the program built by init_cl(...).
+ Terminates with EXIT_FAILURE if the kernel does not exist.
+ \param name Name of the __kernel function.
+ \return The new kernel, the caller is responsible for releasing it.
+ */
+cl_kernel create_kernel(const char * name);
 
 /**
  Releases all memory that was allocated by the
@@ -53,4 +86,10 @@ void init_cl(const char ** sources, int count);
  */
 void release_cl();
 
+/**
+ Monotonic wall clock time in seconds, times host and
+ device work without relying on a window.
+ */
+double wall_time();
+
 #endif
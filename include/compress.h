@@ -0,0 +1,71 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+#include "vector.h"
+#include "cl_util.h"
+#include "arena.h"
+
+// triangles grouped into a single chunk, sharing its bounds for quantization
+#define CHUNK_TRIANGLES 256
+
+// ushorts per compressed triangle, 3 vertex indices and a 32 bit normal
+#define COMPRESSED_TRIANGLE_SIZE 5
+
+/**
+ A run of triangles whose vertices are quantized to 16 bits
+ within the chunk bounds. The format of this struct aligns with
+ the 'geometry_chunk' struct in the OpenCL code for the ray tracer.
+ */
+typedef struct {
+    vector4 lo;
+    vector4 hi;
+
+    cl_uint vertex_offset;      // first vertex of the chunk
+    cl_uint triangle_offset;    // first triangle of the chunk
+    cl_uint triangle_count;
+    cl_uint padding;
+} geometry_chunk;
+
+/**
+ Compressed representation of a triangle mesh. Each vertex is
+ 3 ushorts, quantized to the bounds of its chunk. Each triangle is
+ COMPRESSED_TRIANGLE_SIZE ushorts: 3 vertex indices relative to the
+ chunk's vertex_offset followed by the octahedral encoded face
+ normal (low 16 bits first).
+ */
+typedef struct {
+    geometry_chunk * chunks;
+    cl_ushort * vertices;
+    cl_ushort * triangles;
+
+    size_t chunk_count;
+    size_t vertex_count;
+    size_t triangle_count;
+
+    arena memory; // backs all of the arrays above
+} compressed_geometry;
+
+/**
+ Compresses the triangles produced by make_triangle(...), vertices
+ shared by triangles within a chunk are only stored once.
+ \param surfaces Array of 'triangle_count' triangles, TRIANGLE_SIZE floats each.
+ \param triangle_count The number of triangles.
+ \param geometry (output) The compressed geometry.
+ */
+void compress_geometry(const cl_float * surfaces, size_t triangle_count,
+                       compressed_geometry * geometry);
+
+/**
+ Frees all memory allocated by compress_geometry(...).
+ */
+void release_compressed_geometry(compressed_geometry * geometry);
+
+/**
+ Octahedral encoding of a unit vector into two 16 bit values,
+ the first in the low bits of the result.
+ */
+cl_uint encode_octahedral(vector4 n);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef DISTRIBUTE_H
+#define DISTRIBUTE_H
+
+#include <stdbool.h>
+
+#include "vector.h"
+#include "cl_util.h"
+
+// pixels along each side of a tile, workers render frames of this size
+#define TILE_SIZE 64
+
+// jobs sent to a worker before it returns any, hides the round trip
+#define JOBS_IN_FLIGHT 2
+
+/**
+ A tile of a frame to render. The camera and light are the keyframe
+ sampled for the frame, see sample_keyframes(...).
+ */
+typedef struct {
+    cl_uint id;         // tile of the batch, frame * tiles per frame + tile
+    cl_uint seed;       // seeds the samples of the tile, see enqueue_frame()
+    cl_uint x;          // tile origin in pixels of the frame
+    cl_uint y;
+    vector4 camera;
+    vector4 target;
+    vector4 light;
+} tile_job;
+
+/**
+ Renders the frames of options.batch_file on worker processes instead
+ of a local device. Waits on options.listen_address for options.workers
+ workers, ships each the scene (the options of 'argv') once, and then
+ hands out the tiles of up to FRAME_SLOTS frames at a time. Workers
+ that run out of tiles take a second copy of the oldest tile still
+ being rendered by another worker, the first copy back is kept. Frames
+ are written as ppm files once all of their tiles arrived.
+ Addresses holding a '/' name a Unix socket, others are [host:]port.
+ \param argc Argument count as passed to main(...).
+ \param argv Argument values as passed to main(...).
+ \return Exit status of the process.
+ */
+int run_coordinator(int argc, const char ** argv);
+
+/**
+ Connects to the coordinator at 'address' and receives the scene,
+ the options of the coordinator's command line.
+ \param address Address the coordinator listens on.
+ \param argc (output) Number of arguments of the scene.
+ \param argv (output) Arguments of the scene, kept for the process.
+ \param frame_w (output) Width of the frames the tiles belong to.
+ \param frame_h (output) Height of the frames the tiles belong to.
+ */
+void join_coordinator(const char * address, int * argc, const char *** argv,
+                      unsigned * frame_w, unsigned * frame_h);
+
+/**
+ Blocks until the coordinator sends the next tile.
+ \param job (output) The tile to render.
+ \return false once the coordinator has no tiles left.
+ */
+bool receive_job(tile_job * job);
+
+/**
+ Compresses a rendered tile and sends it to the coordinator.
+ \param job The tile that was rendered.
+ \param pixels TILE_SIZE * TILE_SIZE 8 bit RGBA pixels.
+ \return false if the coordinator hung up, which it does once the
+         last frame is written even if a stolen tile is still out.
+ */
+bool send_tile(const tile_job * job, const cl_uchar * pixels);
+
+/**
+ Closes the connection opened by join_coordinator(...).
+ */
+void leave_coordinator();
+
+#endif
@@ -6,6 +6,8 @@
 #ifndef FILE_IO_H
 #define FILE_IO_H
 
+#include "arena.h"
+
 /**
  Utility method to read the given file name into a single
  character buffer. The caller will be responsible for
@@ -16,6 +18,12 @@
  */
 char * read_file(const char * filename);
 
+/**
+ Same as read_file(...), but the buffer is allocated from 'a'
+ and freed along with it.
+ */
+char * arena_read_file(arena * a, const char * filename);
+
 /**
  Determines the length (in bytes) of the input file.
  \param filename Name of the file to read.
@@ -6,6 +6,8 @@
 #ifndef GL_UTIL_H
 #define GL_UTIL_H
 
+#include <stdbool.h>
+
 #define GLEW_STATIC
 #include <GL/glew.h>
 
@@ -42,13 +44,27 @@ extern float fps;
 
 /**
  serves as a multiplier to the screen_w and the screen_h
- when generating the screen_tex, the resulting pixel count
- will be screen_w * screen_h * sample_rate^2
+ when generating the HDR frame (see tonemap.h), the resulting
+ pixel count will be screen_w * screen_h * sample_rate^2
  the default value of sample_rate is 1
  */
 extern unsigned sample_rate;
 extern GLuint screen_tex;
 
+/**
+ when set the HDR frame is not scaled by sample_rate, instead
+ only pixels on primitive, depth, or color edges are refined
+ with sample_rate^2 rays (see antialias.h)
+ */
+extern bool adaptive_aa;
+
+/**
+ Multiplier applied to screen_w and screen_h to get the
+ dimmensions of the HDR frame (and the ray tracer's
+ global work size).
+ */
+unsigned render_scale();
+
 /**
  Initializes an OpenGL context using screen 
  dimmensions of screen_w and screen_h.
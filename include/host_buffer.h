@@ -0,0 +1,68 @@
+#ifndef HOST_BUFFER_H
+#define HOST_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cl_util.h"
+
+// alignment and size granularity drivers need to use host memory without a copy
+#define HOST_BUFFER_ALIGNMENT 4096
+#define HOST_BUFFER_GRANULARITY 64
+
+/**
+ Device buffer the host reads and writes through a mapping instead
+ of clEnqueueWriteBuffer(...) / clEnqueueReadBuffer(...) from its own
+ malloc'd copy.
+
+ On devices sharing memory with the host the buffer wraps page aligned
+ host memory (CL_MEM_USE_HOST_PTR), mapping it returns that memory and
+ no copy is made at all. Other devices get runtime allocated, usually
+ pinned, host memory (CL_MEM_ALLOC_HOST_PTR), transferred by DMA when
+ mapped or unmapped.
+ */
+typedef struct {
+    cl_mem mem;
+    void * host; // NULL while not mapped
+    size_t size; // padded to HOST_BUFFER_GRANULARITY
+} host_buffer;
+
+/**
+ \return true if the device shares memory with the host, queried once.
+ */
+bool host_unified_memory();
+
+/**
+ Creates the buffer, init_cl(...) must have been called.
+ \param b (output) The new buffer, not mapped.
+ \param size Size in bytes, may be 0.
+ \param access Device access flags, CL_MEM_READ_ONLY etc.
+ */
+void init_host_buffer(host_buffer * b, size_t size, cl_mem_flags access);
+
+/**
+ Blocking map of the whole buffer. Map with CL_MAP_WRITE_INVALIDATE_REGION
+ when the host overwrites the contents, that skips reading them back.
+ \return The host pointer, also stored in b->host.
+ */
+void * map_host_buffer(host_buffer * b, cl_map_flags flags);
+
+/**
+ Enqueues the unmap, kernels enqueued afterwards see the host writes.
+ Does nothing if the buffer is not mapped.
+ */
+void unmap_host_buffer(host_buffer * b);
+
+/**
+ Unmaps the buffer and releases the reference held by 'b', a
+ retained b->mem stays valid.
+ */
+void release_host_buffer(host_buffer * b);
+
+/**
+ Creates a device buffer holding a copy of 'data', written through
+ a mapping. The caller is responsible for releasing the buffer.
+ */
+cl_mem upload_host_data(const void * data, size_t size, cl_mem_flags access);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef IRRADIANCE_H
+#define IRRADIANCE_H
+
+#include "vector.h"
+#include "cl_util.h"
+
+// cells of the cache, a power of two, must match ray_tracer.cl
+#define IRRADIANCE_CELLS (1 << 18)
+
+// cells along the longest side of the scene bounds
+#define IRRADIANCE_RESOLUTION 64
+
+/**
+ A cell of the world space irradiance cache. The format of this
+ struct aligns with the 'irradiance_cell' struct in the OpenCL
+ code for the ray tracer.
+ */
+typedef struct {
+    cl_uint checksum;
+    cl_uint count;
+    cl_uint sum[3];
+    cl_int cell[3];
+} irradiance_cell;
+
+/**
+ Creates a cache of indirect diffuse light for the scene kernels.
+ Shading points look up the light of their grid cell, hashed into a
+ fixed table, in place of a constant ambient term. Cells are filled
+ lazily: a share of the shading points traces a single hemisphere
+ sample, which picks up the cached light where it lands and so
+ carries further bounces over the frames.
+ \param lo Lower corner of the scene bounds.
+ \param hi Upper corner of the scene bounds.
+ */
+void init_irradiance(vector4 lo, vector4 hi);
+
+/**
+ Binds the cache to a scene kernel, or a NULL cache for the constant
+ ambient term when init_irradiance(...) was not called.
+ */
+void set_irradiance_kernel_args(cl_kernel k);
+
+/**
+ Marks the cells overlapping the box as stale, they are dropped by the
+ next refresh_irradiance(...). Boxes add up until then.
+ */
+void invalidate_irradiance(vector4 lo, vector4 hi);
+
+/**
+ Enqueues the pass aging the cache between frames and dropping the
+ stale cells, must be enqueued before every frame.
+ \param moving BVH nodes whose root bounds geometry moved since the
+               last frame, NULL if nothing moves.
+ */
+void refresh_irradiance(cl_mem moving);
+
+/**
+ Releases all memory allocated by init_irradiance(...).
+ */
+void release_irradiance();
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef KERNEL_ARGS_H
+#define KERNEL_ARGS_H
+
+/**
+ Argument indices of the parameters shared by every kernel
+ rendering the scene (SCENE_PARAMS in ray_tracer.cl). Arguments
+ specific to a single kernel start at ARG_KERNEL_SPECIFIC.
+ */
+enum {
+    ARG_CAMERA_POS,
+    ARG_CAMERA_LOOK,
+    ARG_CAMERA_RIGHT,
+    ARG_CAMERA_UP,
+    ARG_SEED,
+
+    ARG_LIGHTS,
+    ARG_LIGHT_TABLE,
+    ARG_N_LIGHTS,
+    ARG_LIGHT_SAMPLES,
+
+    ARG_MATERIALS,
+    ARG_MATERIAL_IDS,
+    ARG_MAX_DEPTH,
+    ARG_IRRADIANCE,
+    ARG_IRRADIANCE_CELL_SIZE,
+
+    ARG_SURFACES,
+    ARG_LOCAL_SURFACES,
+    ARG_N_SURFACES,
+    ARG_N_SURF_VALS,
+
+    ARG_SPHERE_NODES,
+    ARG_SPHERES,
+    ARG_SPHERE_RADIUS,
+    ARG_SPHERE_MATERIAL,
+
+    ARG_OUTPUT,
+    ARG_KERNEL_SPECIFIC,
+
+    // geometry arguments when built with COMPRESSED_GEOMETRY
+    ARG_CHUNKS = ARG_SURFACES,
+    ARG_COMPRESSED_VERTICES = ARG_LOCAL_SURFACES,
+    ARG_COMPRESSED_TRIANGLES = ARG_N_SURFACES,
+    ARG_N_CHUNKS = ARG_N_SURF_VALS,
+
+    // geometry arguments when built with USE_BVH
+    ARG_TRIANGLE_NODES = ARG_LOCAL_SURFACES
+};
+
+#endif
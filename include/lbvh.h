@@ -0,0 +1,118 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vector.h"
+#include "cl_util.h"
+
+// work group size and tiles per radix sort group, must match lbvh.cl
+#define LBVH_GROUP 128
+#define LBVH_TILES 32
+
+/**
+ Node of a linear BVH, aligns with the 'bvh_node' struct in lbvh.cl.
+ The w components hold links as integer bits: lo.w is the left
+ child, or -(primitive + 1) for a leaf, hi.w is the node following
+ this subtree in a depth first walk, -1 past the end of the tree.
+ */
+typedef struct {
+    vector4 lo;
+    vector4 hi;
+} bvh_node;
+
+/**
+ Device key/value radix sort over at most 'count' pairs, using
+ the radix kernels of lbvh.cl. Callers fill keys[0] and values[0]
+ and find them sorted there after sort_radix(...).
+ */
+typedef struct {
+    size_t count;
+    cl_mem keys[2];
+    cl_mem values[2];
+    cl_mem histogram;
+    size_t sort_groups;
+} radix_sort;
+
+/**
+ Device buffers for a linear BVH over a fixed number of primitives,
+ built entirely on the device by build_lbvh(...). The program built
+ by init_cl(...) must include lbvh.cl.
+ */
+typedef struct {
+    // may be lowered below the allocated count between builds
+    size_t count;
+
+    // one bvh_node of bounds per primitive, filled in by the caller
+    cl_mem prims;
+
+    // 2 * count - 1 nodes, the root first
+    cl_mem nodes;
+
+    // {center of mass, total mass} per node, NULL unless requested
+    cl_mem node_mass;
+
+    // build scratch
+    radix_sort sort;
+    cl_mem parents;
+    cl_mem flags;
+    cl_mem scene_bounds;
+} lbvh;
+
+/**
+ Allocates the device buffers for sorting up to 'count' pairs.
+ The program built by init_cl(...) must include lbvh.cl.
+ \param sort The sort to initialize.
+ \param count Maximum number of pairs, at least one.
+ */
+void init_radix_sort(radix_sort * sort, size_t count);
+
+/**
+ Enqueues a stable sort of the first 'n' pairs in keys[0] and
+ values[0] by the low 'bits' bits of the keys, 4 bits per pass.
+ Higher key bits are ignored. Nothing is read back to the host.
+ \param sort The sort holding the pairs.
+ \param n Number of pairs to sort, at most sort->count.
+ \param bits Significant key bits, rounded up to a multiple of 4.
+ */
+void sort_radix(radix_sort * sort, size_t n, unsigned bits);
+
+/**
+ Releases all memory allocated by init_radix_sort(...).
+ */
+void release_radix_sort(radix_sort * sort);
+
+/**
+ Allocates the device buffers for a BVH over 'count' primitives.
+ \param bvh The BVH to initialize.
+ \param count Number of primitives, at least one, terminates with
+              EXIT_FAILURE otherwise.
+ \param with_mass Also allocate node_mass for build_lbvh(...).
+ */
+void init_lbvh(lbvh * bvh, size_t count, bool with_mass);
+
+/**
+ Enqueues the computation of bvh->prims from a buffer of
+ float4 points, each with the given radius.
+ \param bvh The BVH whose primitives are points.
+ \param points Buffer of bvh->count float4 points.
+ \param radius Radius of the sphere around each point.
+ */
+void point_bounds_lbvh(lbvh * bvh, cl_mem points, float radius);
+
+/**
+ Enqueues a full rebuild from bvh->prims: Morton codes, radix sort,
+ hierarchy and bottom up bounds. Nothing is read back to the host.
+ \param bvh The BVH to rebuild.
+ \param prim_mass Buffer of float4 {position, mass} per primitive used
+                  to fill bvh->node_mass, or NULL.
+ */
+void build_lbvh(lbvh * bvh, cl_mem prim_mass);
+
+/**
+ Releases all memory allocated by init_lbvh(...).
+ */
+void release_lbvh(lbvh * bvh);
+
+#endif
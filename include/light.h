@@ -0,0 +1,68 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include <stddef.h>
+
+#include "vector.h"
+#include "cl_util.h"
+
+#define LIGHT_POINT     0
+#define LIGHT_SPHERE    1
+#define LIGHT_TRIANGLE  2
+
+/**
+ A single emitter in the scene. The format of this struct
+ aligns with the 'light' struct in the OpenCL code for the
+ ray tracer.
+ */
+typedef struct {
+    vector4 pos;    // point and sphere center (w = radius), or first triangle vertex
+    vector4 edge1;  // triangle only, p2 - p1
+    vector4 edge2;  // triangle only, p3 - p1
+    vector4 color;  // w = range, the distance at which the light falls off to zero
+
+    cl_int type;
+    cl_float pdf;   // selection probability, filled in by build_light_table(...)
+    cl_float padding[2];
+} light;
+
+/**
+ Entry of the alias table used by the kernel to select a light
+ in constant time, regardless of the number of lights.
+ */
+typedef struct {
+    cl_float prob;
+    cl_int alias;
+} light_alias;
+
+light make_point_light(vector4 pos, vector4 color, float range);
+
+light make_sphere_light(vector4 pos, float radius, vector4 color, float range);
+
+light make_triangle_light(vector4 p1, vector4 p2, vector4 p3, vector4 color, float range);
+
+/**
+ Reads a list of lights from a text file. Each line describes
+ a single light as one of:
+    point x y z r g b range
+    sphere x y z radius r g b range
+    triangle x1 y1 z1 x2 y2 z2 x3 y3 z3 r g b range
+ Empty lines and lines starting with '#' are ignored.
+ The caller will be responsible for freeing the returned memory.
+ \param filename Name of the file to read.
+ \param count (output) The number of lights read.
+ \return Array of 'count' lights.
+ */
+light * load_lights(const char * filename, size_t * count);
+
+/**
+ Estimates the power of each light, normalizes those into the
+ selection probability 'pdf' of each light and builds the alias
+ table (Vose's method) used to sample them.
+ \param lights Array of 'count' lights, each 'pdf' will be updated.
+ \param count The number of lights.
+ \param table (output) Array of 'count' alias table entries.
+ */
+void build_light_table(light * lights, size_t count, light_alias * table);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "model.h"
+#include "camera.h"
+#include "host_buffer.h"
+#include "arena.h"
+#include "thread_pool.h"
+
+// levels kept per mesh at most, level 0 being the imported mesh
+#define LOD_LEVELS 5
+
+// fraction of the previous level's triangles each level aims for
+#define LOD_REDUCTION 0.25f
+
+// meshes and levels with this many triangles are not simplified further
+#define LOD_MIN_TRIANGLES 64
+
+// screen area a triangle of the selected level should cover at least
+#define LOD_PIXELS_PER_TRIANGLE 4.0f
+
+/**
+ The levels of detail of one imported mesh, every level is a run of
+ triangle records in the level pool.
+ */
+typedef struct {
+    // bounding sphere, for the projected size
+    vector4 center;
+    float radius;
+
+    cl_ushort material_id;
+    unsigned level_count;
+    size_t first[LOD_LEVELS];   // first triangle of each level in the pool
+    size_t count[LOD_LEVELS];   // triangles of each level
+} lod_mesh;
+
+/**
+ Every level of every mesh of a model on the device, along with the
+ level currently selected for each mesh.
+ */
+typedef struct {
+    lod_mesh * meshes;
+    size_t mesh_count;
+
+    // TRIANGLE_SIZE floats per triangle, meshes and levels in order
+    host_buffer pool;
+
+    unsigned * selected;        // level of every mesh
+    size_t first_changed;       // first mesh whose level changed, see select_lods(...)
+    vector4 changed_lo;         // bounds of the meshes whose level changed
+    vector4 changed_hi;
+    size_t triangle_count;      // triangles of the selected levels
+
+    arena memory;
+} lod_scene;
+
+/**
+ Simplifies every mesh of 'm' into a chain of levels by quadric error
+ edge collapse, each with about LOD_REDUCTION of the triangles of the
+ one before, and uploads all levels into the level pool. Collapses
+ that would flip a triangle are skipped and open borders are kept in
+ place. The meshes are simplified in parallel on 'pool'.
+ \param m Imported model, its triangles and material ids still mapped.
+ \param pool Pool running the simplification, NULL for the calling thread.
+ \param lods (output) The levels, release with release_lods(...).
+ */
+void build_lods(const model * m, thread_pool * pool, lod_scene * lods);
+
+/**
+ Picks the level of every mesh from the size of its bounding sphere
+ projected by 'camera', the finest level whose triangles each cover
+ at least LOD_PIXELS_PER_TRIANGLE pixels.
+ \param camera The camera the frame is rendered from.
+ \param width Width of the rendered image in pixels.
+ \return true if the level of any mesh changed.
+ */
+bool select_lods(lod_scene * lods, const cam_data * camera, unsigned width);
+
+/**
+ Enqueues copies of the selected levels into the scene geometry,
+ starting at the first mesh whose level changed.
+ \param surfaces Triangle records with room for every level 0 triangle.
+ \param material_ids Material index of every triangle, as large.
+ \return Triangles in the selection, lods->triangle_count.
+ */
+size_t enqueue_lods(lod_scene * lods, cl_mem surfaces, cl_mem material_ids);
+
+/**
+ Releases all memory allocated by build_lods(...).
+ */
+void release_lods(lod_scene * lods);
+
+#endif
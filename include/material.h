@@ -23,8 +23,14 @@ typedef struct {
 
     cl_float reflect;
     cl_float refract;
+
+    cl_float ior; // index of refraction of the transmitted share
+    cl_float padding[3];
 } material;
 
+// index of refraction of materials that do not specify one, glass
+#define DEFAULT_IOR 1.5f
+
 /**
  Utility method that generates a random material.
  */
@@ -6,7 +6,117 @@
 #include <stdbool.h>
 
 #include "surface.h"
+#include "material.h"
+#include "host_buffer.h"
+#include "arena.h"
+#include "thread_pool.h"
 
-cl_float * importModel(const char * filename, size_t * triangle_count);
+/**
+ Triangles of a single imported mesh, which all share one material.
+ */
+typedef struct {
+    size_t first;
+    size_t count;
+} mesh_range;
+
+/**
+ Geometry and materials of an imported model, ready to be
+ uploaded to the ray tracer. Triangles reference a small
+ deduplicated material table by index.
+
+ Triangles and material ids are imported straight into mapped device
+ buffers, unmap them before kernels read the buffers. The pointers are
+ only valid while mapped.
+ */
+typedef struct {
+    cl_float * surfaces;        // TRIANGLE_SIZE floats per triangle
+    cl_ushort * material_ids;   // index into 'materials' for each triangle
+    material * materials;
+
+    // consecutive triangles of every mesh, in order
+    mesh_range * meshes;
+
+    host_buffer surface_buffer;
+    host_buffer material_id_buffer;
+
+    // the material table and import scratch, freed in one go
+    arena memory;
+
+    size_t triangle_count;
+    size_t mesh_count;
+    size_t material_count;
+    size_t material_capacity;
+} model;
+
+struct asset;
+
+/**
+ Files being imported by begin_import(...), not placed in a model yet.
+ */
+typedef struct {
+    struct asset * assets;
+    size_t count;
+    thread_pool * pool;
+    double start;
+} model_import;
+
+/**
+ Imports every mesh in the given file as triangles, along with
+ the materials they use. Identical materials are merged.
+ Requires init_cl(...) for the geometry buffers.
+ \param filename Name of the file to import.
+ \param m (output) The imported model, release with release_model(...).
+ \return false if the file could not be imported.
+ */
+bool importModel(const char * filename, model * m);
+
+/**
+ Imports several files into a single model, as importModel(...) does
+ for one. The files are imported concurrently, then their faces are
+ converted in chunks written straight to their place in the model, so
+ the load time scales with the number of threads. Triangles keep the
+ order of the files.
+ \param filenames Names of the files to import.
+ \param count Number of files.
+ \param pool Pool running the imports, NULL to import on the calling thread.
+ \param m (output) The imported model, release with release_model(...).
+ \return false if any of the files could not be imported.
+ */
+bool import_models(const char ** filenames, size_t count, thread_pool * pool, model * m);
+
+/**
+ Starts the first half of import_models(...): the files are read and
+ parsed on 'pool' and their materials converted. None of it needs an
+ OpenCL context, so the window and the context may be created while
+ the files load.
+ \param filenames Names of the files to import, kept until finish_import(...).
+ \param count Number of files.
+ \param pool Pool running the imports, NULL to import on the calling thread.
+ \param import (output) The files being imported.
+ */
+void begin_import(const char ** filenames, size_t count, thread_pool * pool, model_import * import);
+
+/**
+ Waits for every task on the pool of 'import', then places the files in
+ one model as import_models(...) does. Requires init_cl_context() for
+ the geometry buffers.
+ \param import Files started by begin_import(...).
+ \param m (output) The imported model, release with release_model(...).
+ \return false if any of the files could not be imported.
+ */
+bool finish_import(model_import * import, model * m);
+
+/**
+ Finds 'mat' in the material table, appending it if no identical
+ material exists yet.
+ \return Index of the material in m->materials.
+ */
+cl_ushort add_material(model * m, material mat);
+
+/**
+ Frees all memory allocated by importModel(...), the geometry
+ buffers stay alive for as long as they have been retained.
+ */
+void release_model(model * m);
 
 #endif
@@ -0,0 +1,76 @@
+#ifndef NBODY_H
+#define NBODY_H
+
+#include <stddef.h>
+
+#include "cl_util.h"
+
+// solvers selected by set_nbody_solver(...)
+#define NBODY_DIRECT 0  // tiled all-pairs, O(n^2) per step
+#define NBODY_TREE 1    // Barnes-Hut over a device built BVH, O(n log n) per step
+
+/**
+ Creates the nbody kernel and the device buffers for a simulation
+ of n bodies, initialized as a rotating disk of equal mass bodies.
+ The program built by init_cl(...) must include nbody_sim.cl.
+ The body count is padded to a multiple of the work group size
+ with massless bodies, these do not affect the simulation.
+ \param n Number of simulated bodies.
+ */
+void init_nbody(size_t n);
+
+/**
+ Selects the solver used by step_nbody(...), the direct
+ solver is used until this is called. The program must
+ include lbvh.cl for the tree solver.
+ \param solver NBODY_DIRECT or NBODY_TREE.
+ \param theta Opening angle of the tree solver, ignored by the direct solver.
+ */
+void set_nbody_solver(int solver, float theta);
+
+/**
+ Enqueues 'steps' timesteps of the simulation. Positions ping-pong
+ between two device buffers, so no host synchronization is needed
+ between steps, or when this function returns.
+ \param steps Number of timesteps to enqueue.
+ \param delta Length of a single timestep.
+ */
+void step_nbody(unsigned steps, float delta);
+
+/**
+ Device buffer holding the float4 {x, y, z, mass} positions written
+ by the most recently enqueued timestep.
+ */
+cl_mem nbody_positions();
+
+/**
+ Number of simulated bodies, the first entries of nbody_positions().
+ The buffer holds additional massless padding bodies after these.
+ */
+size_t nbody_count();
+
+/**
+ Runs 'steps' timesteps back-to-back and prints the elapsed
+ time together with the number of pairwise interactions
+ evaluated per second.
+ \param steps Number of timesteps to time.
+ \param delta Length of a single timestep.
+ */
+void benchmark_nbody(unsigned steps, float delta);
+
+/**
+ Runs a single step of both solvers from the current state and
+ prints the error of the tree solver relative to the direct one,
+ then benchmarks each solver for 'steps' timesteps.
+ \param steps Number of timesteps to time for each solver.
+ \param delta Length of a single timestep.
+ \param theta Opening angle of the tree solver.
+ */
+void compare_nbody(unsigned steps, float delta, float theta);
+
+/**
+ Releases all memory allocated by init_nbody(...).
+ */
+void release_nbody();
+
+#endif
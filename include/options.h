@@ -0,0 +1,103 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ Runtime configuration of the renderer, filled in from the
+ command line by parse_options(...). Fields not given on the
+ command line keep their default values.
+ */
+typedef struct {
+    // files imported into the scene, in order
+    const char ** model_files;
+    size_t model_count;
+
+    // file read by load_lights(...), NULL for the default animated light
+    const char * light_file;
+    unsigned light_samples;
+
+    // bounces of a path at most, russian roulette usually ends it sooner
+    unsigned max_depth;
+
+    // store the scene as quantized triangles, see compress.h
+    bool compressed_geometry;
+
+    // trace the triangles through a BVH built on the device, see lbvh.h
+    bool use_bvh;
+
+    // build the BVH on the host instead, see sah_bvh.h
+    bool sah_bvh;
+    bool spatial_splits;
+    unsigned threads; // 0 for one per processor
+
+    // swap in simplified meshes by their size on screen, see lod.h
+    bool lod;
+
+    // trace reflections in a second pass sorted by direction, see reorder.h
+    bool reorder_rays;
+
+    // cache indirect diffuse light in a hashed world space grid, see irradiance.h
+    bool irradiance_cache;
+
+    // cull the local memory surfaces per tile for primary rays
+    bool tile_culling;
+
+    // launch only enough work groups to fill the device, which then
+    // take tiles from a global counter (ray_tracer_persistent)
+    bool persistent_threads;
+
+    // time the work group sizes again instead of using TUNE_CACHE
+    bool retune;
+
+    // frames averaged while the view is still, 0 or 1 to disable
+    unsigned progressive_frames;
+
+    // scale of the linear radiance before the tonemap pass, see tonemap.h
+    float exposure;
+
+    // threshold used by detect_edges(...) when adaptive_aa is enabled
+    float edge_threshold;
+
+    // render the keyframes of this file without a window, see batch.h
+    const char * batch_file;
+    unsigned batch_frames; // 0 for one frame per keyframe
+    const char * output_prefix;
+    int output_format;
+
+    // render the batch on worker processes connecting to this
+    // address instead of the local device, see distribute.h
+    const char * listen_address;
+    unsigned workers;
+
+    // render tiles for the coordinator at this address
+    const char * worker_address;
+
+    // headless n-body benchmark when non zero, see nbody.h
+    size_t nbody_count;
+    unsigned nbody_steps;
+    float nbody_timestep;
+
+    // NBODY_DIRECT or NBODY_TREE from nbody.h, compare runs both
+    int nbody_solver;
+    bool nbody_compare;
+    float nbody_theta;
+
+    // render the simulation as spheres instead of benchmarking it
+    bool nbody_show;
+    float body_radius; // 0 picks a radius from the body count
+} app_options;
+
+extern app_options options;
+
+/**
+ Parses the command line arguments into 'options' (and the
+ related globals such as sample_rate). Unknown arguments
+ print the usage string and terminate with EXIT_FAILURE.
+ \param argc Argument count as passed to main(...).
+ \param argv Argument values as passed to main(...).
+ */
+void parse_options(int argc, const char ** argv);
+
+#endif
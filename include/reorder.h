@@ -0,0 +1,59 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include "vector.h"
+#include "cl_util.h"
+
+// sort key bits written by the ray_tracer kernel, must match ray_tracer.cl
+#define RAY_KEY_BITS 28
+
+/**
+ Reflection ray left by the ray_tracer kernel for trace_bounces.
+ The format of this struct aligns with the 'bounce_ray' struct in
+ the OpenCL code for the ray tracer.
+ */
+typedef struct {
+    vector4 origin;
+    vector4 direction;
+    vector4 color;
+    cl_float reflect;
+    cl_float padding[3];
+} bounce_ray;
+
+/**
+ Kernel tracing the reflection rays in sorted order. It shares
+ the camera and scene arguments (see kernel_args.h) of the
+ ray_tracer kernel, the caller is responsible for setting those.
+ */
+extern cl_kernel bounce_kernel;
+
+/**
+ Creates the ray reordering kernel and buffers for a w * h
+ output and binds them to the ray_tracer kernel, which then
+ leaves its reflection rays to render_reorder(...).
+ \param w Width of the output image.
+ \param h Height of the output image.
+ \param lo Lower corner of the scene bounds.
+ \param hi Upper corner of the scene bounds.
+ */
+void init_reorder(unsigned w, unsigned h, vector4 lo, vector4 hi);
+
+/**
+ Binds empty reordering arguments to the ray_tracer kernel,
+ which then traces every bounce itself.
+ */
+void disable_reorder();
+
+/**
+ Enqueues the sort of the reflection rays and the pass tracing
+ them. Must be called after the ray_tracer kernel has been
+ enqueued while the output image is still acquired.
+ */
+void render_reorder();
+
+/**
+ Releases all memory allocated by init_reorder(...).
+ */
+void release_reorder();
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef SAH_BVH_H
+#define SAH_BVH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lbvh.h"
+#include "thread_pool.h"
+
+/**
+ Builds a BVH over triangle records (see make_triangle(...)) on the
+ host, choosing every split by the surface area heuristic evaluated
+ over binned centroids. Subtrees above a size threshold are built as
+ tasks on 'pool'.
+
+ With spatial_splits, long thin triangles may also be split between
+ both children (their references clipped to either side of the plane)
+ when that is cheaper than any object split, within a budget of
+ extra references.
+
+ The result uses the device BVH node format (see lbvh.h): one triangle
+ per leaf, nodes in depth first order so a left child directly follows
+ its parent, and escape links for the stackless traversal in ray_tracer.cl.
+
+ \param surfaces Triangle records, TRIANGLE_SIZE floats each.
+ \param triangle_count Number of triangle records, at least one,
+        terminates with EXIT_FAILURE otherwise.
+ \param spatial_splits Allow splitting triangle references.
+ \param pool Thread pool running the subtree builds.
+ \param node_count (output) Number of nodes in the returned array.
+ \return The node array, the root first. The caller is responsible for freeing it.
+ */
+bvh_node * build_sah_bvh(const cl_float * surfaces, size_t triangle_count,
+                         bool spatial_splits, thread_pool * pool, size_t * node_count);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef void (*task_func)(void * arg);
+
+typedef struct task {
+    task_func func;
+    void * arg;
+    struct task * next;
+} task;
+
+/**
+ Fixed set of worker threads executing tasks in submission order.
+ Tasks may submit further tasks, wait_thread_pool(...) returns
+ once all of them have finished.
+ */
+typedef struct {
+    pthread_t * threads;
+    unsigned n_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+
+    // queued tasks, popped from head and appended at tail
+    task * head;
+    task * tail;
+
+    // tasks submitted but not yet finished
+    unsigned pending;
+    bool stopping;
+} thread_pool;
+
+/**
+ Starts a pool of worker threads.
+ \param n_threads Number of workers, 0 for one per online processor.
+ \return The new pool, release it with release_thread_pool(...).
+ */
+thread_pool * create_thread_pool(unsigned n_threads);
+
+/**
+ Queues func(arg) to run on one of the workers.
+ \param pool The pool to run the task on.
+ \param func Function to call.
+ \param arg Argument passed to func, owned by the caller.
+ */
+void submit_task(thread_pool * pool, task_func func, void * arg);
+
+/**
+ Blocks until every submitted task, including the tasks
+ they submitted themselves, has finished.
+ */
+void wait_thread_pool(thread_pool * pool);
+
+/**
+ Waits for all tasks to finish, then stops and frees the pool.
+ */
+void release_thread_pool(thread_pool * pool);
+
+#endif
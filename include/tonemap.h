@@ -0,0 +1,44 @@
+#ifndef TONEMAP_H
+#define TONEMAP_H
+
+#include "cl_util.h"
+
+// encodings of the tonemap kernel output, must match ray_tracer.cl
+#define TONEMAP_DISPLAY 0   // filmic curve and sRGB encoding, for 8 bit outputs
+#define TONEMAP_LINEAR  1   // exposure only, for half float outputs
+
+/**
+ Creates the HDR frame the scene kernels render into and the tonemap
+ kernel resolving it into a compact w * h output. Frames rendered at
+ scale * scale samples per pixel are box filtered by the kernel, and
+ the frames of a still view may be averaged over several frames.
+ \param w Width of the output image.
+ \param h Height of the output image.
+ \param scale Samples per output pixel along each axis.
+ */
+void init_tonemap(unsigned w, unsigned h, unsigned scale);
+
+/**
+ Float RGBA image of w * scale by h * scale pixels the scene kernels
+ write a single frame to, set it as their ARG_OUTPUT.
+ */
+cl_mem tonemap_frame();
+
+/**
+ Enqueues the tonemap kernel, adding the latest frame to the sum of
+ the earlier ones and writing their mean, scaled by 'exposure' and
+ encoded by 'encoding', to 'output'. Must be called after the scene
+ kernels while 'output' is acquired.
+ \param output RGBA8 or half float image of w * h pixels.
+ \param encoding TONEMAP_DISPLAY or TONEMAP_LINEAR.
+ \param exposure Factor applied to the linear radiance.
+ \param count Frames in the mean including the latest, 1 restarts it.
+ */
+void render_tonemap(cl_mem output, int encoding, float exposure, unsigned count);
+
+/**
+ Releases all memory allocated by init_tonemap(...).
+ */
+void release_tonemap();
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef TUNER_H
+#define TUNER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cl_util.h"
+
+// tuned sizes of earlier runs, relative to the working directory
+#define TUNE_CACHE "work_groups.cache"
+
+// timed frames per candidate, after one untimed warm up frame
+#define TUNE_FRAMES 3
+
+/**
+ Renders a frame with the given 2D work group size and waits for it.
+ */
+typedef void (*tune_func)(const size_t * local);
+
+/**
+ Picks the 2D work group size of kernel 'k' for a w x h launch.
+
+ Every power of two shape within the kernel and device limits whose
+ size is a multiple of the kernel's preferred work group size multiple
+ is timed on 'render', and the fastest is stored in TUNE_CACHE under
+ the device, driver, 'variant' and resolution. Later runs with the same
+ key read it back without timing anything.
+
+ \param k Kernel launched by 'render', queried for its limits.
+ \param variant Names the kernel and its build options in the cache.
+ \param w Width of the launch.
+ \param h Height of the launch.
+ \param retune Time the candidates even if the cache has a result.
+ \param render Renders a frame with a candidate size.
+ \param local (output) The chosen work group size.
+ */
+void tune_work_group(cl_kernel k, const char * variant, size_t w, size_t h,
+                     bool retune, tune_func render, size_t * local);
+
+#endif
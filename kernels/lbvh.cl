@@ -0,0 +1,435 @@
+/* ---------------------------------------------------
+ Linear BVH built entirely on the device.
+
+ The caller fills one bvh_node per primitive with its
+ bounds, then the host enqueues (see lbvh.c):
+   centroid_bounds, morton_codes, 8 passes of
+   radix_histogram / radix_scan / radix_scatter,
+   lbvh_hierarchy, lbvh_refit.
+
+ The 2n - 1 nodes are stored Karras style, internal
+ node k at index k (the root at 0) and the leaf for
+ the k-th sorted primitive at index n - 1 + k. Every
+ node links to the node following its subtree so the
+ tree can be walked without a stack:
+
+   node = 0;
+   while (node >= 0) {
+       if (visit(nodes[node]) && left child) node = child;
+       else node = escape;
+   }
+ --------------------------------------------------- */
+
+// work group size of the build kernels, matches lbvh.h
+#define LBVH_GROUP 128
+// tiles of LBVH_GROUP keys sorted by each radix work group
+#define LBVH_TILES 32
+
+#define LBVH_RADIX_BITS 4
+#define LBVH_RADIX 16
+
+typedef struct {
+    float4 lo; // w = as_float(left child), or -(primitive + 1) for leaves
+    float4 hi; // w = as_float(escape node), -1 past the end of the tree
+} bvh_node;
+
+int bvh_child(bvh_node node) { return as_int(node.lo.w); }
+int bvh_escape(bvh_node node) { return as_int(node.hi.w); }
+
+/**
+ Maps a float to a uint with the same ordering, so
+ atomic_min and atomic_max can reduce floats.
+ */
+uint float_to_ordered(float f) {
+    uint u = as_uint(f);
+    return u ^ ((u >> 31) ? 0xffffffffu : 0x80000000u);
+}
+
+float ordered_to_float(uint u) {
+    return as_float(u ^ ((u >> 31) ? 0x80000000u : 0xffffffffu));
+}
+
+/**
+ Spreads the lower 10 bits of v so there are two
+ zero bits between each of them.
+ */
+uint expand_bits(uint v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/**
+ Length of the common prefix of the sorted keys i and j,
+ -1 when j is out of range. Equal keys fall back to
+ comparing their indices so every key is unique.
+ */
+int lbvh_delta(__global const uint * keys, int n, int i, int j) {
+    if (j < 0 || j >= n) {
+        return -1;
+    }
+
+    uint a = keys[i];
+    uint b = keys[j];
+    return a == b ? 32 + (int)clz((uint)(i ^ j)) : (int)clz(a ^ b);
+}
+
+/**
+ Escape link of any node whose range ends at sorted key 'last'.
+ The escape is the right sibling of the ancestor split right
+ after 'last', which is internal node last + 1 when that
+ sibling covers more than one key, and leaf last + 1 otherwise.
+ */
+int lbvh_escape(__global const uint * keys, int n, int last) {
+    if (last == n - 1) {
+        return -1;
+    }
+
+    return lbvh_delta(keys, n, last, last + 1) < lbvh_delta(keys, n, last + 1, last + 2) ?
+        last + 1 : n + last;
+}
+
+/**
+ Bounds of n points, or spheres of the given radius.
+ The w component of each point is ignored.
+ */
+__kernel void point_bounds(__global const float4 * points, float radius, int n,
+                           __global bvh_node * prims) {
+    int i = get_global_id(0);
+    if (i >= n) {
+        return;
+    }
+
+    float4 p = points[i];
+    p.w = 0.0f;
+    prims[i].lo = p - (float4)(radius, radius, radius, 0.0f);
+    prims[i].hi = p + (float4)(radius, radius, radius, 0.0f);
+}
+
+/**
+ Reduces the bounds of the primitive centroids into bounds[6],
+ {min x, y, z, max x, y, z} as float_to_ordered(...) values.
+ The host resets bounds before each build.
+ */
+__kernel void centroid_bounds(__global const bvh_node * prims, int n,
+                              __global uint * bounds) {
+    __local float4 lo[LBVH_GROUP];
+    __local float4 hi[LBVH_GROUP];
+
+    int i = get_global_id(0);
+    int lid = get_local_id(0);
+
+    if (i < n) {
+        float4 c = 0.5f * (prims[i].lo + prims[i].hi);
+        lo[lid] = c;
+        hi[lid] = c;
+    } else {
+        lo[lid] = (float4)(INFINITY);
+        hi[lid] = (float4)(-INFINITY);
+    }
+
+    for (int s = LBVH_GROUP / 2; s > 0; s >>= 1) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < s) {
+            lo[lid] = fmin(lo[lid], lo[lid + s]);
+            hi[lid] = fmax(hi[lid], hi[lid + s]);
+        }
+    }
+
+    // one set of atomics per work group
+    if (lid == 0) {
+        atomic_min(&bounds[0], float_to_ordered(lo[0].x));
+        atomic_min(&bounds[1], float_to_ordered(lo[0].y));
+        atomic_min(&bounds[2], float_to_ordered(lo[0].z));
+        atomic_max(&bounds[3], float_to_ordered(hi[0].x));
+        atomic_max(&bounds[4], float_to_ordered(hi[0].y));
+        atomic_max(&bounds[5], float_to_ordered(hi[0].z));
+    }
+}
+
+/**
+ 30-bit Morton code of each primitive centroid within the scene bounds,
+ values are initialized to the primitive indices.
+ */
+__kernel void morton_codes(__global const bvh_node * prims, int n,
+                           __global const uint * bounds,
+                           __global uint * keys, __global uint * values) {
+    int i = get_global_id(0);
+    if (i >= n) {
+        return;
+    }
+
+    float3 lo = (float3)(ordered_to_float(bounds[0]),
+                         ordered_to_float(bounds[1]),
+                         ordered_to_float(bounds[2]));
+    float3 hi = (float3)(ordered_to_float(bounds[3]),
+                         ordered_to_float(bounds[4]),
+                         ordered_to_float(bounds[5]));
+
+    float3 c = 0.5f * (prims[i].lo.xyz + prims[i].hi.xyz);
+    float3 extent = fmax(hi - lo, (float3)(1e-20f));
+    uint3 q = convert_uint3(clamp((c - lo) / extent * 1024.0f, 0.0f, 1023.0f));
+
+    keys[i] = expand_bits(q.x) * 4 + expand_bits(q.y) * 2 + expand_bits(q.z);
+    values[i] = i;
+}
+
+/**
+ Counts the LBVH_RADIX_BITS wide digit at 'shift' for each block of
+ LBVH_GROUP * LBVH_TILES keys. Counts are stored digit major,
+ hist[digit * n_groups + group], so an exclusive scan of hist gives
+ the first output position of every (digit, group) pair.
+ */
+__kernel void radix_histogram(__global const uint * keys, int n, int shift,
+                              __global uint * hist) {
+    __local uint count[LBVH_RADIX];
+
+    int lid = get_local_id(0);
+    int group = get_group_id(0);
+    int start = group * LBVH_GROUP * LBVH_TILES;
+
+    if (lid < LBVH_RADIX) {
+        count[lid] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int t = 0; t < LBVH_TILES; t++) {
+        int i = start + t * LBVH_GROUP + lid;
+        if (i < n) {
+            atomic_inc(&count[(keys[i] >> shift) & (LBVH_RADIX - 1)]);
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid < LBVH_RADIX) {
+        hist[lid * get_num_groups(0) + group] = count[lid];
+    }
+}
+
+/**
+ Exclusive prefix sum of the m histogram entries in place.
+ Launched as a single work group of LBVH_GROUP items.
+ */
+__kernel void radix_scan(__global uint * hist, int m) {
+    __local uint sums[LBVH_GROUP];
+
+    int lid = get_local_id(0);
+    int chunk = (m + LBVH_GROUP - 1) / LBVH_GROUP;
+    int start = min(lid * chunk, m);
+    int end = min(start + chunk, m);
+
+    uint sum = 0;
+    for (int i = start; i < end; i++) {
+        sum += hist[i];
+    }
+    sums[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // inclusive scan of the per item sums
+    for (int offset = 1; offset < LBVH_GROUP; offset <<= 1) {
+        uint v = lid >= offset ? sums[lid - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        sums[lid] += v;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    uint running = sums[lid] - sum;
+    for (int i = start; i < end; i++) {
+        uint c = hist[i];
+        hist[i] = running;
+        running += c;
+    }
+}
+
+uint radix_lane(uint4 v, uint lane) {
+    return lane == 0 ? v.x : lane == 1 ? v.y : lane == 2 ? v.z : v.w;
+}
+
+/**
+ Stable scatter of the keys (and their values) by the digit at 'shift'.
+ Each tile ranks its keys with one scan of 16 packed 8 bit counters,
+ LBVH_GROUP is at most 255 so no counter overflows into its neighbour.
+ */
+__kernel void radix_scatter(__global const uint * keys_in, __global const uint * values_in,
+                            int n, int shift, __global const uint * hist,
+                            __global uint * keys_out, __global uint * values_out) {
+    __local uint4 scan[LBVH_GROUP];
+    __local uint base[LBVH_RADIX];
+
+    int lid = get_local_id(0);
+    int group = get_group_id(0);
+    int start = group * LBVH_GROUP * LBVH_TILES;
+
+    if (lid < LBVH_RADIX) {
+        base[lid] = hist[lid * get_num_groups(0) + group];
+    }
+
+    for (int t = 0; t < LBVH_TILES; t++) {
+        int i = start + t * LBVH_GROUP + lid;
+        bool valid = i < n;
+        uint key = valid ? keys_in[i] : 0;
+        uint digit = (key >> shift) & (LBVH_RADIX - 1);
+        uint lane = digit >> 2;
+        uint bits = 8 * (digit & 3);
+
+        uint one = valid ? 1u << bits : 0;
+        uint4 flag = (uint4)(lane == 0 ? one : 0, lane == 1 ? one : 0,
+                             lane == 2 ? one : 0, lane == 3 ? one : 0);
+
+        scan[lid] = flag;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int offset = 1; offset < LBVH_GROUP; offset <<= 1) {
+            uint4 v = lid >= offset ? scan[lid - offset] : (uint4)(0);
+            barrier(CLK_LOCAL_MEM_FENCE);
+            scan[lid] += v;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        // keys before this one in the tile with the same digit
+        uint rank = (radix_lane(scan[lid] - flag, lane) >> bits) & 0xff;
+        uint4 total = scan[LBVH_GROUP - 1];
+
+        if (valid) {
+            uint dst = base[digit] + rank;
+            keys_out[dst] = key;
+            values_out[dst] = values_in[i];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if (lid < LBVH_RADIX) {
+            base[lid] += (radix_lane(total, lid >> 2) >> (8 * (lid & 3))) & 0xff;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+/**
+ Builds the Karras hierarchy over the n sorted keys, one work
+ item per key. Item i writes leaf i and, when i < n - 1,
+ internal node i. Bounds of internal nodes are left for
+ lbvh_refit(...).
+ */
+__kernel void lbvh_hierarchy(__global const uint * keys, __global const uint * values, int n,
+                             __global const bvh_node * prims, __global bvh_node * nodes,
+                             __global int * parents, __global uint * flags) {
+    int i = get_global_id(0);
+    if (i >= n) {
+        return;
+    }
+
+    if (i == 0) {
+        parents[0] = -1;
+    }
+
+    int prim = values[i];
+    bvh_node leaf = prims[prim];
+    leaf.lo.w = as_float(-(prim + 1));
+    leaf.hi.w = as_float(lbvh_escape(keys, n, i));
+    nodes[n - 1 + i] = leaf;
+
+    if (i >= n - 1) {
+        return;
+    }
+    flags[i] = 0;
+
+    // direction of the range covered by this node
+    int d = lbvh_delta(keys, n, i, i + 1) > lbvh_delta(keys, n, i, i - 1) ? 1 : -1;
+    int delta_min = lbvh_delta(keys, n, i, i - d);
+
+    // upper bound on the range length, then binary search for the other end
+    int l_max = 2;
+    while (lbvh_delta(keys, n, i, i + l_max * d) > delta_min) {
+        l_max *= 2;
+    }
+
+    int l = 0;
+    for (int t = l_max / 2; t >= 1; t /= 2) {
+        if (lbvh_delta(keys, n, i, i + (l + t) * d) > delta_min) {
+            l += t;
+        }
+    }
+    int j = i + l * d;
+
+    // binary search for the split position
+    int delta_node = lbvh_delta(keys, n, i, j);
+    int s = 0;
+    for (int div = 2; ; div *= 2) {
+        int t = (l + div - 1) / div;
+        if (lbvh_delta(keys, n, i, i + (s + t) * d) > delta_node) {
+            s += t;
+        }
+        if (t <= 1) {
+            break;
+        }
+    }
+    int split = i + s * d + min(d, 0);
+
+    int first = min(i, j);
+    int last = max(i, j);
+    int left = first == split ? n - 1 + split : split;
+    int right = last == split + 1 ? n + split : split + 1;
+    parents[left] = i;
+    parents[right] = i;
+
+    bvh_node node;
+    node.lo = (float4)(0.0f, 0.0f, 0.0f, as_float(left));
+    node.hi = (float4)(0.0f, 0.0f, 0.0f, as_float(lbvh_escape(keys, n, last)));
+    nodes[i] = node;
+}
+
+/**
+ Computes the bounds of internal nodes bottom up, one work item per leaf.
+ The first child to reach a parent stops, the second one has both child
+ bounds available and continues upwards. If node_mass is not NULL the
+ {center of mass, total mass} of every node is accumulated the same way
+ from the per primitive {position, mass} in prim_mass.
+ */
+__kernel void lbvh_refit(int n, __global volatile bvh_node * nodes,
+                         __global const int * parents, __global volatile uint * flags,
+                         __global const float4 * prim_mass,
+                         __global volatile float4 * node_mass) {
+    int i = get_global_id(0);
+    if (i >= n) {
+        return;
+    }
+
+    int node = n - 1 + i;
+    if (node_mass) {
+        node_mass[node] = prim_mass[-as_int(nodes[node].lo.w) - 1];
+    }
+
+    int parent = parents[node];
+    while (parent >= 0) {
+        // publish this subtree before the sibling can read it
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        if (atomic_inc(&flags[parent]) == 0) {
+            return;
+        }
+
+        int left = as_int(nodes[parent].lo.w);
+        int right = as_int(nodes[left].hi.w);
+        bvh_node a = nodes[left];
+        bvh_node b = nodes[right];
+
+        float4 lo = fmin(a.lo, b.lo);
+        float4 hi = fmax(a.hi, b.hi);
+        lo.w = nodes[parent].lo.w;
+        hi.w = nodes[parent].hi.w;
+        nodes[parent].lo = lo;
+        nodes[parent].hi = hi;
+
+        if (node_mass) {
+            float4 ma = node_mass[left];
+            float4 mb = node_mass[right];
+            float m = ma.w + mb.w;
+            float4 com = m > 0.0f ? (ma * ma.w + mb * mb.w) / m : 0.5f * (ma + mb);
+            com.w = m;
+            node_mass[parent] = com;
+        }
+
+        parent = parents[parent];
+    }
+}
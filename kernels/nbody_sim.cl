@@ -8,6 +8,10 @@
  The parameter pblock points to local memory on the
  compute device and will be used to cache positions
  for reuse on later iterations.
+ 
+ The global size must be a multiple of the local size,
+ the host pads the data set with massless particles.
+ See nbody_tree(...) below for the O(n log n) solver.
  --------------------------------------------------- */
 __kernel void nbody(
         float delta, float eps,
@@ -32,7 +36,7 @@ __kernel void nbody(
     // for each block
     for (int j_block = 0; j_block < n_blocks; j_block++) {
         // cache one particle position
-        pblock[i_local] = pos_old[j_block * n_local * i_local];
+        pblock[i_local] = pos_old[j_block * n_local + i_local];
 
         // wait for the rest of the work group to finish
         barrier(CLK_LOCAL_MEM_FENCE);
@@ -50,13 +54,69 @@ __kernel void nbody(
         }
 
         barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // apply the acceleration once every block has been accumulated
+    p += v_delta * v + 0.5f * v_delta * v_delta * a;
+    v += v_delta * a;
 
-        // apply the acceleration
-        p += v_delta * v + 0.5f * v_delta * v_delta * a;
-        v += v_delta * a;
+    // update the global data representation, pos_old is still
+    // being read by other work groups so positions go to pos_new
+    pos_new[i] = p;
+    cur_vel[i] = v;
+}
+/* ---------------------------------------------------
+ Barnes-Hut variant of nbody(...), O(n log n) per step.
+ Walks the linear BVH built over pos_old (see lbvh.cl)
+ without a stack, a node whose largest extent is less
+ than theta times its distance from the body is treated
+ as a single body at its center of mass (node_mass).
+ Smaller theta is more accurate, theta = 0 visits every
+ leaf and matches the all-pairs kernel.
+ --------------------------------------------------- */
+__kernel void nbody_tree(
+        float delta, float eps, float theta,
+        __global const float4 * pos_old,
+        __global float4 * pos_new,
+        __global float4 * cur_vel,
+        __global const bvh_node * nodes,
+        __global const float4 * node_mass
+    ) {
+
+    const float4 v_delta = (float4){delta, delta, delta, 0.0};
+    const float theta2 = theta * theta;
+    int i = get_global_id(0);
 
-        // update the global data representation
-        pos_new[i] = p;
-        cur_vel[i] = v;
+    float4 p = pos_old[i];
+    float4 v = cur_vel[i];
+    float4 a = (float4){0.0, 0.0, 0.0, 0.0};
+
+    int node = 0;
+    while (node >= 0) {
+        bvh_node b = nodes[node];
+        float4 m = node_mass[node];
+
+        float4 d = m - p;
+        d.w = 0.0f;
+        float dist2 = d.x * d.x + d.y * d.y + d.z * d.z + eps;
+
+        float4 extent = b.hi - b.lo;
+        float size = fmax(extent.x, fmax(extent.y, extent.z));
+
+        if (bvh_child(b) < 0 || size * size < theta2 * dist2) {
+            // far enough away (or a single body), skip the subtree
+            float invr = rsqrt(dist2);
+            a += m.w * (invr * invr * invr) * d;
+            node = bvh_escape(b);
+        } else {
+            node = bvh_child(b);
+        }
     }
-}
\ No newline at end of file
+
+    // apply the acceleration
+    p += v_delta * v + 0.5f * v_delta * v_delta * a;
+    v += v_delta * a;
+
+    pos_new[i] = p;
+    cur_vel[i] = v;
+}
@@ -9,6 +9,34 @@
 #define PLANE_SIZE 9
 #define TRIANGLE_SIZE 13
 
+// set on hit indices of the device sphere set, the lower bits are the sphere
+#define SPHERE_HIT (1 << 30)
+
+// capacity of the per tile surface list built with TILE_CULLING
+#define TILE_PRIMS 1024
+
+// bounces always traced before russian roulette may end a path,
+// and the lowest survival probability it uses
+#define RR_DEPTH 2
+#define RR_MIN_SURVIVAL 0.05f
+
+// cells of the irradiance cache, a power of two, must match irradiance.h
+#define IRRADIANCE_CELLS (1 << 18)
+// slots probed from the hashed one on before a cell is given up
+#define IRRADIANCE_PROBES 4
+// samples a cell takes before only aging makes room for new ones
+#define IRRADIANCE_MAX_SAMPLES 128
+// share of the shading points adding a sample to a cell that is not full
+#define IRRADIANCE_UPDATE_RATE 0.25f
+// full cells drop 1 / IRRADIANCE_AGE of their samples every frame
+#define IRRADIANCE_AGE 16
+// fixed point scale of the sums, the atomics only add integers
+#define IRRADIANCE_SCALE 1024.0f
+
+// encodings of the tonemap kernel output, must match tonemap.h
+#define TONEMAP_DISPLAY 0
+#define TONEMAP_LINEAR  1
+
 typedef struct {
     float4 diffuse;
 
@@ -17,29 +45,277 @@ typedef struct {
 
     float reflect;
     float refract;
+
+    float ior; // index of refraction of transmitted light
+    float padding[3];
 } material;
 
+#define LIGHT_POINT		0
+#define LIGHT_SPHERE	1
+#define LIGHT_TRIANGLE	2
+
+/**
+ * A single emitter, must match the 'light' struct in light.h.
+ * pos: center of point and sphere lights (w = radius) or
+ * 	the first vertex of a triangle light.
+ * edge1, edge2: triangle edges relative to pos.
+ * color: emitted color, w = range of the light.
+ * pdf: probability of selecting the light from the alias table.
+ */
+typedef struct {
+    float4 pos;
+    float4 edge1;
+    float4 edge2;
+    float4 color;
+    int type;
+    float pdf;
+} light;
+
+/**
+ * Alias table entry used for importance sampling the lights.
+ * Must match the 'light_alias' struct in light.h.
+ */
+typedef struct {
+    float prob;
+    int alias;
+} light_alias;
+
+/**
+ * A run of triangles quantized to the chunk bounds, see compress.h.
+ * Must match the 'geometry_chunk' struct in compress.h.
+ */
+typedef struct {
+    float4 lo;
+    float4 hi;
+
+    uint vertex_offset;
+    uint triangle_offset;
+    uint triangle_count;
+    uint padding;
+} geometry_chunk;
+
+#define CHUNK_TRIANGLES 256
+#define COMPRESSED_TRIANGLE_SIZE 5
+
+/**
+ * Primary visibility information for a single pixel,
+ * written by the first pass of adaptive anti-aliasing.
+ * Must match the 'pixel_sample' struct in antialias.h.
+ */
+typedef struct {
+    float4 color;
+    int hit;
+    float depth;
+} pixel_sample;
+
+/**
+ * A cell of the world space irradiance cache.
+ * Must match the 'irradiance_cell' struct in irradiance.h.
+ */
+typedef struct {
+    uint checksum;  // 0 for an empty cell
+    uint count;     // samples in 'sum'
+    uint sum[3];    // radiance in 1 / IRRADIANCE_SCALE units
+    int cell[3];    // grid coordinates, for refresh_irradiance(...)
+} irradiance_cell;
+
+/**
+ * A reflection ray waiting to be traced by trace_bounces(...)
+ * along with the color gathered by the bounces before it.
+ * Must match the 'bounce_ray' struct in reorder.h.
+ */
+typedef struct {
+    float8 ray;
+    float4 color;
+    float reflect;
+} bounce_ray;
+
+// sort key bits of a bounce ray, rays without a reflection set the top bit
+#define RAY_KEY_BITS 28
+#define RAY_KEY_NONE (1u << (RAY_KEY_BITS - 1))
+
+/**
+ * Everything needed to shade a ray, gathered once per work
+ * item by load_scene(...) and passed around by reference.
+ */
+typedef struct {
+#ifdef COMPRESSED_GEOMETRY
+    __global geometry_chunk * chunks;
+    __global ushort * c_vertices;
+    __global ushort * c_triangles;
+    int n_chunks;
+#elif defined USE_BVH
+    __global float * g_surfaces;
+    __global bvh_node * triangle_nodes;
+    int n_surfaces;
+#else
+    __local float * surfaces;
+    int n_surfaces;
+
+    // surfaces in the frustum of the work group's tile for its primary
+    // rays (see cull_tile(...)), NULL to test every surface
+    __local ushort * tile_prims;
+    int n_tile_prims;
+#endif
+
+    // optional sphere set built on the device, NULL nodes when unused
+    __global bvh_node * sphere_nodes;
+    __global float4 * spheres;
+    float sphere_radius;
+    int sphere_material;
+
+    // deduplicated material table, indexed per surface by material_ids
+    __constant material * materials;
+    __global ushort * material_ids;
+
+    // bounces of a path at most, including the primary hit
+    int max_depth;
+
+    // hashed grid of cached indirect light, NULL for a constant AMBIENT
+    __global irradiance_cell * irradiance;
+    float irradiance_cell_size;
+
+    __global light * lights;
+    __global light_alias * light_table;
+    int n_lights;
+    int light_samples;
+} scene_data;
+
+/**
+ * Scene geometry, either the surfaces copied into local memory
+ * by every work group, compressed triangles read directly
+ * from global memory (see compress.h), or triangles read from
+ * global memory through a BVH built on the device (see lbvh.h).
+ */
+#ifdef COMPRESSED_GEOMETRY
+#define GEOMETRY_PARAMS \
+        __global geometry_chunk * chunks, __global ushort * c_vertices, \
+        __global ushort * c_triangles, int n_chunks
+#define GEOMETRY_ARGS chunks, c_vertices, c_triangles, n_chunks
+#elif defined USE_BVH
+#define GEOMETRY_PARAMS \
+        __global float * g_surfaces, __global bvh_node * triangle_nodes, \
+        int n_surfaces, int n_surf_vals
+#define GEOMETRY_ARGS g_surfaces, triangle_nodes, n_surfaces, n_surf_vals
+#else
+#define GEOMETRY_PARAMS \
+        __read_only __global float * g_surfaces, __local float * surfaces, \
+        int n_surfaces, int n_surf_vals
+#define GEOMETRY_ARGS g_surfaces, surfaces, n_surfaces, n_surf_vals
+#endif
+
+/**
+ * Spheres of a single radius and material around device resident
+ * float4 points (such as the nbody positions) with a BVH rebuilt
+ * on the device (see lbvh.cl), sphere_nodes is NULL when unused.
+ */
+#define SPHERE_PARAMS \
+        __global bvh_node * sphere_nodes, __global float4 * spheres, \
+        float sphere_radius, int sphere_material
+#define SPHERE_ARGS sphere_nodes, spheres, sphere_radius, sphere_material
+
+/**
+ * Parameters shared by every kernel rendering the scene, the
+ * host sets these by the indices enumerated in kernel_args.h.
+ */
+#define SCENE_PARAMS \
+        float4 camera_pos, float4 camera_look, float4 camera_right, float4 camera_up, \
+        uint random_seed, \
+        __global light * lights, __global light_alias * light_table, \
+        int n_lights, int light_samples, \
+        __constant material * materials, __global ushort * material_ids, \
+        int max_depth, \
+        __global irradiance_cell * irradiance, float irradiance_cell_size, \
+        GEOMETRY_PARAMS, \
+        SPHERE_PARAMS, \
+        __write_only image2d_t output
+
+/**
+ * Parameters of the ray_tracer kernels following SCENE_PARAMS, set
+ * from ARG_KERNEL_SPECIFIC on. Optional per pixel visibility for
+ * adaptive anti-aliasing and optional reflection rays left for
+ * trace_bounces(...) with their sort keys over the scene bounds,
+ * either buffer may be NULL.
+ */
+#define RAY_TRACER_PARAMS \
+        __global pixel_sample * samples, \
+        __global bounce_ray * bounces, __global uint * bounce_keys, \
+        __global uint * bounce_pixels, float4 key_lo, float4 key_scale
+#define RAY_TRACER_ARGS samples, bounces, bounce_keys, bounce_pixels, key_lo, key_scale
+
+#define LOAD_SCENE() load_scene(lights, light_table, n_lights, light_samples, \
+        materials, material_ids, max_depth, irradiance, irradiance_cell_size, \
+        GEOMETRY_ARGS, SPHERE_ARGS)
+
 /* --------------------
  * Function Prototypes.
  * -------------------- */
 
-float4 color_for_ray(float8 ray, float4 light_pos, __read_only __local float * surfaces, __local material * materials,
-		int n_surfaces, int * hit_index, float4 * intersect, float4 * norm, uint * seed);
+scene_data load_scene(__global light * lights, __global light_alias * light_table,
+		int n_lights, int light_samples,
+		__constant material * materials, __global ushort * material_ids, int max_depth,
+		__global irradiance_cell * irradiance, float irradiance_cell_size,
+		GEOMETRY_PARAMS, SPHERE_PARAMS);
+material surface_material(const scene_data * scene, int surface);
+void trace_pixel(int2 pos, uint seed, const scene_data * scene,
+		float4 camera_pos, float4 camera_look, float4 camera_right, float4 camera_up,
+		__write_only image2d_t output, RAY_TRACER_PARAMS);
+float4 trace_ray(float8 ray, const scene_data * scene, int * first_hit, float * first_depth, uint * seed);
+void trace_path(float8 ray, const scene_data * scene, float4 * color, float weight, int depth, uint * seed);
+bool shade_bounce(float8 ray, const scene_data * scene, float8 * next,
+		float4 * color, float * weight, int * hit_index, float4 * intersect, uint * seed);
+float refract_ray(float8 ray, float4 intersect, float4 norm, float ior, float8 * refracted);
+uint ray_key(float8 ray, float4 key_lo, float4 key_scale);
+float4 color_for_ray(float8 ray, const scene_data * scene, int * hit_index,
+		float4 * intersect, float4 * norm, uint * seed);
+float4 direct_light(float8 ray, const scene_data * scene, float4 intersect, float4 norm,
+		material mat, float4 * spec, uint * seed);
+int irradiance_slot(const scene_data * scene, float4 p, float4 norm, bool insert);
+float4 cached_irradiance(const scene_data * scene, float4 p, float4 norm, uint * seed);
+void update_irradiance(const scene_data * scene, int slot, float4 p, float4 norm, uint * seed);
+float4 cosine_direction(float4 norm, uint * seed);
+uint hash_uint(uint x);
+int intersect_scene(float8 ray, const scene_data * scene, float4 * intersect, float4 * norm);
+bool occluded_scene(float8 ray, float max_dist, const scene_data * scene, int * blocker);
+int intersect_spheres(float8 ray, const scene_data * scene, float * min_dist);
+bool occluded_spheres(float8 ray, float max_dist, const scene_data * scene);
+float distance_ray_sphere(float8 ray, float4 sphere);
+int intersect_chunks(float8 ray, const scene_data * scene, float4 * intersect, float4 * norm);
+int intersect_tile(float8 ray, const scene_data * scene, float4 * intersect, float4 * norm);
+void cull_tile(scene_data * scene, int2 tile_lo, int2 tile_hi, int2 resolution,
+		float4 camera_pos, float4 camera_look, float4 camera_right, float4 camera_up,
+		__local ushort * prims, __local int * count);
+int intersect_bvh(float8 ray, const scene_data * scene, float4 * intersect, float4 * norm);
+bool occluded_bvh(float8 ray, float max_dist, const scene_data * scene, int * blocker);
+float bvh_triangle_distance(float8 ray, const scene_data * scene, int t);
+bool occluded_chunks(float8 ray, float max_dist, const scene_data * scene, int * blocker);
+void compressed_triangle(const scene_data * scene, geometry_chunk chunk, uint t,
+		float4 * p1, float4 * p2, float4 * p3);
+float4 decode_octahedral(uint n);
+bool intersect_ray_box(float4 origin, float4 inv_dir, float4 lo, float4 hi, float max_dist);
 int intersect_ray_surfaces(float8 ray, __read_only __local float * surfaces,
 		int n_surfaces, float4 * intersect, float4 * norm);
 int size_of_surface(__read_only __local float * surface_p);
+bool occluded(float8 ray, float max_dist, __read_only __local float * surfaces,
+		int n_surfaces, int * blocker);
+bool occludes_surface(float8 ray, float max_dist, __read_only __local float * surface_p);
 
 bool intersect_ray_surface(float8 ray, __read_only __local float * surface_p, float4 * intersect, float4 * norm);
 bool intersect_ray_sphere(float8 ray, float4 sphere, float4 * intersect, float4 * norm);
 bool intersect_ray_plane(float8 ray, float8 plane, float4 * intersect, float4 * norm);
 bool intersect_ray_triangle(float8 ray, float4 p1, float4 p2, float4 p3, float4 * intersect, float4 * norm);
+float distance_ray_triangle(float8 ray, float4 p1, float4 p2, float4 p3);
 
 float8 calculate_ray(float4 camera_pos, float4 camera_look,
-        float4 camera_right, float4 camera_up);
+        float4 camera_right, float4 camera_up, float2 pixel, int2 resolution);
+bool is_edge_pixel(pixel_sample p, pixel_sample n, float threshold);
 float scalar_for_lighting(float4 l_dir, float4 norm);
 float specular_for_lighting(float8 ray, float4 l_dir, float4 norm, material mat);
+int sample_light(const scene_data * scene, uint * seed, float * pdf);
+float4 point_on_light(light l, uint * seed);
 float4 point_on_sphere(float4 sphere, uint * seed);
 float4 bary_centric(float4 P, float4 p1, float4 p2, float4 p3);
+float rand_float(uint * seed);
 uint rand(uint * seed);
 
 /* --------------------
@@ -47,125 +323,841 @@ uint rand(uint * seed);
  * -------------------- */
 
 __kernel void ray_tracer(
-        // camera information
-        float4 camera_pos,
-        float4 camera_look,
-        float4 camera_right,
-        float4 camera_up,
+        SCENE_PARAMS,
+        RAY_TRACER_PARAMS
+	) {
+
+	scene_data scene = LOAD_SCENE();
+
+    // the output image resolution
+    int2 resolution = get_image_dim(output);
+
+#ifdef TILE_CULLING
+	__local ushort tile_prims[TILE_PRIMS];
+	__local int tile_count;
+	int2 tile_size = (int2)(get_local_size(0), get_local_size(1));
+	int2 tile_lo = (int2)(get_group_id(0), get_group_id(1)) * tile_size;
+	cull_tile(&scene, tile_lo, tile_lo + tile_size, resolution,
+			camera_pos, camera_look, camera_right, camera_up, tile_prims, &tile_count);
+#endif
+
+    // the local (x, y) coordinate described relative to the global work size
+	int x_pos = get_global_id(0);
+	int y_pos = get_global_id(1);
+	if (x_pos >= resolution.x || y_pos >= resolution.y) { return; }
+
+	trace_pixel((int2)(x_pos, y_pos), random_seed, &scene,
+			camera_pos, camera_look, camera_right, camera_up, output, RAY_TRACER_ARGS);
+}
+
+/**
+ * Persistent threads variant of the ray_tracer kernel.
+ * The host only launches enough work groups to fill the device,
+ * each group then keeps taking the next tile of the image, one
+ * pixel per work item, from the global 'next_tile' counter until
+ * every tile is done. Slow tiles no longer hold up a fixed share
+ * of the image, and the scene is loaded once per group.
+ */
+__kernel void ray_tracer_persistent(
+        SCENE_PARAMS,
+        RAY_TRACER_PARAMS,
+
+        // tiles handed out so far, reset to 0 before every launch
+        __global volatile uint * next_tile
+	) {
+
+	__local uint tile;
+#ifdef TILE_CULLING
+	__local ushort tile_prims[TILE_PRIMS];
+	__local int tile_count;
+#endif
+
+	scene_data scene = LOAD_SCENE();
+
+    int2 resolution = get_image_dim(output);
+    int tile_w = get_local_size(0);
+    int tile_h = get_local_size(1);
+    uint tiles_x = (resolution.x + tile_w - 1) / tile_w;
+    uint n_tiles = tiles_x * ((resolution.y + tile_h - 1) / tile_h);
+    bool first = get_local_id(0) == 0 && get_local_id(1) == 0;
+
+    while (true) {
+		if (first) { tile = atomic_inc(next_tile); }
+		barrier(CLK_LOCAL_MEM_FENCE);
+		uint t = tile;
+		barrier(CLK_LOCAL_MEM_FENCE); // everyone has read the tile before the next fetch
+
+		// uniform across the work group
+		if (t >= n_tiles) { break; }
+
+		int2 tile_lo = (int2)((t % tiles_x) * tile_w, (t / tiles_x) * tile_h);
+#ifdef TILE_CULLING
+		cull_tile(&scene, tile_lo, tile_lo + (int2)(tile_w, tile_h), resolution,
+				camera_pos, camera_look, camera_right, camera_up, tile_prims, &tile_count);
+#endif
+
+		int x_pos = tile_lo.x + get_local_id(0);
+		int y_pos = tile_lo.y + get_local_id(1);
+		if (x_pos < resolution.x && y_pos < resolution.y) {
+			// work items trace many pixels, seed by pixel instead
+			trace_pixel((int2)(x_pos, y_pos), random_seed + y_pos * resolution.x + x_pos, &scene,
+					camera_pos, camera_look, camera_right, camera_up, output, RAY_TRACER_ARGS);
+		}
+    }
+}
+
+/**
+ * @brief Traces the camera ray through pixel 'pos' and writes its color,
+ * or leaves its reflection to trace_bounces(...) when 'bounces' is set.
+ */
+void trace_pixel(
+		int2 pos,
+		uint seed,
+		const scene_data * scene,
+		float4 camera_pos, float4 camera_look, float4 camera_right, float4 camera_up,
+		__write_only image2d_t output,
+		RAY_TRACER_PARAMS) {
+
+    int2 resolution = get_image_dim(output);
+	int hit_index;
+	float depth;
+    float8 ray = calculate_ray(camera_pos, camera_look, camera_right, camera_up,
+            (float2)(pos.x, pos.y), resolution);
+    float4 color;
+    int pixel = pos.y * resolution.x + pos.x;
+
+    if (bounces) {
+		// only shade the primary hit, the reflection is traced in
+		// sorted order by trace_bounces(...) which writes the pixel
+		float reflect = 1.0f;
+		float4 intersect;
+		float8 reflected;
+
+		color = (float4)0.0f;
+		bool more = shade_bounce(ray, scene, &reflected, &color, &reflect,
+				&hit_index, &intersect, &seed) && scene->max_depth > 1;
+		depth = hit_index >= 0 ? length(intersect - ray.lo) : 0.0f;
+
+		bounce_keys[pixel] = more ? ray_key(reflected, key_lo, key_scale) : RAY_KEY_NONE;
+		bounce_pixels[pixel] = pixel;
+		if (more) {
+			bounces[pixel] = (bounce_ray){ reflected, color, reflect };
+		} else {
+			write_imagef(output, pos, color);
+		}
+    } else {
+		color = trace_ray(ray, scene, &hit_index, &depth, &seed);
+		write_imagef(output, pos, color);
+    }
+
+	// with reordering the color only holds the primary bounce,
+	// which is enough to find edges for anti-aliasing
+	if (samples) {
+		samples[pixel] = (pixel_sample){ color, hit_index, depth };
+	}
+}
+
+/**
+ * Traces the reflection rays left by the ray_tracer kernel after
+ * sorting them by ray_key(...), so neighboring work items follow
+ * similar rays through the scene. Rays without a reflection sort
+ * past every other ray and are skipped.
+ */
+__kernel void trace_bounces(
+        SCENE_PARAMS,
+
+        // sorted keys and the pixel each key belongs to
+        __global const uint * keys,
+        __global const uint * pixels,
+        __global const bounce_ray * bounces,
+        int n_pixels
+	) {
+
+	scene_data scene = LOAD_SCENE();
+
+	int i = get_global_id(0);
+	if (i >= n_pixels || (keys[i] & RAY_KEY_NONE)) { return; }
+
+	int2 resolution = get_image_dim(output);
+	uint pixel = pixels[i];
+	bounce_ray b = bounces[pixel];
+
+	// the primary bounce was shaded by the ray_tracer kernel
+	uint seed = random_seed;
+	trace_path(b.ray, &scene, &b.color, b.reflect, 1, &seed);
+
+	write_imagef(output, (int2)(pixel % resolution.x, pixel / resolution.x), b.color);
+}
+
+/**
+ * Second pass of adaptive anti-aliasing.
+ * Compares each pixel against its right and bottom neighbors and
+ * appends the pixels on either side of a primitive, depth, or color
+ * discontinuity to 'work_list'. Each work group first compacts its
+ * flagged pixels in local memory so only a single global atomic
+ * is needed per group. The launch is rounded up to whole work groups.
+ */
+__kernel void detect_edges(
+        __global pixel_sample * samples,
+        float threshold,
+        __global uint * work_count,
+        __global uint * work_list,
+        int2 resolution
+    ) {
+
+    __local uint group_count;
+    __local uint group_base;
+
+    int screen_w = resolution.x;
+    int screen_h = resolution.y;
+    int x_pos = get_global_id(0);
+    int y_pos = get_global_id(1);
+    int l_id = get_local_id(1) * get_local_size(0) + get_local_id(0);
+
+    if (l_id == 0) { group_count = 0; }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // work items past the image still reach every barrier, they flag nothing
+    bool inside = x_pos < screen_w && y_pos < screen_h;
+
+    // a pixel is refined if it differs from any of its 4 neighbors
+    pixel_sample p = samples[min(y_pos, screen_h - 1) * screen_w + min(x_pos, screen_w - 1)];
+    bool edge = inside && (
+        is_edge_pixel(p, samples[y_pos * screen_w + max(x_pos - 1, 0)], threshold) ||
+        is_edge_pixel(p, samples[y_pos * screen_w + min(x_pos + 1, screen_w - 1)], threshold) ||
+        is_edge_pixel(p, samples[max(y_pos - 1, 0) * screen_w + x_pos], threshold) ||
+        is_edge_pixel(p, samples[min(y_pos + 1, screen_h - 1) * screen_w + x_pos], threshold));
+
+    uint slot = edge ? atomic_inc(&group_count) : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (l_id == 0) { group_base = atomic_add(work_count, group_count); }
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-        // seed for the random number generator
-        uint random_seed,
+    if (edge) {
+        work_list[group_base + slot] = y_pos * screen_w + x_pos;
+    }
+}
+
+/**
+ * Final pass of adaptive anti-aliasing.
+ * Each work item takes one pixel from the compacted 'work_list'
+ * and replaces its color with the average of sub_samples^2
+ * uniformly distributed sub-pixel rays.
+ */
+__kernel void refine_edges(
+        SCENE_PARAMS,
+
+        // pixels flagged by detect_edges(...)
+        __global uint * work_list,
+        uint n_work,
+        int sub_samples
+	) {
+
+	scene_data scene = LOAD_SCENE();
+
+    // the work list is padded to a multiple of the local size
+    if (get_global_id(0) >= n_work) { return; }
+
+    int2 resolution = get_image_dim(output);
+    uint pixel = work_list[get_global_id(0)];
+    int x_pos = pixel % resolution.x;
+    int y_pos = pixel / resolution.x;
+
+	uint seed = random_seed;
+	int hit_index;
+	float depth;
+    float4 color = (float4)0.0f;
+    float step = 1.0f / sub_samples;
+
+    for (int sy = 0; sy < sub_samples; sy++) {
+        for (int sx = 0; sx < sub_samples; sx++) {
+            float2 sub_pixel = (float2)(x_pos + (sx + 0.5f) * step, y_pos + (sy + 0.5f) * step);
+            float8 ray = calculate_ray(camera_pos, camera_look, camera_right, camera_up,
+                    sub_pixel, resolution);
+            color += trace_ray(ray, &scene, &hit_index, &depth, &seed);
+        }
+    }
+
+	write_imagef(output, (int2)(x_pos, y_pos), color * (step * step));
+}
 
-		// scene information
-		float4 light_pos,
-		__read_only __global float * g_surfaces,
-        __read_only __global material * g_materials,
-		__local float * surfaces,
-		__local material * materials,
-		int n_surfaces, int n_surf_vals, int n_mat_vals,
+/**
+ * @brief Narkowicz's fit of the ACES filmic curve, maps linear
+ * radiance to [0, 1] with a soft shoulder instead of clipping.
+ */
+float3 aces_filmic(float3 x) {
+    const float a = 2.51f, b = 0.03f, c = 2.43f, d = 0.59f, e = 0.14f;
+    return clamp((x * (a * x + b)) / (x * (c * x + d) + e), 0.0f, 1.0f);
+}
 
-        // kernel output
+/**
+ * @brief The sRGB transfer function, spends the 8 bits of a display
+ * output evenly over perceived brightness.
+ */
+float3 srgb_encode(float3 c) {
+    return select(1.055f * pow(c, 1.0f / 2.4f) - 0.055f, c * 12.92f, c <= 0.0031308f);
+}
+
+/**
+ * Resolves the HDR 'frame' into the compact 'output'.
+ * Averages the scale * scale samples of every output pixel, adds them
+ * to the running sum of the frames rendered since the view last changed
+ * (a 'count' of 1 restarts it) and writes their mean times 'exposure'.
+ * TONEMAP_DISPLAY maps it through the filmic curve and encodes it to
+ * sRGB for RGBA8 outputs, TONEMAP_LINEAR keeps it linear for half floats.
+ */
+__kernel void tonemap(
+        __read_only image2d_t frame,
+        __global float4 * sum,
+        int count,
+        int scale,
+        float exposure,
+        int encoding,
         __write_only image2d_t output
 	) {
 
+    int2 resolution = get_image_dim(output);
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    if (pos.x >= resolution.x || pos.y >= resolution.y) { return; }
+
+    float4 total = (float4)0.0f;
+    for (int sy = 0; sy < scale; sy++) {
+        for (int sx = 0; sx < scale; sx++) {
+            total += read_imagef(frame, pos * scale + (int2)(sx, sy));
+        }
+    }
+    total /= (float)(scale * scale);
+
+    int i = pos.y * resolution.x + pos.x;
+    if (count > 1) {
+        total += sum[i];
+    }
+    sum[i] = total;
+
+    float3 color = max(total.xyz * (exposure / (float)count), 0.0f);
+    if (encoding == TONEMAP_DISPLAY) {
+        color = srgb_encode(aces_filmic(color));
+    }
+
+	write_imagef(output, pos, (float4)(color, 1.0f));
+}
+
+/**
+ * Ages the irradiance cache before a frame. Cells overlapping the box
+ * 'lo' to 'hi' are dropped, along with the cells overlapping the root
+ * of 'moving' (such as the sphere BVH, rebuilt every frame) unless it
+ * is NULL. Full cells give up a share of their samples so new ones
+ * keep replacing the light of earlier frames.
+ */
+__kernel void refresh_irradiance(
+        __global irradiance_cell * cells,
+        float cell_size,
+        float4 lo,
+        float4 hi,
+        __global bvh_node * moving
+    ) {
+
+    int i = get_global_id(0);
+    if (i >= IRRADIANCE_CELLS || cells[i].checksum == 0) { return; }
+
+    irradiance_cell cell = cells[i];
+    float3 cell_lo = (float3)(cell.cell[0], cell.cell[1], cell.cell[2]) * cell_size;
+    float3 cell_hi = cell_lo + cell_size;
+
+    bool stale = all(cell_lo <= hi.xyz) && all(cell_hi >= lo.xyz);
+    if (moving) {
+        bvh_node root = moving[0];
+        stale = stale || (all(cell_lo <= root.hi.xyz) && all(cell_hi >= root.lo.xyz));
+    }
+
+    if (stale) {
+        cell.checksum = 0;
+        cell.count = 0;
+        cell.sum[0] = cell.sum[1] = cell.sum[2] = 0;
+    } else if (cell.count >= IRRADIANCE_MAX_SAMPLES) {
+        cell.count -= cell.count / IRRADIANCE_AGE;
+        for (int c = 0; c < 3; c++) {
+            cell.sum[c] -= cell.sum[c] / IRRADIANCE_AGE;
+        }
+    }
+
+    cells[i] = cell;
+}
+
+/**
+ * Bounds of each triangle record in 'g_surfaces' for the
+ * device BVH builder, see lbvh.cl. Every record is a
+ * triangle of TRIANGLE_SIZE floats.
+ */
+__kernel void triangle_bounds(
+        __global float * g_surfaces,
+        int n_surfaces,
+        __global bvh_node * prims
+    ) {
+
+    int i = get_global_id(0);
+    if (i >= n_surfaces) { return; }
+
+    __global float * p = g_surfaces + i * TRIANGLE_SIZE + 1;
+    float4 p1 = (float4)(vload3(0, p), 0.0f);
+    float4 p2 = (float4)(vload3(0, p + 4), 0.0f);
+    float4 p3 = (float4)(vload3(0, p + 8), 0.0f);
+
+    prims[i].lo = fmin(p1, fmin(p2, p3));
+    prims[i].hi = fmax(p1, fmax(p2, p3));
+}
+
+/**
+ * @brief Copies the surfaces into local memory and gathers
+ * the scene information into a single structure.
+ * Must be called by every work item in the work group.
+ */
+scene_data load_scene(
+		__global light * lights,
+		__global light_alias * light_table,
+		int n_lights, int light_samples,
+		__constant material * materials,
+		__global ushort * material_ids,
+		int max_depth,
+		__global irradiance_cell * irradiance,
+		float irradiance_cell_size,
+		GEOMETRY_PARAMS, SPHERE_PARAMS) {
+
+#ifdef COMPRESSED_GEOMETRY
+	return (scene_data){
+		chunks, c_vertices, c_triangles, n_chunks,
+		SPHERE_ARGS,
+		materials, material_ids, max_depth,
+		irradiance, irradiance_cell_size,
+		lights, light_table, n_lights, light_samples
+	};
+#elif defined USE_BVH
+	return (scene_data){
+		g_surfaces, triangle_nodes, n_surfaces,
+		SPHERE_ARGS,
+		materials, material_ids, max_depth,
+		irradiance, irradiance_cell_size,
+		lights, light_table, n_lights, light_samples
+	};
+#else
 	event_t es = async_work_group_copy(surfaces, g_surfaces, n_surf_vals, 0);
-	event_t em = async_work_group_copy((__local float *)materials, (__global float *)g_materials, n_mat_vals, 0);
 	wait_group_events(1, &es);
-	wait_group_events(1, &em);
 
-    // the output image resolution -> global work size
-	int screen_w = get_global_size(0);
-	int screen_h = get_global_size(1);
+	return (scene_data){
+		surfaces, n_surfaces, NULL, 0,
+		SPHERE_ARGS,
+		materials, material_ids, max_depth,
+		irradiance, irradiance_cell_size,
+		lights, light_table, n_lights, light_samples
+	};
+#endif
+}
 
-    // the local (x, y) coordinate described relative to the global work size
-	int x_pos = get_global_id(0);
-	int y_pos = get_global_id(1);
+material surface_material(const scene_data * scene, int surface) {
+	if (surface & SPHERE_HIT) {
+		return scene->materials[scene->sphere_material];
+	}
 
-	uint seed = random_seed;
-	int hit_index;
-    float8 ray = calculate_ray(camera_pos, camera_look, camera_right, camera_up);
-	float4 intersect, norm; // surface intersection information
+	return scene->materials[scene->material_ids[surface]];
+}
 
-    float reflect = 1.0f; // percentage of color to use
+/**
+ * @brief Follows 'ray' through the scene, including its reflections
+ * and transmissions, for up to scene->max_depth bounces.
+ * @param first_hit (output) Surface index hit by the primary ray, -1 on a miss.
+ * @param first_depth (output) Distance to the primary intersection, 0 on a miss.
+ * @return The color seen along the input ray.
+ */
+float4 trace_ray(
+		float8 ray,
+		const scene_data * scene,
+		int * first_hit,
+		float * first_depth,
+		uint * seed) {
+
+	float4 intersect; // surface intersection information
+	float8 next;
+
+    float weight = 1.0f; // percentage of color to use
     float4 color = (float4)0.0f; // sum of all color samples
 
-    // grab all of our lighting samples
-    for (int i = 0; i < 2; i++) {
-		float4 c = color_for_ray(ray, light_pos, surfaces, materials, n_surfaces, 
-				&hit_index, &intersect, &norm, &seed);
-		
-        // update the ray
-        float r = 2.0f * dot(ray.hi, norm);
-        ray = (float8){intersect, ray.hi - norm * r};
-
-        // apply reflection
-        if (hit_index >= 0 && materials[hit_index].reflect > EPSILON) {
-            color += c * (1.0f - materials[hit_index].reflect) * reflect;
-            reflect = materials[hit_index].reflect;
-        } else {
-            color += c * reflect;
-            break;
-        }
+	bool more = shade_bounce(ray, scene, &next, &color, &weight,
+			first_hit, &intersect, seed);
+	*first_depth = *first_hit >= 0 ? length(intersect - ray.lo) : 0.0f;
+
+	if (more) {
+#ifdef TILE_CULLING
+		// only primary rays stay within the tile frustum
+		scene_data secondary = *scene;
+		secondary.tile_prims = NULL;
+		trace_path(next, &secondary, &color, weight, 1, seed);
+#else
+		trace_path(next, scene, &color, weight, 1, seed);
+#endif
+	}
+
+	return color;
+}
+
+/**
+ * @brief Continues a path with the bounce 'depth' along 'ray'.
+ * Past RR_DEPTH bounces a path only continues with a probability
+ * following the weight it still carries, and survivors are weighted
+ * up to compensate. Deep paths are then only paid for by pixels
+ * that see glass or mirrors, where the energy actually survives.
+ * @param color (in/out) Color gathered by the path so far.
+ * @param weight Weight of the bounce at 'depth'.
+ */
+void trace_path(
+		float8 ray,
+		const scene_data * scene,
+		float4 * color,
+		float weight,
+		int depth,
+		uint * seed) {
+
+	int hit_index;
+	float4 intersect;
+	float8 next;
+
+	for (; depth < scene->max_depth; depth++) {
+		if (depth >= RR_DEPTH) {
+			float survive = clamp(weight, RR_MIN_SURVIVAL, 1.0f);
+			if (rand_float(seed) >= survive) { return; }
+			weight /= survive;
+		}
+
+		if (!shade_bounce(ray, scene, &next, color, &weight, &hit_index, &intersect, seed)) {
+			return;
+		}
+		ray = next;
+	}
+}
+
+/**
+ * @brief Shades a single bounce of a path.
+ * Adds the color seen along 'ray', weighted by 'weight', to 'color'.
+ * Light the surface does not absorb is either reflected or, for
+ * materials with a 'refract' share, transmitted. The share of both
+ * follows the Fresnel reflectance, and one of them is picked at
+ * random in proportion to the light it carries.
+ * @param next (output) The reflected or transmitted ray.
+ * @param weight (in/out) Weight of this bounce, updated for the next one.
+ * @return Whether the next ray contributes to the color.
+ */
+bool shade_bounce(
+		float8 ray,
+		const scene_data * scene,
+		float8 * next,
+		float4 * color,
+		float * weight,
+		int * hit_index,
+		float4 * intersect,
+		uint * seed) {
+
+	float4 norm;
+	float4 c = color_for_ray(ray, scene, hit_index, intersect, &norm, seed);
+	if (*hit_index < 0) {
+		*color += c * *weight;
+		return false;
+	}
+
+	material mat = surface_material(scene, *hit_index);
+	float r_hit = mat.reflect;
+	float t_hit = mat.refract;
+
+	float8 refracted;
+	if (t_hit > EPSILON) {
+		float fresnel = refract_ray(ray, *intersect, norm, mat.ior, &refracted);
+		r_hit += t_hit * fresnel;
+		t_hit *= 1.0f - fresnel;
+	}
+
+	float bounce = min(r_hit + t_hit, 1.0f);
+	if (bounce > EPSILON) {
+		*color += c * (1.0f - bounce) * *weight;
+		*weight *= bounce;
+
+		if (t_hit > 0.0f && rand_float(seed) * (r_hit + t_hit) < t_hit) {
+			*next = refracted;
+		} else {
+			float r = 2.0f * dot(ray.hi, norm);
+			*next = (float8){*intersect, ray.hi - norm * r};
+		}
+		return true;
+	}
+
+	*color += c * *weight;
+	return false;
+}
+
+/**
+ * @brief Bends 'ray' through the surface at 'intersect' by Snell's law.
+ * The normal may face either way, a ray arriving from behind the
+ * surface passes from the material back out into air.
+ * @param refracted (output) The transmitted ray, unset on total internal reflection.
+ * @return The Fresnel reflectance (Schlick's approximation), 1 on total internal reflection.
+ */
+float refract_ray(float8 ray, float4 intersect, float4 norm, float ior, float8 * refracted) {
+	float cos_i = -dot(ray.hi, norm);
+	float eta = 1.0f / ior;
+	if (cos_i < 0.0f) {
+		norm = -norm;
+		cos_i = -cos_i;
+		eta = ior;
 	}
 
-	write_imagef(output, (int2)(x_pos, y_pos), color);
+	float k = 1.0f - eta * eta * (1.0f - cos_i * cos_i);
+	if (k < 0.0f) {
+		return 1.0f;
+	}
+
+	float cos_t = sqrt(k);
+	*refracted = (float8){intersect, eta * ray.hi + (eta * cos_i - cos_t) * norm};
+
+	// the angle on the side of the thinner medium
+	float r0 = (1.0f - ior) / (1.0f + ior);
+	r0 *= r0;
+	float x = 1.0f - (eta > 1.0f ? cos_t : cos_i);
+	return r0 + (1.0f - r0) * x * x * x * x * x;
+}
+
+/**
+ * @brief Sort key grouping rays of similar direction and origin.
+ * The high bits hold the octahedral direction, 6 bits per axis, the
+ * low bits the Morton code of the origin within the scene bounds,
+ * 5 bits per axis. The top key bit is left clear for RAY_KEY_NONE.
+ */
+uint ray_key(float8 ray, float4 key_lo, float4 key_scale) {
+	float3 d = ray.hi.xyz / (fabs(ray.hi.x) + fabs(ray.hi.y) + fabs(ray.hi.z));
+	float2 oct = d.z >= 0.0f ? d.xy : (1.0f - fabs(d.yx)) * sign(d.xy);
+	uint2 q_dir = convert_uint2(clamp((oct * 0.5f + 0.5f) * 64.0f, 0.0f, 63.0f));
+
+	float3 o = (ray.lo.xyz - key_lo.xyz) * key_scale.xyz;
+	uint3 q_pos = convert_uint3(clamp(o * 32.0f, 0.0f, 31.0f));
+	uint morton = expand_bits(q_pos.x) * 4 + expand_bits(q_pos.y) * 2 + expand_bits(q_pos.z);
+
+	return (q_dir.x << 21) | (q_dir.y << 15) | morton;
 }
 
+/**
+ * @brief Shades the closest intersection of 'ray'.
+ * Indirect light comes from the irradiance cache when there is one,
+ * which also takes a sample at some of the shading points.
+ */
 float4 color_for_ray(
 		float8 ray,
-		float4 light_pos,
-		__read_only __local float * surfaces,
-		__read_only __local material * materials,
-		int n_surfaces,
+		const scene_data * scene,
 		int * hit_index,
 		float4 * intersect,
 		float4 * norm,
 		uint * seed) {
 
-	 *hit_index = intersect_ray_surfaces(ray, surfaces, n_surfaces, intersect, norm);
+	 *hit_index = intersect_scene(ray, scene, intersect, norm);
+	 if (*hit_index < 0 || scene->n_lights == 0) {
+		 return (float4)0.0f;
+	 }
 
-	 float4 light_intersect, light_norm;
-	 if (light_pos.w > EPSILON && intersect_ray_sphere(ray, light_pos, &light_intersect, &light_norm)) {
-	     float pd = length(*intersect - ray.lo);
-	     float ld = length(light_intersect - ray.lo);
-	     if (ld <= pd) { return (float4)1.0f; }
+	 material mat = surface_material(scene, *hit_index);
+	 float4 spec;
+	 float4 diff = direct_light(ray, scene, *intersect, *norm, mat, &spec, seed);
+
+	 float4 ambient = (float4)AMBIENT;
+	 if (scene->irradiance) {
+		 // the cache is kept per side of a surface, take the side facing the ray
+		 float4 facing = dot(ray.hi, *norm) > 0.0f ? -*norm : *norm;
+		 ambient = cached_irradiance(scene, *intersect, facing, seed);
+
+		 int slot = irradiance_slot(scene, *intersect, facing, true);
+		 if (slot >= 0 && scene->irradiance[slot].count < IRRADIANCE_MAX_SAMPLES &&
+				 rand_float(seed) < IRRADIANCE_UPDATE_RATE) {
+#ifdef TILE_CULLING
+			 // the gather ray leaves the tile frustum like any secondary ray
+			 scene_data gather = *scene;
+			 gather.tile_prims = NULL;
+			 update_irradiance(&gather, slot, *intersect, facing, seed);
+#else
+			 update_irradiance(scene, slot, *intersect, facing, seed);
+#endif
+		 }
 	 }
 
-	 if (*hit_index >= 0) {
-	 	float diff = 0.0;
-	 	float spec = 0.0;
-
-        // check if the light is visible from this point
-        int l_samples = light_pos.w > EPSILON ? 32 : 1;
-	 	for (int l = 0; l < l_samples; l++) {
-			float4 sample_pos = point_on_sphere(light_pos, seed);
-
-	    	float l_dist = length(sample_pos - *intersect);
-	    	float4 l_dir = normalize(sample_pos - *intersect);
-	    	float sample_d = AMBIENT;
-	    	float sample_s = 0.0f;
-
-        	float4 l_int, l_norm;
-        	if (intersect_ray_surfaces((float8)(*intersect, l_dir), 
-						surfaces, n_surfaces, &l_int, &l_norm) < 0 
-					|| length(*intersect - l_int) > l_dist) {
-				float intensity = max((15.0f - l_dist)/15.0f, 0.0f);
-
-            	// calculate the lighting components for this point
-                sample_d = max(intensity * scalar_for_lighting(l_dir, *norm), sample_d);
-                sample_s = max(intensity * specular_for_lighting(ray, l_dir, *norm, materials[*hit_index]), sample_s);
-            }
-	 	 		
-             // add this samples contribution to the overall lighting
-        	diff += sample_d / (float)l_samples;
-        	spec += sample_s / (float)l_samples;
-	 	}
+	 float4 color = (ambient + diff) * mat.diffuse + spec;
+	 return (float4)(color.xyz, 1.0f);
+}
+
+/**
+ * @brief Light arriving at 'intersect' straight from the lights.
+ * Rather than looping over every light, 'light_samples' lights are
+ * picked from the alias table in proportion to their estimated
+ * power, so the cost of shading does not grow with the light count.
+ * @param spec (output) Specular highlight of 'mat' seen along 'ray'.
+ * @return The diffuse light, before the material's color.
+ */
+float4 direct_light(
+		float8 ray,
+		const scene_data * scene,
+		float4 intersect,
+		float4 norm,
+		material mat,
+		float4 * spec,
+		uint * seed) {
 
-        return (float4)((float3)diff, 1.0) * materials[*hit_index].diffuse +
-			(float4)(1.0f, 1.0f, 1.0f, 0.0f) * max(spec * diff, 0.0f);
+	 float4 diff = (float4)0.0f;
+	 int blocker = -1; // neighboring samples are likely blocked by the same surface
+	 *spec = (float4)0.0f;
+
+	 for (int l = 0; l < scene->light_samples; l++) {
+		float pdf;
+		light lt = scene->lights[sample_light(scene, seed, &pdf)];
+		float4 sample_pos = point_on_light(lt, seed);
+
+		float l_dist = length(sample_pos - intersect);
+		float4 l_dir = normalize(sample_pos - intersect);
+		float intensity = max((lt.color.w - l_dist) / lt.color.w, 0.0f);
+		float lambert = scalar_for_lighting(l_dir, norm);
+
+		// only trace a shadow ray if the light can contribute
+		if (intensity * lambert <= 0.0f ||
+				occluded_scene((float8)(intersect, l_dir), l_dist, scene, &blocker)) {
+			continue;
+		}
+
+		// weight each sample by the probability of selecting its light
+		float4 c = (float4)(lt.color.xyz, 0.0f) * (intensity * lambert / (pdf * scene->light_samples));
+		diff += c;
+		*spec += c * max(specular_for_lighting(ray, l_dir, norm, mat), 0.0f);
 	 }
 
-	 return (float4)0.0f;
+	 return diff;
+}
+
+/* --------------------
+ * Irradiance Cache.
+ * -------------------- */
+
+/**
+ * @brief Finds the cell caching the light around 'p' on the side of
+ * its surface facing 'norm'. Cells are hashed from their grid
+ * coordinates and the dominant axis of the normal, so both sides of
+ * a thin wall keep their own light. A second hash of the same key
+ * tells cells sharing a slot apart.
+ * @param insert Claim an empty slot if the cell is not cached yet.
+ * @return Index of the cell, -1 if it is not cached.
+ */
+int irradiance_slot(const scene_data * scene, float4 p, float4 norm, bool insert) {
+	int4 c = convert_int4_rtn(p / scene->irradiance_cell_size);
+	float3 a = fabs(norm.xyz);
+	uint axis = a.x > a.y && a.x > a.z ? 0 : (a.y > a.z ? 1 : 2);
+	float n = axis == 0 ? norm.x : (axis == 1 ? norm.y : norm.z);
+	uint face = axis * 2 + (n < 0.0f ? 1 : 0);
+
+	uint h = hash_uint(c.x + hash_uint(c.y + hash_uint(c.z + hash_uint(face))));
+	uint checksum = hash_uint(h ^ 0x9e3779b9u) | 1u; // never 0, the empty cell
+
+	// cells may be dropped inside a chain, so always probe all of it
+	for (uint i = 0; i < IRRADIANCE_PROBES; i++) {
+		uint slot = (h + i) & (IRRADIANCE_CELLS - 1);
+		__global irradiance_cell * cell = &scene->irradiance[slot];
+		uint found = cell->checksum;
+		if (found == 0 && insert) {
+			found = atomic_cmpxchg(&cell->checksum, 0u, checksum);
+			if (found == 0) {
+				cell->cell[0] = c.x;
+				cell->cell[1] = c.y;
+				cell->cell[2] = c.z;
+				return slot;
+			}
+		}
+		if (found == checksum) {
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Indirect light arriving at 'p', read from the cell around a
+ * point up to half a cell away from it. Over a few frames the random
+ * offsets blend neighboring cells instead of showing their edges.
+ * @return AMBIENT until the cells have samples.
+ */
+float4 cached_irradiance(const scene_data * scene, float4 p, float4 norm, uint * seed) {
+	float4 offset = (float4)(rand_float(seed), rand_float(seed), rand_float(seed), 0.5f) - 0.5f;
+	int slot = irradiance_slot(scene, p + offset * scene->irradiance_cell_size, norm, false);
+	if (slot < 0 || scene->irradiance[slot].count == 0) {
+		// the offset left the surface, fall back to the cell of 'p'
+		slot = irradiance_slot(scene, p, norm, false);
+	}
+	if (slot < 0 || scene->irradiance[slot].count == 0) {
+		return (float4)AMBIENT;
+	}
+
+	__global irradiance_cell * cell = &scene->irradiance[slot];
+	float4 sum = (float4)(cell->sum[0], cell->sum[1], cell->sum[2], 0.0f);
+	return sum / (IRRADIANCE_SCALE * cell->count);
+}
+
+/**
+ * @brief Adds a sample of the light arriving at 'p' to cell 'slot'.
+ * A cosine distributed ray finds the surface lighting 'p' and takes
+ * its direct light along with its own cached light, so light keeps
+ * bouncing through the cache over the frames without deeper paths.
+ */
+void update_irradiance(const scene_data * scene, int slot, float4 p, float4 norm, uint * seed) {
+	float8 ray = (float8)(p, cosine_direction(norm, seed));
+	float4 intersect, n;
+	float4 radiance = (float4)0.0f;
+
+	int hit = intersect_scene(ray, scene, &intersect, &n);
+	if (hit >= 0) {
+		material mat = surface_material(scene, hit);
+		if (dot(ray.hi, n) > 0.0f) { n = -n; }
+
+		float4 spec;
+		float4 incoming = direct_light(ray, scene, intersect, n, mat, &spec, seed);
+		int bounce = irradiance_slot(scene, intersect, n, false);
+		if (bounce >= 0 && scene->irradiance[bounce].count > 0) {
+			__global irradiance_cell * cell = &scene->irradiance[bounce];
+			incoming += (float4)(cell->sum[0], cell->sum[1], cell->sum[2], 0.0f) /
+					(IRRADIANCE_SCALE * cell->count);
+		}
+		radiance = incoming * mat.diffuse;
+	}
+
+	uint4 fixed = convert_uint4_sat(radiance * IRRADIANCE_SCALE);
+	__global irradiance_cell * cell = &scene->irradiance[slot];
+	atomic_add(&cell->sum[0], fixed.x);
+	atomic_add(&cell->sum[1], fixed.y);
+	atomic_add(&cell->sum[2], fixed.z);
+	atomic_inc(&cell->count);
+}
+
+/**
+ * @brief Direction in the hemisphere around 'norm', distributed by
+ * the cosine to it so samples follow the lambertian weight.
+ */
+float4 cosine_direction(float4 norm, uint * seed) {
+	float u = rand_float(seed);
+	float phi = 2.0f * M_PI_F * rand_float(seed);
+	float r = sqrt(u);
+
+	float3 n = normalize(norm.xyz);
+	float3 t = normalize(cross(fabs(n.x) > 0.5f ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f), n));
+	float3 b = cross(n, t);
+	return (float4)(t * (r * cos(phi)) + b * (r * sin(phi)) + n * sqrt(1.0f - u), 0.0f);
+}
+
+uint hash_uint(uint x) {
+	// Thomas Wang's integer hash
+	x = (x ^ 61u) ^ (x >> 16);
+	x *= 9u;
+	x ^= x >> 4;
+	x *= 0x27d4eb2du;
+	x ^= x >> 15;
+	return x;
 }
 
 
@@ -173,6 +1165,367 @@ float4 color_for_ray(
  * Ray Tests.
  * -------------------- */
 
+/**
+ * @brief Closest hit of 'ray' against whichever geometry the scene uses.
+ * @return Index of the surface hit, or -1 on a miss.
+ */
+int intersect_scene(float8 ray, const scene_data * scene, float4 * intersect, float4 * norm) {
+#ifdef COMPRESSED_GEOMETRY
+	int hit = intersect_chunks(ray, scene, intersect, norm);
+#elif defined USE_BVH
+	int hit = intersect_bvh(ray, scene, intersect, norm);
+#else
+	int hit = scene->tile_prims ?
+		intersect_tile(ray, scene, intersect, norm) :
+		intersect_ray_surfaces(ray, scene->surfaces, scene->n_surfaces, intersect, norm);
+#endif
+
+	if (scene->sphere_nodes) {
+		ray.hi = normalize(ray.hi);
+		float dist = hit >= 0 ? length(*intersect - ray.lo) : INFINITY;
+		int sphere = intersect_spheres(ray, scene, &dist);
+
+		if (sphere >= 0) {
+			float4 center = (float4)(scene->spheres[sphere].xyz, ray.lo.w);
+			*intersect = ray.lo + ray.hi * dist;
+			*norm = normalize(*intersect - center);
+			hit = SPHERE_HIT | sphere;
+		}
+	}
+
+	return hit;
+}
+
+/**
+ * @brief Any-hit test of 'ray' against whichever geometry the scene uses.
+ * @param blocker (input/output) Blocker of the previous sample, see occluded(...).
+ */
+bool occluded_scene(float8 ray, float max_dist, const scene_data * scene, int * blocker) {
+#ifdef COMPRESSED_GEOMETRY
+	if (occluded_chunks(ray, max_dist, scene, blocker)) {
+#elif defined USE_BVH
+	if (occluded_bvh(ray, max_dist, scene, blocker)) {
+#else
+	if (occluded(ray, max_dist, scene->surfaces, scene->n_surfaces, blocker)) {
+#endif
+		return true;
+	}
+
+	return scene->sphere_nodes && occluded_spheres(ray, max_dist, scene);
+}
+
+/**
+ * @brief Closest hit against the device sphere set, walking its BVH
+ * through the escape links without a stack.
+ * @param ray (input) Ray with a normalized direction.
+ * @param min_dist (input/output) Closest hit so far, updated on a closer hit.
+ * @return Index of the sphere hit closer than min_dist, or -1.
+ */
+int intersect_spheres(float8 ray, const scene_data * scene, float * min_dist) {
+	float4 inv_dir = 1.0f / ray.hi;
+	int hit = -1;
+
+	int node = 0;
+	while (node >= 0) {
+		bvh_node b = scene->sphere_nodes[node];
+		int child = bvh_child(b);
+
+		if (!intersect_ray_box(ray.lo, inv_dir, b.lo, b.hi, *min_dist)) {
+			node = bvh_escape(b);
+		} else if (child >= 0) {
+			node = child;
+		} else {
+			float4 sphere = (float4)(scene->spheres[-child - 1].xyz, scene->sphere_radius);
+			float d = distance_ray_sphere(ray, sphere);
+			if (d > EPSILON && d < *min_dist) {
+				*min_dist = d;
+				hit = -child - 1;
+			}
+			node = bvh_escape(b);
+		}
+	}
+
+	return hit;
+}
+
+/**
+ * @brief Any-hit test against the device sphere set.
+ */
+bool occluded_spheres(float8 ray, float max_dist, const scene_data * scene) {
+	float4 inv_dir = 1.0f / ray.hi;
+
+	int node = 0;
+	while (node >= 0) {
+		bvh_node b = scene->sphere_nodes[node];
+		int child = bvh_child(b);
+
+		if (!intersect_ray_box(ray.lo, inv_dir, b.lo, b.hi, max_dist)) {
+			node = bvh_escape(b);
+		} else if (child >= 0) {
+			node = child;
+		} else {
+			float4 sphere = (float4)(scene->spheres[-child - 1].xyz, scene->sphere_radius);
+			float d = distance_ray_sphere(ray, sphere);
+			if (d > EPSILON && d < max_dist) {
+				return true;
+			}
+			node = bvh_escape(b);
+		}
+	}
+
+	return false;
+}
+
+/**
+ * @brief Distance to the first intersection of a ray with a normalized
+ * direction and the sphere { pos.x, pos.y, pos.z, radius }.
+ * @return Distance along the ray, or -1 on a miss.
+ */
+float distance_ray_sphere(float8 ray, float4 sphere) {
+	float3 oc = ray.lo.xyz - sphere.xyz;
+	float b = dot(oc, ray.hi.xyz);
+	float c = dot(oc, oc) - sphere.w * sphere.w;
+	float delta = b * b - c;
+	if (delta < 0.0f) { return -1.0f; }
+
+	float root = sqrt(delta);
+	return -b - root > EPSILON ? -b - root : -b + root;
+}
+
+#ifdef USE_BVH
+
+/**
+ * @brief Closest hit against the triangles through the device built BVH,
+ * subtrees whose bounds the ray misses (or only hits beyond the closest
+ * hit so far) are skipped through their escape links.
+ * @return Index of the triangle hit, or -1 on a miss.
+ */
+int intersect_bvh(float8 ray, const scene_data * scene, float4 * intersect, float4 * norm) {
+	ray.hi = normalize(ray.hi);
+	float4 inv_dir = 1.0f / ray.hi;
+
+	int hit = -1;
+	float min_dist = INFINITY;
+
+	int node = 0;
+	while (node >= 0) {
+		bvh_node b = scene->triangle_nodes[node];
+		int child = bvh_child(b);
+
+		if (!intersect_ray_box(ray.lo, inv_dir, b.lo, b.hi, min_dist)) {
+			node = bvh_escape(b);
+		} else if (child >= 0) {
+			node = child;
+		} else {
+			float d = bvh_triangle_distance(ray, scene, -child - 1);
+			if (d > EPSILON && d < min_dist) {
+				min_dist = d;
+				hit = -child - 1;
+			}
+			node = bvh_escape(b);
+		}
+	}
+
+	if (hit >= 0) {
+		// triangles are two sided, the normal always faces the ray
+		__global float * p = scene->g_surfaces + hit * TRIANGLE_SIZE + 1;
+		float4 p1 = (float4)(vload3(0, p), 0.0f);
+		float4 n = normalize(cross((float4)(vload3(0, p + 4), 0.0f) - p1,
+				(float4)(vload3(0, p + 8), 0.0f) - p1));
+		*intersect = ray.lo + ray.hi * min_dist;
+		*norm = dot(n, ray.hi) > 0.0f ? -n : n;
+	}
+
+	return hit;
+}
+
+/**
+ * @brief Any-hit test against the triangles through the device built BVH.
+ * @param blocker (input/output) Triangle which blocked the previous sample, or -1.
+ */
+bool occluded_bvh(float8 ray, float max_dist, const scene_data * scene, int * blocker) {
+	if (*blocker >= 0) {
+		float d = bvh_triangle_distance(ray, scene, *blocker);
+		if (d > EPSILON && d < max_dist) {
+			return true;
+		}
+	}
+
+	float4 inv_dir = 1.0f / ray.hi;
+	int node = 0;
+	while (node >= 0) {
+		bvh_node b = scene->triangle_nodes[node];
+		int child = bvh_child(b);
+
+		if (!intersect_ray_box(ray.lo, inv_dir, b.lo, b.hi, max_dist)) {
+			node = bvh_escape(b);
+		} else if (child >= 0) {
+			node = child;
+		} else {
+			float d = bvh_triangle_distance(ray, scene, -child - 1);
+			if (d > EPSILON && d < max_dist) {
+				*blocker = -child - 1;
+				return true;
+			}
+			node = bvh_escape(b);
+		}
+	}
+
+	return false;
+}
+
+/**
+ * @brief Distance along 'ray' to triangle 't' of g_surfaces, see distance_ray_triangle(...).
+ */
+float bvh_triangle_distance(float8 ray, const scene_data * scene, int t) {
+	__global float * p = scene->g_surfaces + t * TRIANGLE_SIZE + 1;
+	return distance_ray_triangle(ray,
+			(float4)(vload3(0, p), 0.0f),
+			(float4)(vload3(0, p + 4), 0.0f),
+			(float4)(vload3(0, p + 8), 0.0f));
+}
+
+#endif
+
+#ifdef COMPRESSED_GEOMETRY
+
+/**
+ * @brief Closest hit against the compressed triangles, chunks whose
+ * bounds the ray misses (or only hits beyond the closest hit so far)
+ * are skipped entirely.
+ * @return Index of the triangle hit, or -1 on a miss.
+ */
+int intersect_chunks(float8 ray, const scene_data * scene, float4 * intersect, float4 * norm) {
+	ray.hi = normalize(ray.hi);
+	float4 inv_dir = 1.0f / ray.hi;
+
+	int hit = -1;
+	uint hit_normal = 0;
+	float min_dist = INFINITY;
+
+	for (int c = 0; c < scene->n_chunks; c++) {
+		geometry_chunk chunk = scene->chunks[c];
+		if (!intersect_ray_box(ray.lo, inv_dir, chunk.lo, chunk.hi, min_dist)) {
+			continue;
+		}
+
+		for (uint t = 0; t < chunk.triangle_count; t++) {
+			float4 p1, p2, p3;
+			compressed_triangle(scene, chunk, t, &p1, &p2, &p3);
+
+			float d = distance_ray_triangle(ray, p1, p2, p3);
+			if (d > EPSILON && d < min_dist) {
+				__global ushort * tri = scene->c_triangles +
+					(chunk.triangle_offset + t) * COMPRESSED_TRIANGLE_SIZE;
+
+				min_dist = d;
+				hit = chunk.triangle_offset + t;
+				hit_normal = tri[3] | ((uint)tri[4] << 16);
+			}
+		}
+	}
+
+	if (hit >= 0) {
+		// triangles are two sided, the normal always faces the ray
+		float4 n = decode_octahedral(hit_normal);
+		*intersect = ray.lo + ray.hi * min_dist;
+		*norm = dot(n, ray.hi) > 0.0f ? -n : n;
+	}
+
+	return hit;
+}
+
+/**
+ * @brief Any-hit test against the compressed triangles.
+ * @param blocker (input/output) Triangle which blocked the previous sample, or -1.
+ */
+bool occluded_chunks(float8 ray, float max_dist, const scene_data * scene, int * blocker) {
+	float4 inv_dir = 1.0f / ray.hi;
+
+	// every chunk but the last holds exactly CHUNK_TRIANGLES triangles
+	if (*blocker >= 0) {
+		float4 p1, p2, p3;
+		geometry_chunk chunk = scene->chunks[*blocker / CHUNK_TRIANGLES];
+		compressed_triangle(scene, chunk, *blocker - chunk.triangle_offset, &p1, &p2, &p3);
+
+		float d = distance_ray_triangle(ray, p1, p2, p3);
+		if (d > EPSILON && d < max_dist) {
+			return true;
+		}
+	}
+
+	for (int c = 0; c < scene->n_chunks; c++) {
+		geometry_chunk chunk = scene->chunks[c];
+		if (!intersect_ray_box(ray.lo, inv_dir, chunk.lo, chunk.hi, max_dist)) {
+			continue;
+		}
+
+		for (uint t = 0; t < chunk.triangle_count; t++) {
+			float4 p1, p2, p3;
+			compressed_triangle(scene, chunk, t, &p1, &p2, &p3);
+
+			float d = distance_ray_triangle(ray, p1, p2, p3);
+			if (d > EPSILON && d < max_dist) {
+				*blocker = chunk.triangle_offset + t;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/**
+ * @brief Decodes the vertices of triangle 't' of 'chunk'.
+ */
+void compressed_triangle(const scene_data * scene, geometry_chunk chunk, uint t,
+		float4 * p1, float4 * p2, float4 * p3) {
+
+	__global ushort * tri = scene->c_triangles + (chunk.triangle_offset + t) * COMPRESSED_TRIANGLE_SIZE;
+	float3 scale = (chunk.hi.xyz - chunk.lo.xyz) / 65535.0f;
+
+	float3 q1 = convert_float3(vload3(chunk.vertex_offset + tri[0], scene->c_vertices));
+	float3 q2 = convert_float3(vload3(chunk.vertex_offset + tri[1], scene->c_vertices));
+	float3 q3 = convert_float3(vload3(chunk.vertex_offset + tri[2], scene->c_vertices));
+
+	*p1 = (float4)(chunk.lo.xyz + q1 * scale, 1.0f);
+	*p2 = (float4)(chunk.lo.xyz + q2 * scale, 1.0f);
+	*p3 = (float4)(chunk.lo.xyz + q3 * scale, 1.0f);
+}
+
+/**
+ * @brief Inverse of encode_octahedral(...) in compress.c.
+ */
+float4 decode_octahedral(uint n) {
+	float2 f = (float2)(n & 0xFFFF, n >> 16) / 65535.0f * 2.0f - 1.0f;
+	float3 v = (float3)(f, 1.0f - fabs(f.x) - fabs(f.y));
+
+	// unfold the lower hemisphere
+	float t = max(-v.z, 0.0f);
+	v.x += v.x >= 0.0f ? -t : t;
+	v.y += v.y >= 0.0f ? -t : t;
+
+	return (float4)(normalize(v), 0.0f);
+}
+
+#endif
+
+/**
+ * @brief Slab test of a ray against an axis aligned box.
+ * @param inv_dir (input) Reciprocal of the ray direction.
+ * @param max_dist (input) Boxes entered at or beyond this distance are missed.
+ */
+bool intersect_ray_box(float4 origin, float4 inv_dir, float4 lo, float4 hi, float max_dist) {
+	float3 t0 = (lo.xyz - origin.xyz) * inv_dir.xyz;
+	float3 t1 = (hi.xyz - origin.xyz) * inv_dir.xyz;
+	float3 t_min = fmin(t0, t1);
+	float3 t_max = fmax(t0, t1);
+
+	float t_enter = max(max(t_min.x, t_min.y), max(t_min.z, 0.0f));
+	float t_exit = min(min(t_max.x, t_max.y), t_max.z);
+	return t_enter <= t_exit && t_enter < max_dist;
+}
+
 int intersect_ray_surfaces(float8 ray, __read_only __local float * surfaces,
 		int n_surfaces, float4 * intersect, float4 * norm) {
 
@@ -201,6 +1554,145 @@ int intersect_ray_surfaces(float8 ray, __read_only __local float * surfaces,
 	 return hit;
 }
 
+/**
+ * @brief Any-hit visibility test used for shadow rays.
+ * Returns as soon as any surface blocks 'ray' closer than 'max_dist',
+ * intersection points and normals are never computed.
+ * @param ray (input) Ray with a normalized direction.
+ * @param max_dist (input) Surfaces at or beyond this distance do not block the ray.
+ * @param blocker (input/output) Offset into 'surfaces' of the surface which
+ * 	blocked the previous sample (tested first), or -1 for none.
+ */
+bool occluded(float8 ray, float max_dist, __read_only __local float * surfaces,
+		int n_surfaces, int * blocker) {
+
+	if (*blocker >= 0 && occludes_surface(ray, max_dist, surfaces + *blocker)) {
+		return true;
+	}
+
+	int offset = 0;
+	for (int i=0; i<n_surfaces; i++) {
+		if (offset != *blocker && occludes_surface(ray, max_dist, surfaces + offset)) {
+			*blocker = offset;
+			return true;
+		}
+
+		offset += size_of_surface(surfaces + offset);
+	}
+
+	return false;
+}
+
+bool occludes_surface(float8 ray, float max_dist, __read_only __local float * surface_p) {
+	if (fabs(surface_p[0] - SURFACE_TRIANGLE) < EPSILON) {
+		float4 p1 = (float4)(surface_p[1], surface_p[2], surface_p[3], surface_p[4]);
+		float4 p2 = (float4)(surface_p[5], surface_p[6], surface_p[7], surface_p[8]);
+		float4 p3 = (float4)(surface_p[9], surface_p[10], surface_p[11], surface_p[12]);
+		float d = distance_ray_triangle(ray, p1, p2, p3);
+		return d > EPSILON && d < max_dist;
+	}
+
+	float4 tmp_i;
+	return intersect_ray_surface(ray, surface_p, &tmp_i, NULL)
+		&& length(tmp_i - ray.lo) < max_dist;
+}
+
+/**
+ * @brief Closest hit of a primary ray against the surfaces in the
+ * frustum of its tile, scene->tile_prims, see cull_tile(...).
+ * @return Index of the surface hit, or -1 on a miss.
+ */
+int intersect_tile(float8 ray, const scene_data * scene, float4 * intersect, float4 * norm) {
+	int hit = -1;
+	float min_dist = INFINITY;
+	float4 tmp_i, tmp_n;
+
+	for (int k = 0; k < scene->n_tile_prims; k++) {
+		int i = scene->tile_prims[k];
+		if (intersect_ray_surface(ray, scene->surfaces + i * TRIANGLE_SIZE, &tmp_i, &tmp_n)) {
+			float dist = length(tmp_i - ray.lo);
+
+			if (dist < min_dist) {
+				*intersect = tmp_i;
+				*norm = tmp_n;
+
+				hit = i;
+				min_dist = dist;
+			}
+		}
+	}
+
+	return hit;
+}
+
+/**
+ * @brief Culls the surfaces against the frustum of the pixels in
+ * [tile_lo, tile_hi), the work items of the group test a share of
+ * the surfaces each and append the survivors to 'prims'. Sets
+ * scene->tile_prims when every survivor fits in TILE_PRIMS. Every
+ * surface is a triangle record (see make_triangle(...)).
+ * Must be called by every work item in the work group.
+ */
+void cull_tile(
+		scene_data * scene,
+		int2 tile_lo, int2 tile_hi, int2 resolution,
+		float4 camera_pos, float4 camera_look, float4 camera_right, float4 camera_up,
+		__local ushort * prims,
+		__local int * count) {
+
+	int l_id = get_local_id(1) * get_local_size(0) + get_local_id(0);
+	int group = get_local_size(0) * get_local_size(1);
+
+	if (l_id == 0) { *count = 0; }
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// the side planes pass through the camera and neighboring corner rays,
+	// with a plane facing along the view to drop surfaces behind the camera
+	float3 c00 = calculate_ray(camera_pos, camera_look, camera_right, camera_up,
+			(float2)(tile_lo.x, tile_lo.y), resolution).hi.xyz;
+	float3 c10 = calculate_ray(camera_pos, camera_look, camera_right, camera_up,
+			(float2)(tile_hi.x, tile_lo.y), resolution).hi.xyz;
+	float3 c11 = calculate_ray(camera_pos, camera_look, camera_right, camera_up,
+			(float2)(tile_hi.x, tile_hi.y), resolution).hi.xyz;
+	float3 c01 = calculate_ray(camera_pos, camera_look, camera_right, camera_up,
+			(float2)(tile_lo.x, tile_hi.y), resolution).hi.xyz;
+	float3 center = c00 + c10 + c11 + c01;
+
+	float3 planes[5] = {
+		cross(c00, c10), cross(c10, c11), cross(c11, c01), cross(c01, c00), camera_look.xyz
+	};
+	for (int p = 0; p < 5; p++) {
+		planes[p] = normalize(planes[p]);
+		if (dot(planes[p], center) < 0.0f) { planes[p] = -planes[p]; }
+	}
+
+	for (int i = l_id; i < scene->n_surfaces; i += group) {
+		__local float * t = scene->surfaces + i * TRIANGLE_SIZE + 1;
+		float3 p1 = (float3)(t[0], t[1], t[2]) - camera_pos.xyz;
+		float3 p2 = (float3)(t[4], t[5], t[6]) - camera_pos.xyz;
+		float3 p3 = (float3)(t[8], t[9], t[10]) - camera_pos.xyz;
+
+		// outside when every vertex lies behind the same plane
+		bool outside = false;
+		for (int p = 0; p < 5 && !outside; p++) {
+			outside = dot(planes[p], p1) < -EPSILON &&
+				dot(planes[p], p2) < -EPSILON &&
+				dot(planes[p], p3) < -EPSILON;
+		}
+
+		if (!outside) {
+			int slot = atomic_inc(count);
+			if (slot < TILE_PRIMS) { prims[slot] = (ushort)i; }
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// an overflowing tile falls back to testing every surface
+	int n = *count;
+	scene->tile_prims = n <= TILE_PRIMS ? prims : NULL;
+	scene->n_tile_prims = n;
+}
+
 int size_of_surface(__read_only __local float * surface_p) {
 	const float surface_id = *surface_p;
 
@@ -300,7 +1792,7 @@ bool intersect_ray_plane(float8 ray, float8 plane, float4 * intersect, float4 *
 
 	if (d > EPSILON) {
 		(*intersect) = ray.lo + ray.hi * d;
-		(*norm) = -plane.hi;
+		if (norm) { (*norm) = -plane.hi; }
 		return true;
 	}
 
@@ -340,6 +1832,30 @@ bool intersect_ray_triangle(float8 ray,
 	return false;
 }
 
+/**
+ * @brief Two sided Moller-Trumbore ray/triangle test.
+ * @return Distance along the ray direction to the intersection, or -1 on a miss.
+ */
+float distance_ray_triangle(float8 ray, float4 p1, float4 p2, float4 p3) {
+	float4 e1 = p2 - p1;
+	float4 e2 = p3 - p1;
+
+	float4 p = cross(ray.hi, e2);
+	float det = dot(e1, p);
+	if (fabs(det) < EPSILON * EPSILON) { return -1.0f; }
+	float inv_det = 1.0f / det;
+
+	float4 t = ray.lo - p1;
+	float u = dot(t, p) * inv_det;
+	if (u < 0.0f || u > 1.0f) { return -1.0f; }
+
+	float4 q = cross(t, e1);
+	float v = dot(ray.hi, q) * inv_det;
+	if (v < 0.0f || u + v > 1.0f) { return -1.0f; }
+
+	return dot(e2, q) * inv_det;
+}
+
 /* --------------------
  * Utility Functions.
  * -------------------- */
@@ -347,7 +1863,9 @@ bool intersect_ray_triangle(float8 ray,
 /**
  * @brief
  * Given the input camera information, 
- * calculate the ray to shoot for the current work item.
+ * calculate the ray passing through 'pixel'.
+ * @param pixel Image coordinate of the ray, fractional values select sub-pixels.
+ * @param resolution The output image resolution.
  * @return Two concatenated vectors.
  * 	The first 4 floats describe vector position (the camera position).
  * 	The second 4 floats describe vector direction.
@@ -356,26 +1874,35 @@ float8 calculate_ray (
         float4 camera_pos,
         float4 camera_look,
         float4 camera_right,
-        float4 camera_up
+        float4 camera_up,
+        float2 pixel,
+        int2 resolution
     ) {
 
-    // the output image resolution -> global work size
-    int screen_w = get_global_size(0);
-    int screen_h = get_global_size(1);
-
-    // the local (x, y) coordinate described relative to the global work size
-    int x_pos = get_global_id(0);
-    int y_pos = get_global_id(1);
-
     // calculate our coordinate as a percentage
-    float x_perc = (x_pos / (float)screen_w) - 0.5;
-    float y_perc = (y_pos / (float)screen_h) - 0.5;
+    float x_perc = (pixel.x / (float)resolution.x) - 0.5;
+    float y_perc = (pixel.y / (float)resolution.y) - 0.5;
 
     // compute the ray we will use for this work item
     float4 dir = normalize(camera_look + camera_up * -y_perc + camera_right * x_perc);
     return (float8){ camera_pos.xyz, 0.0, dir };
 }
 
+/**
+ * @brief Check for a discontinuity between neighboring pixels 'p' and 'n'.
+ * Pixels differ if they hit different primitives, their relative depth
+ * differs by more than 'threshold', or any color channel does.
+ */
+bool is_edge_pixel(pixel_sample p, pixel_sample n, float threshold) {
+    if (p.hit != n.hit) { return true; }
+
+    float d = fabs(p.depth - n.depth);
+    if (d > threshold * max(p.depth, n.depth)) { return true; }
+
+    float4 c = fabs(p.color - n.color);
+    return max(max(c.x, c.y), c.z) > threshold;
+}
+
 float scalar_for_lighting(float4 l_dir, float4 norm) {
     return max(min(dot(l_dir, normalize(norm)), 1.0f), 0.0f);
 }
@@ -387,6 +1914,38 @@ float specular_for_lighting(float8 ray, float4 l_dir, float4 norm, material mat)
     return mat.spec_scalar * pow(blinn, mat.spec_power);
 }
 
+/**
+ * @brief Picks a light index from the alias table in constant time.
+ * @param pdf (output) Probability of the returned light being selected.
+ */
+int sample_light(const scene_data * scene, uint * seed, float * pdf) {
+    float u = rand_float(seed) * scene->n_lights;
+    int slot = min((int)u, scene->n_lights - 1);
+    light_alias entry = scene->light_table[slot];
+
+    int index = (u - slot) < entry.prob ? slot : entry.alias;
+    *pdf = scene->lights[index].pdf;
+    return index;
+}
+
+float4 point_on_light(light l, uint * seed) {
+    if (l.type == LIGHT_SPHERE) {
+        return point_on_sphere(l.pos, seed);
+    } else if (l.type == LIGHT_TRIANGLE) {
+        // uniformly distributed over the triangle
+        float u = rand_float(seed);
+        float v = rand_float(seed);
+        if (u + v > 1.0f) {
+            u = 1.0f - u;
+            v = 1.0f - v;
+        }
+
+        return (float4)(l.pos.xyz, 1.0f) + l.edge1 * u + l.edge2 * v;
+    }
+
+    return (float4)(l.pos.xyz, 1.0f);
+}
+
 float4 point_on_sphere(float4 sphere, uint * seed) {
     float mil = 100000.0f;
     float4 r = (float4){
@@ -423,6 +1982,11 @@ float4 bary_centric(float4 P, float4 p1, float4 p2, float4 p3) {
 	return (float4)(w1, w2, w3, 0.0);
 }
 
+float rand_float(uint * seed) {
+    float mil = 100000.0f;
+    return (rand(seed) % (int)mil) / mil;
+}
+
 uint rand(uint * seed) {
 	int screen_w = get_global_size(0);
 	int x_pos = get_global_id(0);
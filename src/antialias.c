@@ -0,0 +1,92 @@
+#include "antialias.h"
+#include "kernel_args.h"
+
+cl_kernel refine_kernel;
+
+static cl_kernel edge_kernel;
+static cl_mem samples;
+static cl_mem work_count;
+static cl_mem work_list;
+
+// work group size used for the 1D refinement pass
+static const size_t refine_local = 64;
+
+void init_antialias(unsigned w, unsigned h) {
+    int err = CL_SUCCESS;
+
+    edge_kernel = create_kernel("detect_edges");
+    refine_kernel = create_kernel("refine_edges");
+
+    samples = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                             sizeof(pixel_sample) * w * h, NULL, &err);
+    cl_check_err(err, "clCreateBuffer(...)");
+    work_count = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                sizeof(cl_uint), NULL, &err);
+    cl_check_err(err, "clCreateBuffer(...)");
+    work_list = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                               sizeof(cl_uint) * w * h, NULL, &err);
+    cl_check_err(err, "clCreateBuffer(...)");
+
+    // the first pass records its primary visibility here
+    err  = clSetKernelArg(kernel, ARG_KERNEL_SPECIFIC, sizeof(cl_mem), &samples);
+
+    err |= clSetKernelArg(edge_kernel, 0, sizeof(cl_mem), &samples);
+    err |= clSetKernelArg(edge_kernel, 2, sizeof(cl_mem), &work_count);
+    err |= clSetKernelArg(edge_kernel, 3, sizeof(cl_mem), &work_list);
+
+    err |= clSetKernelArg(refine_kernel, ARG_KERNEL_SPECIFIC, sizeof(cl_mem), &work_list);
+    cl_check_err(err, "clSetKernelArg(...)");
+}
+
+unsigned render_antialias(unsigned w, unsigned h, float threshold, unsigned sub_samples) {
+    static const cl_uint zero = 0;
+    int err = CL_SUCCESS;
+    cl_uint n_work = 0;
+
+    err = clEnqueueWriteBuffer(command_queue, work_count, CL_FALSE, 0,
+                               sizeof(cl_uint), &zero, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueWriteBuffer(...)");
+
+    // flag and compact every pixel lying on an edge, in whole work groups
+    const size_t edge_local[] = {8, 8};
+    const size_t edge_global[] = {
+        (w + edge_local[0] - 1) / edge_local[0] * edge_local[0],
+        (h + edge_local[1] - 1) / edge_local[1] * edge_local[1]
+    };
+    const cl_int resolution[] = {(cl_int)w, (cl_int)h};
+    err  = clSetKernelArg(edge_kernel, 1, sizeof(float), &threshold);
+    err |= clSetKernelArg(edge_kernel, 4, sizeof(resolution), resolution);
+    cl_check_err(err, "clSetKernelArg(...)");
+    err = clEnqueueNDRangeKernel(command_queue, edge_kernel, 2,
+                                 NULL, edge_global, edge_local, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueNDRangeKernel(...)");
+
+    // the size of the work list decides the size of the refinement pass
+    err = clEnqueueReadBuffer(command_queue, work_count, CL_TRUE, 0,
+                              sizeof(cl_uint), &n_work, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueReadBuffer(...)");
+    if (n_work == 0) {
+        return 0;
+    }
+
+    const size_t refine_global[] = {
+        (n_work + refine_local - 1) / refine_local * refine_local
+    };
+    cl_int n = (cl_int)sub_samples;
+    err  = clSetKernelArg(refine_kernel, ARG_KERNEL_SPECIFIC + 1, sizeof(cl_uint), &n_work);
+    err |= clSetKernelArg(refine_kernel, ARG_KERNEL_SPECIFIC + 2, sizeof(cl_int), &n);
+    cl_check_err(err, "clSetKernelArg(...)");
+    err = clEnqueueNDRangeKernel(command_queue, refine_kernel, 1,
+                                 NULL, refine_global, &refine_local, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueNDRangeKernel(...)");
+
+    return n_work;
+}
+
+void release_antialias() {
+    clReleaseMemObject(samples);
+    clReleaseMemObject(work_count);
+    clReleaseMemObject(work_list);
+    clReleaseKernel(edge_kernel);
+    clReleaseKernel(refine_kernel);
+}
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+/**
+ Start of the storage following a block header.
+ */
+static unsigned char * block_data(arena_block * block) {
+    return (unsigned char *)(block + 1);
+}
+
+void init_arena(arena * a, size_t block_size) {
+    a->head = NULL;
+    a->block_size = block_size ? block_size : ARENA_BLOCK_SIZE;
+    a->allocated = 0;
+}
+
+/**
+ Takes 'size' bytes aligned to 'alignment' from the free space of 'block'.
+ \return NULL if the block does not have enough space left.
+ */
+static void * bump(arena_block * block, size_t size, size_t alignment) {
+    uintptr_t start = (uintptr_t)(block_data(block) + block->used);
+    uintptr_t aligned = (start + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    size_t padding = aligned - start;
+
+    if (block->used + padding + size > block->size) {
+        return NULL;
+    }
+
+    block->used += padding + size;
+    return (void *)aligned;
+}
+
+void * arena_alloc_aligned(arena * a, size_t size, size_t alignment) {
+    void * p = a->head ? bump(a->head, size, alignment) : NULL;
+    if (p) {
+        a->allocated += size;
+        return p;
+    }
+
+    // room for the worst case padding, so the request always fits the new block
+    size_t block_size = size + alignment > a->block_size ? size + alignment : a->block_size;
+    arena_block * block = (arena_block *)malloc(sizeof(arena_block) + block_size);
+    if (!block) {
+        fprintf(stderr, "failed to allocate an arena block of %zu bytes\n", block_size);
+        exit(EXIT_FAILURE);
+    }
+    block->size = block_size;
+    block->used = 0;
+
+    if (a->head && block_size > a->block_size) {
+        // an oversized block is used up at once, keep filling the current one
+        block->next = a->head->next;
+        a->head->next = block;
+    } else {
+        block->next = a->head;
+        a->head = block;
+    }
+
+    a->allocated += size;
+    return bump(block, size, alignment);
+}
+
+void * arena_alloc(arena * a, size_t size) {
+    return arena_alloc_aligned(a, size, ARENA_ALIGNMENT);
+}
+
+void release_arena(arena * a) {
+    while (a->head) {
+        arena_block * next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->allocated = 0;
+}
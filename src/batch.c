@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "batch.h"
+#include "host_buffer.h"
+
+/**
+ A pinned host buffer and the frame being read back into it.
+ */
+typedef struct {
+    host_buffer buffer;
+    void * pixels; // mapped for the lifetime of the writer
+    cl_event ready;
+    unsigned frame;
+    bool busy;
+} frame_slot;
+
+static frame_slot slots[FRAME_SLOTS];
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_free = PTHREAD_COND_INITIALIZER;
+
+static cl_mem frame_image;
+static unsigned frame_w, frame_h;
+static const char * frame_prefix;
+static int frame_format;
+static thread_pool * writers;
+
+keyframe * load_keyframes(const char * filename, size_t * count) {
+    FILE * f = fopen(filename, "r");
+    if (!f) {
+        printf("failed to open file: %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t capacity = 16;
+    keyframe * keys = (keyframe *)malloc(sizeof(keyframe) * capacity);
+    *count = 0;
+
+    char line[512];
+    float v[10];
+    while (fgets(line, sizeof(line), f)) {
+        char first[16];
+        if (sscanf(line, "%15s", first) != 1 || first[0] == '#') {
+            continue;
+        }
+
+        if (sscanf(line, "%f %f %f %f %f %f %f %f %f %f",
+                    &v[0], &v[1], &v[2], &v[3], &v[4],
+                    &v[5], &v[6], &v[7], &v[8], &v[9]) != 10) {
+            printf("skipping malformed keyframe: %s", line);
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity *= 2;
+            keys = (keyframe *)realloc(keys, sizeof(keyframe) * capacity);
+        }
+
+        keys[(*count)++] = (keyframe){
+            v[0],
+            vector3_init(v[1], v[2], v[3]),
+            vector3_init(v[4], v[5], v[6]),
+            vector3_init(v[7], v[8], v[9])
+        };
+    }
+
+    fclose(f);
+
+    if (*count == 0) {
+        printf("no keyframes in file: %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    return keys;
+}
+
+static vector4 lerp(vector4 a, vector4 b, float t) {
+    return vector3_init(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+}
+
+keyframe sample_keyframes(const keyframe * keys, size_t count, float time) {
+    if (time <= keys[0].time) {
+        return keys[0];
+    }
+
+    for (size_t i = 1; i < count; i++) {
+        if (time < keys[i].time) {
+            const keyframe * a = &keys[i - 1];
+            const keyframe * b = &keys[i];
+            float t = (time - a->time) / (b->time - a->time);
+
+            return (keyframe){
+                time,
+                lerp(a->camera, b->camera, t),
+                lerp(a->target, b->target, t),
+                lerp(a->light, b->light, t)
+            };
+        }
+    }
+
+    return keys[count - 1];
+}
+
+void init_frame_writer(cl_mem image, unsigned w, unsigned h,
+                       const char * prefix, int format, thread_pool * pool) {
+    size_t pixel = format == FRAME_PFM ? sizeof(cl_half) * 4 : sizeof(cl_uchar) * 4;
+    size_t size = pixel * w * h;
+
+    frame_image = image;
+    frame_w = w;
+    frame_h = h;
+    frame_prefix = prefix;
+    frame_format = format;
+    writers = pool;
+
+    // host buffers are page locked by most drivers, or the device's own memory
+    // on unified devices, so reads into them run while the device keeps working
+    for (unsigned i = 0; i < FRAME_SLOTS; i++) {
+        init_host_buffer(&slots[i].buffer, size, CL_MEM_READ_WRITE);
+        slots[i].pixels = map_host_buffer(&slots[i].buffer, CL_MAP_READ | CL_MAP_WRITE);
+        slots[i].busy = false;
+    }
+}
+
+unsigned acquire_frame_slot(unsigned frame) {
+    unsigned slot = frame % FRAME_SLOTS;
+
+    pthread_mutex_lock(&slot_lock);
+    while (slots[slot].busy) {
+        pthread_cond_wait(&slot_free, &slot_lock);
+    }
+    slots[slot].busy = true;
+    slots[slot].frame = frame;
+    pthread_mutex_unlock(&slot_lock);
+
+    return slot;
+}
+
+void save_ppm_frame(const char * prefix, unsigned frame,
+                    const cl_uchar * pixels, unsigned w, unsigned h) {
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s%04u.ppm", prefix, frame);
+    FILE * f = fopen(filename, "wb");
+    if (!f) {
+        printf("failed to open file: %s\n", filename);
+        return;
+    }
+
+    fprintf(f, "P6\n%u %u\n255\n", w, h);
+    unsigned char * rgb = (unsigned char *)malloc(3 * w);
+    for (unsigned y = 0; y < h; y++) {
+        for (unsigned x = 0; x < w; x++) {
+            const cl_uchar * p = pixels + 4 * (y * w + x);
+            rgb[3 * x] = p[0];
+            rgb[3 * x + 1] = p[1];
+            rgb[3 * x + 2] = p[2];
+        }
+        fwrite(rgb, 1, 3 * w, f);
+    }
+    free(rgb);
+    fclose(f);
+}
+
+/**
+ Widens an IEEE 754 half, the format of FRAME_PFM frames on the device.
+ */
+static float half_to_float(cl_half h) {
+    int exponent = (h >> 10) & 0x1F;
+    int mantissa = h & 0x3FF;
+    float v = exponent == 0x1F ? (mantissa ? NAN : INFINITY) :
+              exponent == 0 ? ldexpf((float)mantissa, -24) :
+              ldexpf((float)(mantissa | 0x400), exponent - 25);
+    return (h & 0x8000) ? -v : v;
+}
+
+/**
+ Writes the slot's pixels in the configured format. Runs on a writer thread.
+ */
+static void write_slot(void * arg) {
+    frame_slot * slot = (frame_slot *)arg;
+
+    clWaitForEvents(1, &slot->ready);
+    clReleaseEvent(slot->ready);
+
+    if (frame_format == FRAME_PPM) {
+        save_ppm_frame(frame_prefix, slot->frame, (const cl_uchar *)slot->pixels, frame_w, frame_h);
+    } else {
+        char filename[1024];
+        snprintf(filename, sizeof(filename), "%s%04u.pfm", frame_prefix, slot->frame);
+        FILE * f = fopen(filename, "wb");
+        if (!f) {
+            printf("failed to open file: %s\n", filename);
+        } else {
+            // little endian floats, rows stored bottom to top
+            fprintf(f, "PF\n%u %u\n-1.0\n", frame_w, frame_h);
+            float * rgb = (float *)malloc(sizeof(float) * 3 * frame_w);
+            for (unsigned y = frame_h; y-- > 0; ) {
+                for (unsigned x = 0; x < frame_w; x++) {
+                    const cl_half * p = (const cl_half *)slot->pixels + 4 * (y * frame_w + x);
+                    rgb[3 * x] = half_to_float(p[0]);
+                    rgb[3 * x + 1] = half_to_float(p[1]);
+                    rgb[3 * x + 2] = half_to_float(p[2]);
+                }
+                fwrite(rgb, sizeof(float), 3 * frame_w, f);
+            }
+            free(rgb);
+            fclose(f);
+        }
+    }
+
+    pthread_mutex_lock(&slot_lock);
+    slot->busy = false;
+    pthread_cond_broadcast(&slot_free);
+    pthread_mutex_unlock(&slot_lock);
+}
+
+void write_frame(unsigned frame) {
+    frame_slot * slot = &slots[frame % FRAME_SLOTS];
+    const size_t origin[] = {0, 0, 0};
+    const size_t region[] = {frame_w, frame_h, 1};
+
+    int err = clEnqueueReadImage(command_queue, frame_image, CL_FALSE, origin, region,
+                                 0, 0, slot->pixels, 0, NULL, &slot->ready);
+    cl_check_err(err, "clEnqueueReadImage(...)");
+
+    // make sure the frame is submitted before a writer waits on it
+    err = clFlush(command_queue);
+    cl_check_err(err, "clFlush(...)");
+
+    submit_task(writers, write_slot, slot);
+}
+
+void release_frame_writer() {
+    wait_thread_pool(writers);
+
+    for (unsigned i = 0; i < FRAME_SLOTS; i++) {
+        release_host_buffer(&slots[i].buffer);
+    }
+    clFinish(command_queue);
+}
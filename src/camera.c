@@ -18,6 +18,39 @@ cam_data init_camera(float field_of_view, float near_dist, float aspect_ratio) {
     };
 }
 
+void look_at_camera(cam_data * camera, vector4 pos, vector4 target) {
+    float near_dist = length(camera->look);
+    float half_width = length(camera->right);
+    float half_height = length(camera->up);
+
+    vector4 look = normalize(vector3_init(target.x - pos.x, target.y - pos.y, target.z - pos.z));
+    vector4 right = cross3(vector3_init(0, 1, 0), look);
+    if (length(right) < 1e-6f) {
+        right = vector3_init(1, 0, 0); // looking straight up or down
+    }
+    right = normalize(right);
+    vector4 up = cross3(look, right);
+
+    camera->pos = vector3_init(pos.x, pos.y, pos.z);
+    camera->look = vector3_init(look.x * near_dist, look.y * near_dist, look.z * near_dist);
+    camera->right = vector3_init(right.x * half_width, right.y * half_width, right.z * half_width);
+    camera->up = vector3_init(up.x * half_height, up.y * half_height, up.z * half_height);
+}
+
+cam_data crop_camera(const cam_data * camera, vector4 rect) {
+    // image point (u, v) in [0, 1] sees along look + right * (u - 0.5) - up * (v - 0.5)
+    float u = rect.x + rect.z * 0.5f - 0.5f;
+    float v = rect.y + rect.w * 0.5f - 0.5f;
+
+    cam_data c = *camera;
+    c.look = vector3_init(camera->look.x + camera->right.x * u - camera->up.x * v,
+                          camera->look.y + camera->right.y * u - camera->up.y * v,
+                          camera->look.z + camera->right.z * u - camera->up.z * v);
+    c.right = vector3_init(camera->right.x * rect.z, camera->right.y * rect.z, camera->right.z * rect.z);
+    c.up = vector3_init(camera->up.x * rect.w, camera->up.y * rect.w, camera->up.z * rect.w);
+    return c;
+}
+
 void move_camera(cam_data * camera, vector4 vel) {
     camera->pos.x += vel.x;
     camera->pos.y += vel.y;
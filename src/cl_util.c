@@ -4,6 +4,9 @@
 //
 
 #include <string.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #include "gl_util.h"
 #include "cl_util.h"
@@ -15,6 +18,11 @@ cl_command_queue command_queue;
 cl_program program;
 cl_kernel kernel;
 
+// set by program_built(...) once the build started by build_program(...) ends
+static bool built;
+static pthread_mutex_t build_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t build_done = PTHREAD_COND_INITIALIZER;
+
 void cl_check_err(int err, const char * msg) {
     // err is not succesfull => print the error and exit
     if (err != CL_SUCCESS) {
@@ -23,7 +31,13 @@ void cl_check_err(int err, const char * msg) {
     }
 }
 
-void init_cl(const char ** sources, int count) {
+void init_cl(const char ** sources, int count, const char * build_options) {
+    init_cl_context();
+    build_program(sources, count, build_options);
+    wait_program();
+}
+
+void init_cl_context() {
     int err = CL_SUCCESS;
 
     // get the platform id for this system
@@ -38,26 +52,34 @@ void init_cl(const char ** sources, int count) {
     err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device_id, NULL);
     cl_check_err(err, "clGetDeviceIDs(...)");
 
-    // set the platform specific context properties for OpenGL + OpenCL sharing
-#ifdef __APPLE__
-    cl_context_properties ctx_prop[] = {
-        CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE,
-        (cl_context_properties)CGLGetShareGroup(CGLGetCurrentContext()),
+    // without a window (headless modes) there is no OpenGL context to share
+    cl_context_properties ctx_prop[8] = {
+        CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
         0};
 
+    if (window) {
+        // set the platform specific context properties for OpenGL + OpenCL sharing
+#ifdef __APPLE__
+        cl_context_properties gl_prop[] = {
+            CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE,
+            (cl_context_properties)CGLGetShareGroup(CGLGetCurrentContext()),
+            0};
+
 #elif defined __linux__
-    cl_context_properties ctx_prop[] = {
-        CL_GL_CONTEXT_KHR, (cl_context_properties)glfwGetGLXContext(window),
-        CL_GLX_DISPLAY_KHR, (cl_context_properties)glfwGetX11Display(),
-        CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
-        0};
+        cl_context_properties gl_prop[] = {
+            CL_GL_CONTEXT_KHR, (cl_context_properties)glfwGetGLXContext(window),
+            CL_GLX_DISPLAY_KHR, (cl_context_properties)glfwGetX11Display(),
+            CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
+            0};
 #elif defined __MINGW32__
-    cl_context_properties ctx_prop[] = {
-        CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
-        CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
-        CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
-        0};
+        cl_context_properties gl_prop[] = {
+            CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
+            CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
+            CL_CONTEXT_PLATFORM, (cl_context_properties)platform,
+            0};
 #endif
+        memcpy(ctx_prop, gl_prop, sizeof(gl_prop));
+    }
 
     // create the working context
     context = clCreateContext(ctx_prop, 1, &device_id, NULL, NULL, &err);
@@ -66,47 +88,81 @@ void init_cl(const char ** sources, int count) {
     // next up is the command queue
     command_queue = clCreateCommandQueue(context, device_id, 0, &err);
     cl_check_err(err, "clCreateCommandQueue(...)");
+}
 
-    // create a single source buffer for the program from the input files
-    size_t length = 0;
-    for (int i = 0; i < count; i++) {
-        length += file_length(sources[i]);
-    }
+/**
+ Completion callback of clBuildProgram(...), may run on a driver thread.
+ */
+static void CL_CALLBACK program_built(cl_program p, void * user_data) {
+    (void)p;
+    (void)user_data;
+    pthread_mutex_lock(&build_lock);
+    built = true;
+    pthread_cond_broadcast(&build_done);
+    pthread_mutex_unlock(&build_lock);
+}
 
-    char * buffer = (char *)malloc(length+1);
-    buffer[0] = '\0';
+void build_program(const char ** sources, int count, const char * build_options) {
+    int err = CL_SUCCESS;
+
+    // every file is one string of the program, read into a single arena
+    arena files;
+    init_arena(&files, 0);
+    const char ** strings = (const char **)arena_alloc(&files, sizeof(char *) * count);
     for (int i = 0; i < count; i++) {
-        char * tmp = read_file(sources[i]);
-        strcat(buffer, tmp);
-        free(tmp);
+        strings[i] = arena_read_file(&files, sources[i]);
     }
-	buffer[length] = '\0';
 
-    // create the compute program from 'kernels.cl'
-    program = clCreateProgramWithSource(context, 1, (const char **)&buffer, NULL, &err);
+    // create the compute program from the kernel sources
+    program = clCreateProgramWithSource(context, count, strings, NULL, &err);
     cl_check_err(err, "clCreateProgramWithSource(...)");
-    free(buffer); // program already read, we don't need the buffer anymore
+    release_arena(&files); // program already read, we don't need the sources anymore
+
+    // compile the program for our device, a failed build is reported by wait_program()
+    built = false;
+    err = clBuildProgram(program, 1, &device_id, build_options, program_built, NULL);
+    if (err == CL_BUILD_PROGRAM_FAILURE) {
+        program_built(program, NULL);
+    } else { cl_check_err(err, "clBuildProgram(...)"); }
+}
 
-    // compile the program for our device
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-	if (err == CL_BUILD_PROGRAM_FAILURE) {
+void wait_program() {
+    pthread_mutex_lock(&build_lock);
+    while (!built) {
+        pthread_cond_wait(&build_done, &build_lock);
+    }
+    pthread_mutex_unlock(&build_lock);
+
+    cl_build_status status = CL_BUILD_ERROR;
+    int err = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_STATUS,
+                                    sizeof(status), &status, NULL);
+    cl_check_err(err, "clGetProgramBuildInfo(...)");
+	if (status != CL_BUILD_SUCCESS) {
 		char buffer[2048];
 		size_t len;
 		err = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
 		cl_check_err(err, "clGetProgramBuildInfo(...)");
 		printf("%s\n", buffer);
 		exit(EXIT_FAILURE);
+	}
+}
 
-	} else { cl_check_err(err, "clBuildProgram(...)"); }
-
-    // create the computer kernel in the program we wish to run
-    kernel = clCreateKernel(program, "ray_tracer", &err);
+cl_kernel create_kernel(const char * name) {
+    int err = CL_SUCCESS;
+    cl_kernel k = clCreateKernel(program, name, &err);
     cl_check_err(err, "clCreateKernel(...)");
+    return k;
+}
+
+double wall_time() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
 }
 
 void release_cl() {
     clReleaseProgram(program);
-    clReleaseKernel(kernel);
+    if (kernel) { clReleaseKernel(kernel); }
     clReleaseCommandQueue(command_queue);
     clReleaseContext(context);
 }
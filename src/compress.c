@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "compress.h"
+#include "surface.h"
+
+// a vertex of a chunk before deduplication
+typedef struct {
+    cl_ushort q[3];     // quantized position
+    unsigned corner;    // triangle * 3 + corner within the chunk
+} chunk_vertex;
+
+static int compare_vertex(const void * a, const void * b) {
+    return memcmp(((const chunk_vertex *)a)->q, ((const chunk_vertex *)b)->q, sizeof(cl_ushort) * 3);
+}
+
+static cl_ushort quantize(float v, float lo, float hi) {
+    if (hi - lo <= 0.0f) {
+        return 0;
+    }
+
+    float q = (v - lo) / (hi - lo) * 65535.0f + 0.5f;
+    return (cl_ushort)fminf(fmaxf(q, 0.0f), 65535.0f);
+}
+
+static cl_ushort snorm16(float v) {
+    return (cl_ushort)fminf(fmaxf((v * 0.5f + 0.5f) * 65535.0f + 0.5f, 0.0f), 65535.0f);
+}
+
+cl_uint encode_octahedral(vector4 n) {
+    float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    float x = n.x / l1;
+    float y = n.y / l1;
+
+    // fold the lower hemisphere over the diagonals
+    if (n.z < 0.0f) {
+        float fx = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float fy = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
+    }
+
+    return (cl_uint)snorm16(x) | ((cl_uint)snorm16(y) << 16);
+}
+
+void compress_geometry(const cl_float * surfaces, size_t triangle_count,
+                       compressed_geometry * geometry) {
+    memset(geometry, 0, sizeof(compressed_geometry));
+    init_arena(&geometry->memory, 0);
+    geometry->triangle_count = triangle_count;
+    geometry->chunk_count = (triangle_count + CHUNK_TRIANGLES - 1) / CHUNK_TRIANGLES;
+
+    // worst case every vertex of every triangle is unique, only vertex_count are uploaded
+    geometry->chunks = arena_alloc(&geometry->memory, sizeof(geometry_chunk) * geometry->chunk_count);
+    geometry->vertices = arena_alloc(&geometry->memory, sizeof(cl_ushort) * 9 * triangle_count);
+    geometry->triangles = arena_alloc(&geometry->memory,
+                                      sizeof(cl_ushort) * COMPRESSED_TRIANGLE_SIZE * triangle_count);
+    chunk_vertex * scratch = arena_alloc(&geometry->memory, sizeof(chunk_vertex) * 3 * CHUNK_TRIANGLES);
+
+    for (size_t c = 0; c < geometry->chunk_count; c++) {
+        geometry_chunk * chunk = &geometry->chunks[c];
+        size_t first = c * CHUNK_TRIANGLES;
+        size_t count = triangle_count - first < CHUNK_TRIANGLES ? triangle_count - first : CHUNK_TRIANGLES;
+        const cl_float * tri = surfaces + first * TRIANGLE_SIZE;
+
+        // chunk bounds, skipping the surface type and w components
+        float lo[3] = { INFINITY, INFINITY, INFINITY };
+        float hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+        for (size_t t = 0; t < count; t++) {
+            for (int v = 0; v < 3; v++) {
+                const cl_float * p = tri + t * TRIANGLE_SIZE + 1 + v * 4;
+                for (int a = 0; a < 3; a++) {
+                    lo[a] = fminf(lo[a], p[a]);
+                    hi[a] = fmaxf(hi[a], p[a]);
+                }
+            }
+        }
+
+        chunk->lo = vector3_init(lo[0], lo[1], lo[2]);
+        chunk->hi = vector3_init(hi[0], hi[1], hi[2]);
+        chunk->vertex_offset = (cl_uint)geometry->vertex_count;
+        chunk->triangle_offset = (cl_uint)first;
+        chunk->triangle_count = (cl_uint)count;
+        chunk->padding = 0;
+
+        // quantize every corner, then sort so identical vertices are adjacent
+        for (size_t t = 0; t < count; t++) {
+            for (int v = 0; v < 3; v++) {
+                const cl_float * p = tri + t * TRIANGLE_SIZE + 1 + v * 4;
+                chunk_vertex * cv = &scratch[t * 3 + v];
+                for (int a = 0; a < 3; a++) {
+                    cv->q[a] = quantize(p[a], lo[a], hi[a]);
+                }
+                cv->corner = (unsigned)(t * 3 + v);
+            }
+        }
+        qsort(scratch, count * 3, sizeof(chunk_vertex), compare_vertex);
+
+        cl_ushort * out_tri = geometry->triangles + first * COMPRESSED_TRIANGLE_SIZE;
+        int unique = -1;
+        for (size_t i = 0; i < count * 3; i++) {
+            if (i == 0 || compare_vertex(&scratch[i - 1], &scratch[i])) {
+                unique++;
+                memcpy(geometry->vertices + 3 * (geometry->vertex_count + unique),
+                       scratch[i].q, sizeof(cl_ushort) * 3);
+            }
+
+            unsigned t = scratch[i].corner / 3;
+            out_tri[t * COMPRESSED_TRIANGLE_SIZE + scratch[i].corner % 3] = (cl_ushort)unique;
+        }
+        geometry->vertex_count += unique + 1;
+
+        // face normals are taken from the full precision vertices
+        for (size_t t = 0; t < count; t++) {
+            const cl_float * p = tri + t * TRIANGLE_SIZE + 1;
+            vector4 p1 = vector3_init(p[0], p[1], p[2]);
+            vector4 p2 = vector3_init(p[4], p[5], p[6]);
+            vector4 p3 = vector3_init(p[8], p[9], p[10]);
+            vector4 e1 = vector3_init(p2.x - p1.x, p2.y - p1.y, p2.z - p1.z);
+            vector4 e2 = vector3_init(p3.x - p1.x, p3.y - p1.y, p3.z - p1.z);
+            vector4 n = cross3(e1, e2);
+
+            cl_uint enc = length(n) > 0.0f ? encode_octahedral(normalize(n)) : 0;
+            out_tri[t * COMPRESSED_TRIANGLE_SIZE + 3] = (cl_ushort)(enc & 0xFFFF);
+            out_tri[t * COMPRESSED_TRIANGLE_SIZE + 4] = (cl_ushort)(enc >> 16);
+        }
+    }
+
+}
+
+void release_compressed_geometry(compressed_geometry * geometry) {
+    release_arena(&geometry->memory);
+    memset(geometry, 0, sizeof(compressed_geometry));
+}
@@ -0,0 +1,598 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "distribute.h"
+#include "options.h"
+#include "batch.h"
+#include "gl_util.h"
+
+// message types, every message is a message_header followed by 'size' bytes
+#define MSG_SCENE 1     // to a worker: a scene_header and the arguments
+#define MSG_JOB   2     // to a worker: a tile_job
+#define MSG_TILE  3     // to the coordinator: the job id and the compressed tile
+#define MSG_QUIT  4     // to a worker: no tiles left
+
+// ops of the tile codec, held in the top two bits of every tag byte
+#define OP_RUN  0x00    // the previous pixel repeated 1 to 64 times
+#define OP_DIFF 0x40    // channel deltas in [-2, 1], two bits each
+#define OP_LUMA 0x80    // green delta in [-32, 31], then red and blue relative to it
+#define OP_RGB  0xC0    // a literal pixel in the next three bytes
+
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+
+// the coordinator and its workers are expected to share a byte order
+typedef struct {
+    cl_uint type;
+    cl_uint size;
+} message_header;
+
+typedef struct {
+    cl_uint frame_w;
+    cl_uint frame_h;
+    cl_uint tile_size;
+    cl_uint argc;
+} scene_header;
+
+/**
+ A connected worker and the jobs it has not returned yet.
+ */
+typedef struct {
+    int fd;
+    cl_uint jobs[JOBS_IN_FLIGHT];
+    unsigned job_count;
+} worker;
+
+// a worker's connection to its coordinator
+static int coordinator = -1;
+
+static bool read_all(int fd, void * data, size_t size) {
+    char * p = (char *)data;
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void * data, size_t size) {
+    const char * p = (const char *)data;
+    while (size > 0) {
+        // a closed peer shows up as an error instead of SIGPIPE
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+/**
+ Sends a message whose payload is 'a' followed by 'b'.
+ */
+static bool send_message(int fd, cl_uint type, const void * a, size_t a_size,
+                         const void * b, size_t b_size) {
+    message_header header = { type, (cl_uint)(a_size + b_size) };
+    return write_all(fd, &header, sizeof(header)) &&
+           write_all(fd, a, a_size) && write_all(fd, b, b_size);
+}
+
+/**
+ Opens a stream socket listening on or connected to 'address', a Unix
+ socket path if it holds a '/', [host:]port otherwise. Exits on failure.
+ */
+static int open_socket(const char * address, bool listening) {
+    int fd = -1;
+
+    if (strchr(address, '/')) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address) < sizeof(addr.sun_path)) {
+            strcpy(addr.sun_path, address);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        }
+
+        if (fd >= 0 && listening) {
+            unlink(address); // left behind by an earlier coordinator
+        }
+        if (fd >= 0 && (listening ?
+                bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN) :
+                connect(fd, (struct sockaddr *)&addr, sizeof(addr)))) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        char host[256] = "";
+        const char * port = strrchr(address, ':');
+        if (port) {
+            snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+            port++;
+        } else {
+            port = address;
+        }
+
+        struct addrinfo hints, * list = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = listening ? AI_PASSIVE : 0;
+        if (getaddrinfo(host[0] ? host : NULL, port, &hints, &list)) {
+            list = NULL;
+        }
+
+        for (struct addrinfo * a = list; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+
+            int on = 1;
+            if (listening) {
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            }
+            if (listening ? bind(fd, a->ai_addr, a->ai_addrlen) || listen(fd, SOMAXCONN) :
+                            connect(fd, a->ai_addr, a->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        if (list) {
+            freeaddrinfo(list);
+        }
+    }
+
+    if (fd < 0) {
+        printf("failed to %s %s\n", listening ? "listen on" : "connect to", address);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/**
+ Sends the small messages of a TCP connection right away, jobs and
+ tiles are latency bound. Does nothing for Unix sockets.
+ */
+static void set_no_delay(int fd) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/**
+ Compresses 'count' RGBA pixels, whose alpha is always opaque, by
+ their difference to the previous pixel. Neighboring pixels of a
+ rendered image are mostly close, noisy ones fall back to literals.
+ \param out At least 4 * count bytes, the size of the worst case.
+ \return Bytes written to 'out'.
+ */
+static size_t encode_tile(const cl_uchar * pixels, size_t count, cl_uchar * out) {
+    cl_uchar prev[3] = {0, 0, 0};
+    unsigned run = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const cl_uchar * p = pixels + 4 * i;
+        if (p[0] == prev[0] && p[1] == prev[1] && p[2] == prev[2]) {
+            if (++run == 64) {
+                out[n++] = OP_RUN | 63;
+                run = 0;
+            }
+            continue;
+        }
+        if (run) {
+            out[n++] = OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        // deltas wrap around like the decoder's additions
+        int dr = (signed char)(cl_uchar)(p[0] - prev[0]);
+        int dg = (signed char)(cl_uchar)(p[1] - prev[1]);
+        int db = (signed char)(cl_uchar)(p[2] - prev[2]);
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+            out[n++] = OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+        } else if (dg >= -32 && dg <= 31 && dr - dg >= -8 && dr - dg <= 7 &&
+                   db - dg >= -8 && db - dg <= 7) {
+            out[n++] = OP_LUMA | (dg + 32);
+            out[n++] = (cl_uchar)((dr - dg + 8) << 4 | (db - dg + 8));
+        } else {
+            out[n++] = OP_RGB;
+            out[n++] = p[0];
+            out[n++] = p[1];
+            out[n++] = p[2];
+        }
+
+        prev[0] = p[0];
+        prev[1] = p[1];
+        prev[2] = p[2];
+    }
+    if (run) {
+        out[n++] = OP_RUN | (run - 1);
+    }
+
+    return n;
+}
+
+/**
+ Reverses encode_tile(...).
+ \return false if 'data' does not hold exactly 'count' pixels.
+ */
+static bool decode_tile(const cl_uchar * data, size_t size, cl_uchar * pixels, size_t count) {
+    cl_uchar p[3] = {0, 0, 0};
+    size_t i = 0, n = 0;
+
+    while (n < size && i < count) {
+        cl_uchar tag = data[n++];
+        unsigned repeat = 1;
+
+        switch (tag & 0xC0) {
+        case OP_RUN:
+            repeat = (tag & 0x3F) + 1;
+            break;
+        case OP_DIFF:
+            p[0] += ((tag >> 4) & 3) - 2;
+            p[1] += ((tag >> 2) & 3) - 2;
+            p[2] += (tag & 3) - 2;
+            break;
+        case OP_LUMA: {
+            if (n == size) {
+                return false;
+            }
+            int dg = (tag & 0x3F) - 32;
+            cl_uchar rb = data[n++];
+            p[0] += dg + (rb >> 4) - 8;
+            p[1] += dg;
+            p[2] += dg + (rb & 0xF) - 8;
+            break;
+        }
+        default:
+            if (size - n < 3) {
+                return false;
+            }
+            memcpy(p, data + n, 3);
+            n += 3;
+        }
+
+        for (; repeat > 0 && i < count; repeat--, i++) {
+            cl_uchar * out = pixels + 4 * i;
+            out[0] = p[0];
+            out[1] = p[1];
+            out[2] = p[2];
+            out[3] = 255;
+        }
+    }
+
+    return i == count && n == size;
+}
+
+/**
+ The keyframe of 'frame' out of 'frames', see render_batch().
+ */
+static keyframe frame_key(const keyframe * keys, size_t n_keys, unsigned frame, unsigned frames) {
+    if (!options.batch_frames) {
+        return keys[frame];
+    }
+
+    float start = keys[0].time;
+    float end = keys[n_keys - 1].time;
+    return sample_keyframes(keys, n_keys,
+                            frames > 1 ? start + (end - start) * frame / (frames - 1) : start);
+}
+
+/**
+ Closes the connection of a worker that failed, its jobs are left
+ to the other workers.
+ */
+static void drop_worker(worker * w, unsigned char * holders) {
+    printf("lost a worker with %u tiles in flight\n", w->job_count);
+    for (unsigned i = 0; i < w->job_count; i++) {
+        holders[w->jobs[i]]--;
+    }
+    close(w->fd);
+    w->fd = -1;
+    w->job_count = 0;
+}
+
+/**
+ Picks the next tile for 'w' among the tiles before 'limit': a tile no
+ worker was given yet, then a tile whose worker was dropped, then, if
+ 'w' is idle, the oldest tile another worker is still rendering.
+ \return false if there is no tile for 'w'.
+ */
+static bool pick_tile(const worker * w, size_t * next, size_t first, size_t limit,
+                      const bool * done, const unsigned char * holders, size_t * id) {
+    if (*next < limit) {
+        *id = (*next)++;
+        return true;
+    }
+
+    for (size_t i = first; i < limit; i++) {
+        if (!done[i] && holders[i] == 0) {
+            *id = i;
+            return true;
+        }
+    }
+
+    // steal from a straggler, the first copy back wins
+    for (size_t i = first; i < limit && w->job_count == 0; i++) {
+        if (!done[i] && holders[i] == 1) {
+            *id = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int run_coordinator(int argc, const char ** argv) {
+    size_t n_keys = 0;
+    keyframe * keys = load_keyframes(options.batch_file, &n_keys);
+    unsigned frames = options.batch_frames ? options.batch_frames : (unsigned)n_keys;
+
+    unsigned tiles_x = (screen_w + TILE_SIZE - 1) / TILE_SIZE;
+    unsigned tiles_y = (screen_h + TILE_SIZE - 1) / TILE_SIZE;
+    size_t per_frame = (size_t)tiles_x * tiles_y;
+    size_t total = per_frame * frames;
+
+    // the scene is the coordinator's own command line
+    size_t args_size = 0;
+    for (int i = 0; i < argc; i++) {
+        args_size += strlen(argv[i]) + 1;
+    }
+    char * args = (char *)malloc(args_size);
+    for (int i = 0, at = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]) + 1;
+        memcpy(args + at, argv[i], len);
+        at += (int)len;
+    }
+    scene_header scene = { screen_w, screen_h, TILE_SIZE, (cl_uint)argc };
+
+    int listener = open_socket(options.listen_address, true);
+    printf("Waiting for %u workers on %s.\n", options.workers, options.listen_address);
+
+    worker * workers = (worker *)calloc(options.workers, sizeof(worker));
+    for (unsigned i = 0; i < options.workers; i++) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0 && errno == EINTR) {
+            i--;
+            continue;
+        } else if (fd < 0) {
+            printf("failed to accept a worker on %s\n", options.listen_address);
+            exit(EXIT_FAILURE);
+        }
+
+        set_no_delay(fd);
+        workers[i].fd = fd;
+        if (!send_message(fd, MSG_SCENE, &scene, sizeof(scene), args, args_size)) {
+            drop_worker(&workers[i], NULL);
+        }
+    }
+    close(listener);
+    if (strchr(options.listen_address, '/')) {
+        unlink(options.listen_address);
+    }
+    free(args);
+
+    bool * done = (bool *)calloc(total, sizeof(bool));
+    unsigned char * holders = (unsigned char *)calloc(total, 1);
+    struct pollfd * polled = (struct pollfd *)malloc(sizeof(struct pollfd) * options.workers);
+
+    // frames assembled at the same time, written in order
+    cl_uchar * pixels[FRAME_SLOTS];
+    size_t tiles_left[FRAME_SLOTS];
+    for (unsigned i = 0; i < FRAME_SLOTS; i++) {
+        pixels[i] = (cl_uchar *)malloc(4 * (size_t)screen_w * screen_h);
+        tiles_left[i] = per_frame;
+    }
+
+    // a received message, the job id and the compressed tile
+    cl_uchar * message = (cl_uchar *)malloc(sizeof(cl_uint) + 4 * TILE_PIXELS);
+    cl_uchar * tile = (cl_uchar *)malloc(4 * TILE_PIXELS);
+
+    size_t next = 0;        // tiles below were all handed out once
+    unsigned oldest = 0;    // frames below are written
+    unsigned stolen = 0;
+
+    double begin = wall_time();
+    while (oldest < frames) {
+        size_t first = per_frame * oldest;
+        size_t limit = per_frame * (oldest + FRAME_SLOTS < frames ? oldest + FRAME_SLOTS : frames);
+
+        unsigned live = 0;
+        for (unsigned i = 0; i < options.workers; i++) {
+            worker * w = &workers[i];
+            size_t id;
+            while (w->fd >= 0 && w->job_count < JOBS_IN_FLIGHT &&
+                   pick_tile(w, &next, first, limit, done, holders, &id)) {
+                cl_uint frame = (cl_uint)(id / per_frame);
+                cl_uint t = (cl_uint)(id % per_frame);
+                keyframe k = frame_key(keys, n_keys, frame, frames);
+                tile_job job = {
+                    (cl_uint)id, (cl_uint)rand(),
+                    t % tiles_x * TILE_SIZE, t / tiles_x * TILE_SIZE,
+                    k.camera, k.target, k.light
+                };
+
+                stolen += holders[id] > 0;
+                holders[id]++;
+                w->jobs[w->job_count++] = (cl_uint)id;
+                if (!send_message(w->fd, MSG_JOB, &job, sizeof(job), NULL, 0)) {
+                    drop_worker(w, holders);
+                }
+            }
+
+            polled[i].fd = w->fd; // ignored by poll(...) when negative
+            polled[i].events = POLLIN;
+            polled[i].revents = 0;
+            live += w->fd >= 0;
+        }
+
+        if (live == 0) {
+            printf("no workers left to render on\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (poll(polled, options.workers, -1) < 0 && errno != EINTR) {
+            printf("failed to wait for the workers\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (unsigned i = 0; i < options.workers; i++) {
+            worker * w = &workers[i];
+            if (w->fd < 0 || !polled[i].revents) {
+                continue;
+            }
+
+            message_header header;
+            if (!read_all(w->fd, &header, sizeof(header)) || header.type != MSG_TILE ||
+                    header.size < sizeof(cl_uint) || header.size > sizeof(cl_uint) + 4 * TILE_PIXELS ||
+                    !read_all(w->fd, message, header.size)) {
+                drop_worker(w, holders);
+                continue;
+            }
+
+            cl_uint id;
+            memcpy(&id, message, sizeof(cl_uint));
+            unsigned held = 0;
+            while (held < w->job_count && w->jobs[held] != id) {
+                held++;
+            }
+            if (held == w->job_count ||
+                    !decode_tile(message + sizeof(cl_uint), header.size - sizeof(cl_uint),
+                                 tile, TILE_PIXELS)) {
+                drop_worker(w, holders);
+                continue;
+            }
+
+            w->jobs[held] = w->jobs[--w->job_count];
+            holders[id]--;
+            if (done[id]) {
+                continue; // the other copy of a stolen tile came back first
+            }
+            done[id] = true;
+
+            // tiles on the right and bottom edges reach past the frame
+            unsigned frame = id / per_frame;
+            unsigned t = id % per_frame;
+            unsigned x = t % tiles_x * TILE_SIZE;
+            unsigned y = t / tiles_x * TILE_SIZE;
+            unsigned w_copy = screen_w - x < TILE_SIZE ? screen_w - x : TILE_SIZE;
+            unsigned h_copy = screen_h - y < TILE_SIZE ? screen_h - y : TILE_SIZE;
+            cl_uchar * target = pixels[frame % FRAME_SLOTS];
+            for (unsigned row = 0; row < h_copy; row++) {
+                memcpy(target + 4 * ((size_t)(y + row) * screen_w + x),
+                       tile + 4 * (size_t)row * TILE_SIZE, 4 * w_copy);
+            }
+            tiles_left[frame % FRAME_SLOTS]--;
+        }
+
+        while (oldest < frames && tiles_left[oldest % FRAME_SLOTS] == 0) {
+            save_ppm_frame(options.output_prefix, oldest, pixels[oldest % FRAME_SLOTS],
+                           screen_w, screen_h);
+            tiles_left[oldest % FRAME_SLOTS] = per_frame;
+            oldest++;
+        }
+    }
+
+    double elapsed = wall_time() - begin;
+    printf("Rendered %u frames in %f seconds (%.2f frames per second), %u tiles stolen.\n",
+           frames, elapsed, frames / elapsed, stolen);
+
+    for (unsigned i = 0; i < options.workers; i++) {
+        if (workers[i].fd >= 0) {
+            send_message(workers[i].fd, MSG_QUIT, NULL, 0, NULL, 0);
+            close(workers[i].fd);
+        }
+    }
+    for (unsigned i = 0; i < FRAME_SLOTS; i++) {
+        free(pixels[i]);
+    }
+    free(message);
+    free(tile);
+    free(polled);
+    free(holders);
+    free(done);
+    free(workers);
+    free(keys);
+
+    return 0;
+}
+
+void join_coordinator(const char * address, int * argc, const char *** argv,
+                      unsigned * frame_w, unsigned * frame_h) {
+    coordinator = open_socket(address, false);
+    set_no_delay(coordinator);
+
+    message_header header;
+    scene_header scene;
+    if (!read_all(coordinator, &header, sizeof(header)) || header.type != MSG_SCENE ||
+            header.size < sizeof(scene) || !read_all(coordinator, &scene, sizeof(scene))) {
+        printf("no scene received from %s\n", address);
+        exit(EXIT_FAILURE);
+    }
+    if (scene.tile_size != TILE_SIZE) {
+        printf("the coordinator renders tiles of %u pixels, not %u\n", scene.tile_size, TILE_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    // the arguments are referenced by the options for the life of the process
+    size_t size = header.size - sizeof(scene);
+    char * args = (char *)malloc(size + 1);
+    if (!read_all(coordinator, args, size)) {
+        printf("no scene received from %s\n", address);
+        exit(EXIT_FAILURE);
+    }
+    args[size] = '\0';
+
+    const char ** list = (const char **)malloc(sizeof(char *) * (scene.argc + 1));
+    size_t at = 0;
+    for (cl_uint i = 0; i < scene.argc; i++) {
+        list[i] = at < size ? args + at : "";
+        at += strlen(list[i]) + 1;
+    }
+    list[scene.argc] = NULL;
+
+    *argc = (int)scene.argc;
+    *argv = list;
+    *frame_w = scene.frame_w;
+    *frame_h = scene.frame_h;
+}
+
+bool receive_job(tile_job * job) {
+    message_header header;
+    return read_all(coordinator, &header, sizeof(header)) &&
+           header.type == MSG_JOB && header.size == sizeof(tile_job) &&
+           read_all(coordinator, job, sizeof(tile_job));
+}
+
+bool send_tile(const tile_job * job, const cl_uchar * pixels) {
+    static cl_uchar * compressed = NULL;
+    if (!compressed) {
+        compressed = (cl_uchar *)malloc(4 * TILE_PIXELS);
+    }
+
+    size_t size = encode_tile(pixels, TILE_PIXELS, compressed);
+    return send_message(coordinator, MSG_TILE, &job->id, sizeof(cl_uint), compressed, size);
+}
+
+void leave_coordinator() {
+    close(coordinator);
+    coordinator = -1;
+}
@@ -8,7 +8,11 @@
 
 #include "file_io.h"
 
-char * read_file(const char * filename) {
+/**
+ Reads 'filename' into a NULL terminated buffer allocated
+ from 'a', or from the heap if 'a' is NULL.
+ */
+static char * read_file_into(const char * filename, arena * a) {
     FILE * f = fopen(filename, "rb");
     char * buffer;
     size_t file_length;
@@ -24,7 +28,8 @@ char * read_file(const char * filename) {
     fseek(f, 0, SEEK_SET);
 
     // allocate our buffer and read the data
-    buffer = (char *)malloc(file_length + 1); // +1 for NULL terminator
+    buffer = a ? (char *)arena_alloc_aligned(a, file_length + 1, 1) // +1 for NULL terminator
+               : (char *)malloc(file_length + 1);
     fread(buffer, file_length, 1, f);
     buffer[file_length] = '\0';
     fclose(f);
@@ -32,6 +37,14 @@ char * read_file(const char * filename) {
     return buffer;
 }
 
+char * read_file(const char * filename) {
+    return read_file_into(filename, NULL);
+}
+
+char * arena_read_file(arena * a, const char * filename) {
+    return read_file_into(filename, a);
+}
+
 size_t file_length(const char * filename) {
     FILE * f = fopen(filename, "rb");
     size_t file_length;
@@ -16,6 +16,7 @@ GLFWwindow * window;
 unsigned screen_w = 800;
 unsigned screen_h = 600;
 unsigned sample_rate = 1;
+bool adaptive_aa = false;
 GLuint screen_tex;
 
 float last_time = 0.0f;
@@ -92,6 +93,10 @@ void init_gl(const char * title, int v_sync) {
     gl_check_errors("init_gl(...)");
 }
 
+unsigned render_scale() {
+    return adaptive_aa ? 1 : sample_rate;
+}
+
 void update_screen() {
     // update the frame counter information
 #ifdef __REAL_TIME__
@@ -172,18 +177,9 @@ void init_screen_tex() {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    unsigned w = screen_w * sample_rate;
-    unsigned h = screen_h * sample_rate;
-
-    vector4 * data = (vector4 *)malloc(sizeof(vector4) * w * h);
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            data[y * w + x] = vector4_init(1.0f, 1.0f, 1.0f, 1.0f);
-        }
-    }
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGB, GL_FLOAT, data);
-    free(data);
+    // storage only, the tonemap pass writes every texel before the first draw,
+    // already filtered down to the window and sRGB encoded in 8 bits
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, screen_w, screen_h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
 }
 
 void check_shader_compile(const char * filename, GLuint shader) {
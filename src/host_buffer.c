@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_buffer.h"
+
+// -1 until the device has been queried
+static int unified_memory = -1;
+
+bool host_unified_memory() {
+    if (unified_memory < 0) {
+        cl_bool unified = CL_FALSE;
+        int err = clGetDeviceInfo(device_id, CL_DEVICE_HOST_UNIFIED_MEMORY,
+                                  sizeof(cl_bool), &unified, NULL);
+        cl_check_err(err, "clGetDeviceInfo(...)");
+        unified_memory = unified == CL_TRUE;
+    }
+
+    return unified_memory;
+}
+
+/**
+ Frees the host memory of a CL_MEM_USE_HOST_PTR buffer once the
+ last reference to the buffer is gone.
+ */
+static void CL_CALLBACK free_host_memory(cl_mem mem, void * memory) {
+    (void)mem;
+    free(memory);
+}
+
+void init_host_buffer(host_buffer * b, size_t size, cl_mem_flags access) {
+    int err = CL_SUCCESS;
+    b->host = NULL;
+    b->size = size > 0 ? size : 1;
+    b->size = (b->size + HOST_BUFFER_GRANULARITY - 1) / HOST_BUFFER_GRANULARITY * HOST_BUFFER_GRANULARITY;
+
+    if (host_unified_memory()) {
+        void * memory = NULL;
+        if (posix_memalign(&memory, HOST_BUFFER_ALIGNMENT, b->size)) {
+            fprintf(stderr, "posix_memalign(...) failed for %zu bytes\n", b->size);
+            exit(EXIT_FAILURE);
+        }
+
+        b->mem = clCreateBuffer(context, access | CL_MEM_USE_HOST_PTR, b->size, memory, &err);
+        cl_check_err(err, "clCreateBuffer(...)");
+        err = clSetMemObjectDestructorCallback(b->mem, free_host_memory, memory);
+        cl_check_err(err, "clSetMemObjectDestructorCallback(...)");
+    } else {
+        b->mem = clCreateBuffer(context, access | CL_MEM_ALLOC_HOST_PTR, b->size, NULL, &err);
+        cl_check_err(err, "clCreateBuffer(...)");
+    }
+}
+
+void * map_host_buffer(host_buffer * b, cl_map_flags flags) {
+    int err = CL_SUCCESS;
+    b->host = clEnqueueMapBuffer(command_queue, b->mem, CL_TRUE, flags,
+                                 0, b->size, 0, NULL, NULL, &err);
+    cl_check_err(err, "clEnqueueMapBuffer(...)");
+    return b->host;
+}
+
+void unmap_host_buffer(host_buffer * b) {
+    if (!b->host) {
+        return;
+    }
+
+    int err = clEnqueueUnmapMemObject(command_queue, b->mem, b->host, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueUnmapMemObject(...)");
+    b->host = NULL;
+}
+
+void release_host_buffer(host_buffer * b) {
+    if (!b->mem) {
+        return;
+    }
+
+    unmap_host_buffer(b);
+    clReleaseMemObject(b->mem);
+    b->mem = NULL;
+}
+
+cl_mem upload_host_data(const void * data, size_t size, cl_mem_flags access) {
+    host_buffer b;
+    init_host_buffer(&b, size, access);
+    memcpy(map_host_buffer(&b, CL_MAP_WRITE_INVALIDATE_REGION), data, size);
+    unmap_host_buffer(&b);
+    return b.mem;
+}
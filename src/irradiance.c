@@ -0,0 +1,78 @@
+#include <math.h>
+
+#include "irradiance.h"
+#include "kernel_args.h"
+
+static cl_kernel refresh_kernel;
+static cl_mem cells;
+static float cell_size;
+
+// union of the boxes invalidated since the last refresh, empty when lo > hi
+static vector4 stale_lo, stale_hi;
+
+// work group size used for the refresh pass
+static const size_t refresh_local = 64;
+
+/**
+ Resets the stale box to the empty box.
+ */
+static void clear_stale() {
+    stale_lo = vector3_init(INFINITY, INFINITY, INFINITY);
+    stale_hi = vector3_init(-INFINITY, -INFINITY, -INFINITY);
+}
+
+void init_irradiance(vector4 lo, vector4 hi) {
+    int err = CL_SUCCESS;
+
+    float extent = fmaxf(hi.x - lo.x, fmaxf(hi.y - lo.y, hi.z - lo.z));
+    cell_size = extent > 0.0f ? extent / IRRADIANCE_RESOLUTION : 1.0f;
+
+    refresh_kernel = create_kernel("refresh_irradiance");
+    cells = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                           sizeof(irradiance_cell) * IRRADIANCE_CELLS, NULL, &err);
+    cl_check_err(err, "clCreateBuffer(...)");
+
+    static const cl_uint zero = 0;
+    err = clEnqueueFillBuffer(command_queue, cells, &zero, sizeof(cl_uint), 0,
+                              sizeof(irradiance_cell) * IRRADIANCE_CELLS, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueFillBuffer(...)");
+
+    err  = clSetKernelArg(refresh_kernel, 0, sizeof(cl_mem), &cells);
+    err |= clSetKernelArg(refresh_kernel, 1, sizeof(float), &cell_size);
+    cl_check_err(err, "clSetKernelArg(...)");
+
+    clear_stale();
+}
+
+void set_irradiance_kernel_args(cl_kernel k) {
+    int err = CL_SUCCESS;
+    err  = clSetKernelArg(k, ARG_IRRADIANCE, sizeof(cl_mem), cells ? &cells : NULL);
+    err |= clSetKernelArg(k, ARG_IRRADIANCE_CELL_SIZE, sizeof(float), &cell_size);
+    cl_check_err(err, "clSetKernelArg(...)");
+}
+
+void invalidate_irradiance(vector4 lo, vector4 hi) {
+    stale_lo = vector3_init(fminf(stale_lo.x, lo.x), fminf(stale_lo.y, lo.y), fminf(stale_lo.z, lo.z));
+    stale_hi = vector3_init(fmaxf(stale_hi.x, hi.x), fmaxf(stale_hi.y, hi.y), fmaxf(stale_hi.z, hi.z));
+}
+
+void refresh_irradiance(cl_mem moving) {
+    int err = CL_SUCCESS;
+    err  = clSetKernelArg(refresh_kernel, 2, sizeof(vector4), &stale_lo);
+    err |= clSetKernelArg(refresh_kernel, 3, sizeof(vector4), &stale_hi);
+    err |= clSetKernelArg(refresh_kernel, 4, sizeof(cl_mem), moving ? &moving : NULL);
+    cl_check_err(err, "clSetKernelArg(...)");
+
+    const size_t global = IRRADIANCE_CELLS;
+    err = clEnqueueNDRangeKernel(command_queue, refresh_kernel, 1,
+                                 NULL, &global, &refresh_local, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueNDRangeKernel(...)");
+
+    clear_stale();
+}
+
+void release_irradiance() {
+    clReleaseMemObject(cells);
+    clReleaseKernel(refresh_kernel);
+    cells = NULL;
+}
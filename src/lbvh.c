@@ -0,0 +1,223 @@
+#include <limits.h>
+#include <stdlib.h>
+
+#include "lbvh.h"
+
+// kernels shared by every lbvh, created by the first init_lbvh(...)
+static cl_kernel bounds_kernel;
+static cl_kernel centroid_kernel;
+static cl_kernel morton_kernel;
+static cl_kernel histogram_kernel;
+static cl_kernel scan_kernel;
+static cl_kernel scatter_kernel;
+static cl_kernel hierarchy_kernel;
+static cl_kernel refit_kernel;
+static unsigned lbvh_users = 0; // lbvh and radix_sort instances
+
+// reset value of the centroid bounds as float_to_ordered(...) values
+static const cl_uint empty_bounds[6] = {
+    UINT_MAX, UINT_MAX, UINT_MAX, 0, 0, 0
+};
+
+static const size_t group_size = LBVH_GROUP;
+
+static cl_mem create_buffer(size_t size) {
+    int err = CL_SUCCESS;
+    cl_mem mem = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+    cl_check_err(err, "clCreateBuffer(...)");
+    return mem;
+}
+
+static size_t round_up(size_t n, size_t multiple) {
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+static void enqueue(cl_kernel k, size_t global, const size_t * local) {
+    int err = clEnqueueNDRangeKernel(command_queue, k, 1, NULL, &global, local, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueNDRangeKernel(...)");
+}
+
+static void retain_kernels() {
+    if (lbvh_users++ == 0) {
+        bounds_kernel = create_kernel("point_bounds");
+        centroid_kernel = create_kernel("centroid_bounds");
+        morton_kernel = create_kernel("morton_codes");
+        histogram_kernel = create_kernel("radix_histogram");
+        scan_kernel = create_kernel("radix_scan");
+        scatter_kernel = create_kernel("radix_scatter");
+        hierarchy_kernel = create_kernel("lbvh_hierarchy");
+        refit_kernel = create_kernel("lbvh_refit");
+    }
+}
+
+static void release_kernels() {
+    if (--lbvh_users == 0) {
+        clReleaseKernel(bounds_kernel);
+        clReleaseKernel(centroid_kernel);
+        clReleaseKernel(morton_kernel);
+        clReleaseKernel(histogram_kernel);
+        clReleaseKernel(scan_kernel);
+        clReleaseKernel(scatter_kernel);
+        clReleaseKernel(hierarchy_kernel);
+        clReleaseKernel(refit_kernel);
+    }
+}
+
+void init_radix_sort(radix_sort * sort, size_t count) {
+    retain_kernels();
+
+    sort->count = count;
+    sort->sort_groups = (count + LBVH_GROUP * LBVH_TILES - 1) / (LBVH_GROUP * LBVH_TILES);
+    for (unsigned i = 0; i < 2; i++) {
+        sort->keys[i] = create_buffer(sizeof(cl_uint) * count);
+        sort->values[i] = create_buffer(sizeof(cl_uint) * count);
+    }
+    sort->histogram = create_buffer(sizeof(cl_uint) * 16 * sort->sort_groups);
+}
+
+void sort_radix(radix_sort * sort, size_t n, unsigned bits) {
+    int err = CL_SUCCESS;
+    int count = (int)n;
+    size_t groups = (n + LBVH_GROUP * LBVH_TILES - 1) / (LBVH_GROUP * LBVH_TILES);
+    int hist_count = 16 * (int)groups;
+    size_t sort_global = groups * LBVH_GROUP;
+
+    // least significant digit first, an odd number of passes
+    // ends with a copy back into keys[0] and values[0]
+    int passes = (int)(bits + 3) / 4;
+    for (int pass = 0; pass < passes; pass++) {
+        int shift = pass * 4;
+        int src = pass % 2;
+
+        err  = clSetKernelArg(histogram_kernel, 0, sizeof(cl_mem), &sort->keys[src]);
+        err |= clSetKernelArg(histogram_kernel, 1, sizeof(int), &count);
+        err |= clSetKernelArg(histogram_kernel, 2, sizeof(int), &shift);
+        err |= clSetKernelArg(histogram_kernel, 3, sizeof(cl_mem), &sort->histogram);
+
+        err |= clSetKernelArg(scan_kernel, 0, sizeof(cl_mem), &sort->histogram);
+        err |= clSetKernelArg(scan_kernel, 1, sizeof(int), &hist_count);
+
+        err |= clSetKernelArg(scatter_kernel, 0, sizeof(cl_mem), &sort->keys[src]);
+        err |= clSetKernelArg(scatter_kernel, 1, sizeof(cl_mem), &sort->values[src]);
+        err |= clSetKernelArg(scatter_kernel, 2, sizeof(int), &count);
+        err |= clSetKernelArg(scatter_kernel, 3, sizeof(int), &shift);
+        err |= clSetKernelArg(scatter_kernel, 4, sizeof(cl_mem), &sort->histogram);
+        err |= clSetKernelArg(scatter_kernel, 5, sizeof(cl_mem), &sort->keys[1 - src]);
+        err |= clSetKernelArg(scatter_kernel, 6, sizeof(cl_mem), &sort->values[1 - src]);
+        cl_check_err(err, "clSetKernelArg(...)");
+
+        enqueue(histogram_kernel, sort_global, &group_size);
+        enqueue(scan_kernel, group_size, &group_size);
+        enqueue(scatter_kernel, sort_global, &group_size);
+    }
+
+    if (passes % 2) {
+        err  = clEnqueueCopyBuffer(command_queue, sort->keys[1], sort->keys[0],
+                                   0, 0, sizeof(cl_uint) * n, 0, NULL, NULL);
+        err |= clEnqueueCopyBuffer(command_queue, sort->values[1], sort->values[0],
+                                   0, 0, sizeof(cl_uint) * n, 0, NULL, NULL);
+        cl_check_err(err, "clEnqueueCopyBuffer(...)");
+    }
+}
+
+void release_radix_sort(radix_sort * sort) {
+    for (unsigned i = 0; i < 2; i++) {
+        clReleaseMemObject(sort->keys[i]);
+        clReleaseMemObject(sort->values[i]);
+    }
+    clReleaseMemObject(sort->histogram);
+
+    release_kernels();
+}
+
+void init_lbvh(lbvh * bvh, size_t count, bool with_mass) {
+    // there is no root node without a primitive
+    if (count == 0) {
+        fprintf(stderr, "init_lbvh(...) needs at least one primitive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    retain_kernels();
+    init_radix_sort(&bvh->sort, count);
+
+    size_t node_count = 2 * count - 1;
+    bvh->count = count;
+
+    bvh->prims = create_buffer(sizeof(bvh_node) * count);
+    bvh->nodes = create_buffer(sizeof(bvh_node) * node_count);
+    bvh->node_mass = with_mass ? create_buffer(sizeof(vector4) * node_count) : NULL;
+    bvh->parents = create_buffer(sizeof(cl_int) * node_count);
+    bvh->flags = create_buffer(sizeof(cl_uint) * count);
+    bvh->scene_bounds = create_buffer(sizeof(empty_bounds));
+}
+
+void point_bounds_lbvh(lbvh * bvh, cl_mem points, float radius) {
+    int err = CL_SUCCESS;
+    int n = (int)bvh->count;
+
+    err  = clSetKernelArg(bounds_kernel, 0, sizeof(cl_mem), &points);
+    err |= clSetKernelArg(bounds_kernel, 1, sizeof(float), &radius);
+    err |= clSetKernelArg(bounds_kernel, 2, sizeof(int), &n);
+    err |= clSetKernelArg(bounds_kernel, 3, sizeof(cl_mem), &bvh->prims);
+    cl_check_err(err, "clSetKernelArg(...)");
+
+    enqueue(bounds_kernel, round_up(bvh->count, group_size), &group_size);
+}
+
+void build_lbvh(lbvh * bvh, cl_mem prim_mass) {
+    int err = CL_SUCCESS;
+    int n = (int)bvh->count;
+    size_t padded = round_up(bvh->count, group_size);
+
+    // scene bounds of the primitive centroids
+    err = clEnqueueWriteBuffer(command_queue, bvh->scene_bounds, CL_FALSE, 0,
+                               sizeof(empty_bounds), empty_bounds, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueWriteBuffer(...)");
+
+    err  = clSetKernelArg(centroid_kernel, 0, sizeof(cl_mem), &bvh->prims);
+    err |= clSetKernelArg(centroid_kernel, 1, sizeof(int), &n);
+    err |= clSetKernelArg(centroid_kernel, 2, sizeof(cl_mem), &bvh->scene_bounds);
+    cl_check_err(err, "clSetKernelArg(...)");
+    enqueue(centroid_kernel, padded, &group_size);
+
+    err  = clSetKernelArg(morton_kernel, 0, sizeof(cl_mem), &bvh->prims);
+    err |= clSetKernelArg(morton_kernel, 1, sizeof(int), &n);
+    err |= clSetKernelArg(morton_kernel, 2, sizeof(cl_mem), &bvh->scene_bounds);
+    err |= clSetKernelArg(morton_kernel, 3, sizeof(cl_mem), &bvh->sort.keys[0]);
+    err |= clSetKernelArg(morton_kernel, 4, sizeof(cl_mem), &bvh->sort.values[0]);
+    cl_check_err(err, "clSetKernelArg(...)");
+    enqueue(morton_kernel, padded, &group_size);
+    sort_radix(&bvh->sort, bvh->count, 32);
+
+    err  = clSetKernelArg(hierarchy_kernel, 0, sizeof(cl_mem), &bvh->sort.keys[0]);
+    err |= clSetKernelArg(hierarchy_kernel, 1, sizeof(cl_mem), &bvh->sort.values[0]);
+    err |= clSetKernelArg(hierarchy_kernel, 2, sizeof(int), &n);
+    err |= clSetKernelArg(hierarchy_kernel, 3, sizeof(cl_mem), &bvh->prims);
+    err |= clSetKernelArg(hierarchy_kernel, 4, sizeof(cl_mem), &bvh->nodes);
+    err |= clSetKernelArg(hierarchy_kernel, 5, sizeof(cl_mem), &bvh->parents);
+    err |= clSetKernelArg(hierarchy_kernel, 6, sizeof(cl_mem), &bvh->flags);
+    cl_check_err(err, "clSetKernelArg(...)");
+    enqueue(hierarchy_kernel, padded, &group_size);
+
+    cl_mem node_mass = prim_mass ? bvh->node_mass : NULL;
+    err  = clSetKernelArg(refit_kernel, 0, sizeof(int), &n);
+    err |= clSetKernelArg(refit_kernel, 1, sizeof(cl_mem), &bvh->nodes);
+    err |= clSetKernelArg(refit_kernel, 2, sizeof(cl_mem), &bvh->parents);
+    err |= clSetKernelArg(refit_kernel, 3, sizeof(cl_mem), &bvh->flags);
+    err |= clSetKernelArg(refit_kernel, 4, sizeof(cl_mem), prim_mass ? &prim_mass : NULL);
+    err |= clSetKernelArg(refit_kernel, 5, sizeof(cl_mem), node_mass ? &node_mass : NULL);
+    cl_check_err(err, "clSetKernelArg(...)");
+    enqueue(refit_kernel, padded, &group_size);
+}
+
+void release_lbvh(lbvh * bvh) {
+    release_radix_sort(&bvh->sort);
+    clReleaseMemObject(bvh->prims);
+    clReleaseMemObject(bvh->nodes);
+    if (bvh->node_mass) { clReleaseMemObject(bvh->node_mass); }
+    clReleaseMemObject(bvh->parents);
+    clReleaseMemObject(bvh->flags);
+    clReleaseMemObject(bvh->scene_bounds);
+
+    release_kernels();
+}
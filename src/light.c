@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "light.h"
+
+light make_point_light(vector4 pos, vector4 color, float range) {
+    return (light) {
+        vector4_init(pos.x, pos.y, pos.z, 0.0f),
+        zero_vector4(), zero_vector4(),
+        vector4_init(color.x, color.y, color.z, range),
+        LIGHT_POINT, 0.0f, { 0.0f, 0.0f }
+    };
+}
+
+light make_sphere_light(vector4 pos, float radius, vector4 color, float range) {
+    light l = make_point_light(pos, color, range);
+    l.pos.w = radius;
+    l.type = LIGHT_SPHERE;
+    return l;
+}
+
+light make_triangle_light(vector4 p1, vector4 p2, vector4 p3, vector4 color, float range) {
+    light l = make_point_light(p1, color, range);
+    l.edge1 = vector3_init(p2.x - p1.x, p2.y - p1.y, p2.z - p1.z);
+    l.edge2 = vector3_init(p3.x - p1.x, p3.y - p1.y, p3.z - p1.z);
+    l.type = LIGHT_TRIANGLE;
+    return l;
+}
+
+light * load_lights(const char * filename, size_t * count) {
+    FILE * f = fopen(filename, "r");
+    if (!f) {
+        printf("failed to open file: %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t capacity = 16;
+    light * lights = (light *)malloc(sizeof(light) * capacity);
+    *count = 0;
+
+    char line[512];
+    float v[13];
+    while (fgets(line, sizeof(line), f)) {
+        char type[16];
+        if (sscanf(line, "%15s", type) != 1 || type[0] == '#') {
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity *= 2;
+            lights = (light *)realloc(lights, sizeof(light) * capacity);
+        }
+
+        light * l = &lights[*count];
+        if (!strcmp(type, "point") && sscanf(line, "%*s %f %f %f %f %f %f %f",
+                    &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6]) == 7) {
+            *l = make_point_light(vector3_init(v[0], v[1], v[2]),
+                    vector3_init(v[3], v[4], v[5]), v[6]);
+        } else if (!strcmp(type, "sphere") && sscanf(line, "%*s %f %f %f %f %f %f %f %f",
+                    &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) == 8) {
+            *l = make_sphere_light(vector3_init(v[0], v[1], v[2]), v[3],
+                    vector3_init(v[4], v[5], v[6]), v[7]);
+        } else if (!strcmp(type, "triangle") && sscanf(line,
+                    "%*s %f %f %f %f %f %f %f %f %f %f %f %f %f",
+                    &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6],
+                    &v[7], &v[8], &v[9], &v[10], &v[11], &v[12]) == 13) {
+            *l = make_triangle_light(vector3_init(v[0], v[1], v[2]),
+                    vector3_init(v[3], v[4], v[5]), vector3_init(v[6], v[7], v[8]),
+                    vector3_init(v[9], v[10], v[11]), v[12]);
+        } else {
+            fprintf(stderr, "%s: invalid light: %s", filename, line);
+            exit(EXIT_FAILURE);
+        }
+
+        (*count)++;
+    }
+
+    fclose(f);
+    return lights;
+}
+
+/**
+ Rough estimate of how much a light contributes to the scene,
+ brighter lights with a longer range are sampled more often.
+ */
+static float estimate_power(light l) {
+    float brightness = fmaxf(l.color.x, fmaxf(l.color.y, l.color.z));
+    return brightness * l.color.w * l.color.w;
+}
+
+void build_light_table(light * lights, size_t count, light_alias * table) {
+    float total = 0.0f;
+    for (size_t i = 0; i < count; i++) {
+        total += estimate_power(lights[i]);
+    }
+
+    // scaled probabilities, split into those above and below the average
+    float * scaled = (float *)malloc(sizeof(float) * count);
+    int * small = (int *)malloc(sizeof(int) * count);
+    int * large = (int *)malloc(sizeof(int) * count);
+    size_t n_small = 0, n_large = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        lights[i].pdf = total > 0.0f ? estimate_power(lights[i]) / total : 1.0f / count;
+        scaled[i] = lights[i].pdf * count;
+
+        if (scaled[i] < 1.0f) {
+            small[n_small++] = (int)i;
+        } else {
+            large[n_large++] = (int)i;
+        }
+    }
+
+    // pair each under full slot with an over full light
+    while (n_small > 0 && n_large > 0) {
+        int s = small[--n_small];
+        int l = large[--n_large];
+
+        table[s] = (light_alias){ scaled[s], l };
+        scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+
+        if (scaled[l] < 1.0f) {
+            small[n_small++] = l;
+        } else {
+            large[n_large++] = l;
+        }
+    }
+
+    // whatever remains is full up to floating point error
+    while (n_large > 0) {
+        int l = large[--n_large];
+        table[l] = (light_alias){ 1.0f, l };
+    }
+    while (n_small > 0) {
+        int s = small[--n_small];
+        table[s] = (light_alias){ 1.0f, s };
+    }
+
+    free(scaled);
+    free(small);
+    free(large);
+}
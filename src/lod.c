@@ -0,0 +1,517 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "lod.h"
+#include "surface.h"
+
+// collapse passes per level, the error allowed grows with every pass
+#define LOD_PASSES 64
+
+// smallest cosine between a triangle's normal before and after a collapse
+#define LOD_MIN_COS 0.2
+
+// weight of the planes holding open borders in place
+#define LOD_BORDER_WEIGHT 1000.0
+
+/**
+ Sum of squared distances to a set of planes, the symmetric 4x4 matrix
+ stored as its upper triangle: aa ab ac ad bb bc bd cc cd dd.
+ */
+typedef struct {
+    double q[10];
+} quadric;
+
+/**
+ An indexed mesh being simplified.
+ */
+typedef struct {
+    size_t vertex_count;
+    size_t triangle_count;      // including deleted triangles
+    size_t live;                // triangles not deleted
+
+    double (*pos)[3];
+    quadric * quadrics;
+    unsigned * tris;            // 3 vertices per triangle
+    bool * deleted;
+
+    // live triangles around every vertex, rebuilt every pass
+    unsigned * adj_start;
+    unsigned * adj;
+    bool * touched;             // collapsed this pass, its adjacency is stale
+} simplifier;
+
+/**
+ One mesh of the model, simplified by a single task.
+ */
+typedef struct {
+    const model * m;
+    const mesh_range * range;
+    lod_mesh * mesh;
+    arena memory;
+    cl_float * levels[LOD_LEVELS]; // triangle records, level 0 stays in the model
+} lod_job;
+
+// a corner of the triangle soup before welding
+typedef struct {
+    cl_float p[3];
+    unsigned corner;
+} weld_vertex;
+
+static int compare_weld(const void * a, const void * b) {
+    return memcmp(((const weld_vertex *)a)->p, ((const weld_vertex *)b)->p, sizeof(cl_float) * 3);
+}
+
+/**
+ Cross product of the edges of triangle a, b, c.
+ \return Twice the area of the triangle, the length of 'n'.
+ */
+static double triangle_normal(const double * a, const double * b, const double * c, double * n) {
+    double e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+    double e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+    n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+    return sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+}
+
+/**
+ Adds the plane through 'p' with unit normal 'n', weighted by 'w'.
+ */
+static void add_plane(quadric * q, const double * n, const double * p, double w) {
+    double d = -(n[0] * p[0] + n[1] * p[1] + n[2] * p[2]);
+    const double v[4] = { n[0], n[1], n[2], d };
+    unsigned k = 0;
+    for (unsigned i = 0; i < 4; i++) {
+        for (unsigned j = i; j < 4; j++) {
+            q->q[k++] += w * v[i] * v[j];
+        }
+    }
+}
+
+static double quadric_error(const quadric * q, const double * p) {
+    const double * m = q->q;
+    double x = p[0], y = p[1], z = p[2];
+    return m[0] * x * x + 2 * m[1] * x * y + 2 * m[2] * x * z + 2 * m[3] * x +
+           m[4] * y * y + 2 * m[5] * y * z + 2 * m[6] * y +
+           m[7] * z * z + 2 * m[8] * z + m[9];
+}
+
+/**
+ Lists the live triangles around every vertex.
+ */
+static void build_adjacency(simplifier * s) {
+    memset(s->adj_start, 0, sizeof(unsigned) * (s->vertex_count + 1));
+    for (size_t t = 0; t < s->triangle_count; t++) {
+        if (s->deleted[t]) { continue; }
+        for (unsigned c = 0; c < 3; c++) {
+            s->adj_start[s->tris[3 * t + c] + 1]++;
+        }
+    }
+    for (size_t v = 0; v < s->vertex_count; v++) {
+        s->adj_start[v + 1] += s->adj_start[v];
+    }
+
+    // the starts advance while filling, then move back by one vertex
+    for (size_t t = 0; t < s->triangle_count; t++) {
+        if (s->deleted[t]) { continue; }
+        for (unsigned c = 0; c < 3; c++) {
+            s->adj[s->adj_start[s->tris[3 * t + c]]++] = (unsigned)t;
+        }
+    }
+    memmove(s->adj_start + 1, s->adj_start, sizeof(unsigned) * s->vertex_count);
+    s->adj_start[0] = 0;
+}
+
+static bool has_vertex(const simplifier * s, unsigned t, unsigned v) {
+    const unsigned * tri = s->tris + 3 * t;
+    return tri[0] == v || tri[1] == v || tri[2] == v;
+}
+
+/**
+ Sums the planes of the triangles around every vertex, plus a plane
+ perpendicular to every border edge so open borders do not shrink.
+ */
+static void init_quadrics(simplifier * s) {
+    memset(s->quadrics, 0, sizeof(quadric) * s->vertex_count);
+
+    for (size_t t = 0; t < s->triangle_count; t++) {
+        const unsigned * tri = s->tris + 3 * t;
+        double n[3];
+        double area = triangle_normal(s->pos[tri[0]], s->pos[tri[1]], s->pos[tri[2]], n);
+        if (area <= 0.0) { continue; }
+        n[0] /= area; n[1] /= area; n[2] /= area;
+
+        for (unsigned c = 0; c < 3; c++) {
+            add_plane(&s->quadrics[tri[c]], n, s->pos[tri[c]], area);
+        }
+
+        for (unsigned c = 0; c < 3; c++) {
+            unsigned a = tri[c], b = tri[(c + 1) % 3];
+            unsigned shared = 0;
+            for (unsigned i = s->adj_start[a]; i < s->adj_start[a + 1]; i++) {
+                shared += has_vertex(s, s->adj[i], b);
+            }
+            if (shared != 1) { continue; }
+
+            const double * pa = s->pos[a];
+            const double * pb = s->pos[b];
+            double e[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+            double side[3] = {
+                e[1] * n[2] - e[2] * n[1],
+                e[2] * n[0] - e[0] * n[2],
+                e[0] * n[1] - e[1] * n[0]
+            };
+            double l = sqrt(side[0] * side[0] + side[1] * side[1] + side[2] * side[2]);
+            if (l <= 0.0) { continue; }
+            side[0] /= l; side[1] /= l; side[2] /= l;
+
+            double w = LOD_BORDER_WEIGHT * (e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
+            add_plane(&s->quadrics[a], side, pa, w);
+            add_plane(&s->quadrics[b], side, pa, w);
+        }
+    }
+}
+
+/**
+ Checks whether moving vertex 'v' to 'p' would fold over or collapse
+ one of its triangles that does not also contain 'other'.
+ */
+static bool flips(const simplifier * s, unsigned v, unsigned other, const double * p) {
+    for (unsigned i = s->adj_start[v]; i < s->adj_start[v + 1]; i++) {
+        unsigned t = s->adj[i];
+        if (s->deleted[t] || has_vertex(s, t, other)) { continue; }
+
+        const unsigned * tri = s->tris + 3 * t;
+        const double * before[3] = { s->pos[tri[0]], s->pos[tri[1]], s->pos[tri[2]] };
+        const double * after[3] = { before[0], before[1], before[2] };
+        for (unsigned c = 0; c < 3; c++) {
+            if (tri[c] == v) { after[c] = p; }
+        }
+
+        double n0[3], n1[3];
+        double l0 = triangle_normal(before[0], before[1], before[2], n0);
+        double l1 = triangle_normal(after[0], after[1], after[2], n1);
+        if (l1 <= 0.0) { return true; }
+        if (l0 > 0.0 && (n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2]) < LOD_MIN_COS * l0 * l1) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ Merges vertex 'b' into 'a' at 'p', deleting the triangles on the edge.
+ */
+static void collapse(simplifier * s, unsigned a, unsigned b, const double * p, const quadric * q) {
+    memcpy(s->pos[a], p, sizeof(double) * 3);
+    s->quadrics[a] = *q;
+
+    for (unsigned i = s->adj_start[b]; i < s->adj_start[b + 1]; i++) {
+        unsigned t = s->adj[i];
+        if (s->deleted[t]) { continue; }
+
+        if (has_vertex(s, t, a)) {
+            s->deleted[t] = true;
+            s->live--;
+            continue;
+        }
+        for (unsigned c = 0; c < 3; c++) {
+            if (s->tris[3 * t + c] == b) { s->tris[3 * t + c] = a; }
+        }
+    }
+
+    s->touched[a] = s->touched[b] = true;
+}
+
+/**
+ Collapses edges, cheapest first in growing error bands, until at
+ most 'target' triangles are left or no collapse is allowed.
+ \param scale Size of the mesh, errors are relative to it.
+ */
+static void simplify(simplifier * s, size_t target, double scale) {
+    for (unsigned pass = 0; pass < LOD_PASSES && s->live > target; pass++) {
+        build_adjacency(s);
+        memset(s->touched, 0, sizeof(bool) * s->vertex_count);
+        double threshold = 1e-9 * pow(pass + 3.0, 5.0) * scale * scale;
+
+        for (size_t t = 0; t < s->triangle_count && s->live > target; t++) {
+            if (s->deleted[t]) { continue; }
+
+            for (unsigned c = 0; c < 3; c++) {
+                unsigned a = s->tris[3 * t + c];
+                unsigned b = s->tris[3 * t + (c + 1) % 3];
+                if (s->touched[a] || s->touched[b]) { continue; }
+
+                quadric q;
+                for (unsigned k = 0; k < 10; k++) {
+                    q.q[k] = s->quadrics[a].q[k] + s->quadrics[b].q[k];
+                }
+
+                // the cheaper end point or the midpoint of the edge
+                const double * pa = s->pos[a];
+                const double * pb = s->pos[b];
+                double mid[3] = { (pa[0] + pb[0]) / 2, (pa[1] + pb[1]) / 2, (pa[2] + pb[2]) / 2 };
+                const double * candidates[] = { pa, pb, mid };
+                double p[3];
+                double error = INFINITY;
+                for (unsigned i = 0; i < 3; i++) {
+                    double e = quadric_error(&q, candidates[i]);
+                    if (e < error) {
+                        error = e;
+                        memcpy(p, candidates[i], sizeof(p));
+                    }
+                }
+
+                if (error > threshold || flips(s, a, b, p) || flips(s, b, a, p)) {
+                    continue;
+                }
+
+                collapse(s, a, b, p, &q);
+                break; // the triangle is gone or moved
+            }
+        }
+    }
+}
+
+/**
+ Writes the live triangles as triangle records, see make_triangle(...).
+ */
+static cl_float * write_level(const simplifier * s, arena * memory) {
+    cl_float * out = arena_alloc(memory, sizeof(cl_float) * TRIANGLE_SIZE * s->live);
+    cl_float * record = out;
+    for (size_t t = 0; t < s->triangle_count; t++) {
+        if (s->deleted[t]) { continue; }
+
+        vector4 p[3];
+        for (unsigned c = 0; c < 3; c++) {
+            const double * v = s->pos[s->tris[3 * t + c]];
+            p[c] = vector3_init((float)v[0], (float)v[1], (float)v[2]);
+        }
+        make_triangle(p[0], p[1], p[2], record);
+        record += TRIANGLE_SIZE;
+    }
+
+    return out;
+}
+
+/**
+ Welds the triangles of a mesh by position and simplifies them into
+ as many levels as keep getting smaller.
+ */
+static void build_mesh_lods(void * arg) {
+    lod_job * job = (lod_job *)arg;
+    lod_mesh * mesh = job->mesh;
+    size_t count = job->range->count;
+    const cl_float * tri = job->m->surfaces + job->range->first * TRIANGLE_SIZE;
+    arena * memory = &job->memory;
+
+    // identical positions become one vertex, so collapses keep the mesh connected
+    weld_vertex * corners = arena_alloc(memory, sizeof(weld_vertex) * 3 * count);
+    for (size_t t = 0; t < count; t++) {
+        for (unsigned c = 0; c < 3; c++) {
+            memcpy(corners[3 * t + c].p, tri + t * TRIANGLE_SIZE + 1 + c * 4, sizeof(cl_float) * 3);
+            corners[3 * t + c].corner = (unsigned)(3 * t + c);
+        }
+    }
+    qsort(corners, 3 * count, sizeof(weld_vertex), compare_weld);
+
+    simplifier s;
+    s.triangle_count = s.live = count;
+    s.tris = arena_alloc(memory, sizeof(unsigned) * 3 * count);
+    s.pos = arena_alloc(memory, sizeof(double) * 3 * 3 * count);
+    s.vertex_count = 0;
+
+    double lo[3] = { INFINITY, INFINITY, INFINITY };
+    double hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+    for (size_t i = 0; i < 3 * count; i++) {
+        if (i == 0 || compare_weld(&corners[i - 1], &corners[i])) {
+            for (unsigned a = 0; a < 3; a++) {
+                s.pos[s.vertex_count][a] = corners[i].p[a];
+                lo[a] = fmin(lo[a], corners[i].p[a]);
+                hi[a] = fmax(hi[a], corners[i].p[a]);
+            }
+            s.vertex_count++;
+        }
+        s.tris[corners[i].corner] = (unsigned)(s.vertex_count - 1);
+    }
+
+    mesh->center = vector3_init((lo[0] + hi[0]) / 2, (lo[1] + hi[1]) / 2, (lo[2] + hi[2]) / 2);
+    double scale = sqrt((hi[0] - lo[0]) * (hi[0] - lo[0]) + (hi[1] - lo[1]) * (hi[1] - lo[1]) +
+                        (hi[2] - lo[2]) * (hi[2] - lo[2])) / 2;
+    mesh->radius = (float)scale;
+    mesh->count[0] = count;
+    mesh->level_count = 1;
+    if (count <= LOD_MIN_TRIANGLES) {
+        return;
+    }
+
+    s.quadrics = arena_alloc(memory, sizeof(quadric) * s.vertex_count);
+    s.deleted = arena_alloc(memory, sizeof(bool) * count);
+    s.adj_start = arena_alloc(memory, sizeof(unsigned) * (s.vertex_count + 1));
+    s.adj = arena_alloc(memory, sizeof(unsigned) * 3 * count);
+    s.touched = arena_alloc(memory, sizeof(bool) * s.vertex_count);
+    // corners welded together leave triangles without area behind
+    for (size_t t = 0; t < count; t++) {
+        const unsigned * v = s.tris + 3 * t;
+        s.deleted[t] = v[0] == v[1] || v[1] == v[2] || v[2] == v[0];
+        s.live -= s.deleted[t];
+    }
+
+    build_adjacency(&s);
+    init_quadrics(&s);
+
+    // every level continues from the one before, keeping its quadrics
+    for (unsigned level = 1; level < LOD_LEVELS; level++) {
+        size_t previous = mesh->count[level - 1];
+        if (previous <= LOD_MIN_TRIANGLES) {
+            break;
+        }
+
+        size_t target = (size_t)(previous * LOD_REDUCTION);
+        simplify(&s, target > LOD_MIN_TRIANGLES ? target : LOD_MIN_TRIANGLES, scale);
+
+        // stuck on borders or folds, coarser levels would not be any smaller
+        if (s.live == 0 || s.live > previous * 3 / 4) {
+            break;
+        }
+
+        job->levels[level] = write_level(&s, memory);
+        mesh->count[level] = s.live;
+        mesh->level_count = level + 1;
+    }
+}
+
+void build_lods(const model * m, thread_pool * pool, lod_scene * lods) {
+    double start = wall_time();
+    memset(lods, 0, sizeof(lod_scene));
+    init_arena(&lods->memory, 0);
+
+    lods->mesh_count = m->mesh_count;
+    lods->meshes = arena_alloc(&lods->memory, sizeof(lod_mesh) * (m->mesh_count + 1));
+    lods->selected = arena_alloc(&lods->memory, sizeof(unsigned) * (m->mesh_count + 1));
+    lod_job * jobs = arena_alloc(&lods->memory, sizeof(lod_job) * (m->mesh_count + 1));
+    memset(lods->meshes, 0, sizeof(lod_mesh) * m->mesh_count);
+    memset(jobs, 0, sizeof(lod_job) * m->mesh_count);
+
+    for (size_t i = 0; i < m->mesh_count; i++) {
+        jobs[i].m = m;
+        jobs[i].range = &m->meshes[i];
+        jobs[i].mesh = &lods->meshes[i];
+        lods->meshes[i].material_id = m->material_ids[m->meshes[i].first];
+        init_arena(&jobs[i].memory, 0);
+
+        if (pool) {
+            submit_task(pool, build_mesh_lods, &jobs[i]);
+        } else {
+            build_mesh_lods(&jobs[i]);
+        }
+    }
+    if (pool) { wait_thread_pool(pool); }
+
+    // place every level in the pool, then copy them in
+    size_t total = 0, coarsest = 0;
+    for (size_t i = 0; i < m->mesh_count; i++) {
+        lod_mesh * mesh = &lods->meshes[i];
+        for (unsigned level = 0; level < mesh->level_count; level++) {
+            mesh->first[level] = total;
+            total += mesh->count[level];
+        }
+        coarsest += mesh->count[mesh->level_count - 1];
+        lods->selected[i] = UINT32_MAX; // nothing is selected yet
+    }
+
+    init_host_buffer(&lods->pool, sizeof(cl_float) * TRIANGLE_SIZE * total, CL_MEM_READ_ONLY);
+    cl_float * out = map_host_buffer(&lods->pool, CL_MAP_WRITE_INVALIDATE_REGION);
+    for (size_t i = 0; i < m->mesh_count; i++) {
+        const lod_mesh * mesh = &lods->meshes[i];
+        memcpy(out + mesh->first[0] * TRIANGLE_SIZE, m->surfaces + m->meshes[i].first * TRIANGLE_SIZE,
+               sizeof(cl_float) * TRIANGLE_SIZE * mesh->count[0]);
+        for (unsigned level = 1; level < mesh->level_count; level++) {
+            memcpy(out + mesh->first[level] * TRIANGLE_SIZE, jobs[i].levels[level],
+                   sizeof(cl_float) * TRIANGLE_SIZE * mesh->count[level]);
+        }
+        release_arena(&jobs[i].memory);
+    }
+    unmap_host_buffer(&lods->pool);
+
+    printf("Built levels of detail for %zu meshes (%zu -> %zu triangles at the coarsest) in %f seconds.\n",
+           m->mesh_count, m->triangle_count, coarsest, wall_time() - start);
+}
+
+bool select_lods(lod_scene * lods, const cam_data * camera, unsigned width) {
+    // pixels covered by one unit at a distance of one unit
+    float focal = length(camera->look) / length(camera->right) * width * 0.5f;
+    lods->first_changed = lods->mesh_count;
+    lods->changed_lo = vector3_init(INFINITY, INFINITY, INFINITY);
+    lods->changed_hi = vector3_init(-INFINITY, -INFINITY, -INFINITY);
+
+    for (size_t i = 0; i < lods->mesh_count; i++) {
+        const lod_mesh * mesh = &lods->meshes[i];
+        vector4 d = vector3_init(mesh->center.x - camera->pos.x,
+                                 mesh->center.y - camera->pos.y,
+                                 mesh->center.z - camera->pos.z);
+        float distance = length(d);
+
+        // the full mesh whenever the camera is inside its bounds
+        unsigned level = 0;
+        if (distance > mesh->radius) {
+            float r = mesh->radius / distance * focal;
+            float area = (float)M_PI * r * r;
+            while (level + 1 < mesh->level_count && mesh->count[level] * LOD_PIXELS_PER_TRIANGLE > area) {
+                level++;
+            }
+        }
+
+        if (lods->selected[i] != level) {
+            lods->selected[i] = level;
+            if (lods->first_changed == lods->mesh_count) {
+                lods->first_changed = i;
+            }
+
+            const vector4 c = mesh->center;
+            const float r = mesh->radius;
+            lods->changed_lo = vector3_init(fminf(lods->changed_lo.x, c.x - r),
+                    fminf(lods->changed_lo.y, c.y - r), fminf(lods->changed_lo.z, c.z - r));
+            lods->changed_hi = vector3_init(fmaxf(lods->changed_hi.x, c.x + r),
+                    fmaxf(lods->changed_hi.y, c.y + r), fmaxf(lods->changed_hi.z, c.z + r));
+        }
+    }
+
+    return lods->first_changed < lods->mesh_count;
+}
+
+size_t enqueue_lods(lod_scene * lods, cl_mem surfaces, cl_mem material_ids) {
+    int err = CL_SUCCESS;
+    const size_t record = sizeof(cl_float) * TRIANGLE_SIZE;
+    size_t offset = 0;
+
+    for (size_t i = 0; i < lods->mesh_count; i++) {
+        const lod_mesh * mesh = &lods->meshes[i];
+        unsigned level = lods->selected[i];
+
+        // the meshes before the first change are already in place
+        if (i >= lods->first_changed) {
+            err = clEnqueueCopyBuffer(command_queue, lods->pool.mem, surfaces,
+                                      mesh->first[level] * record, offset * record,
+                                      mesh->count[level] * record, 0, NULL, NULL);
+            cl_check_err(err, "clEnqueueCopyBuffer(...)");
+            err = clEnqueueFillBuffer(command_queue, material_ids, &mesh->material_id, sizeof(cl_ushort),
+                                      offset * sizeof(cl_ushort), mesh->count[level] * sizeof(cl_ushort),
+                                      0, NULL, NULL);
+            cl_check_err(err, "clEnqueueFillBuffer(...)");
+        }
+        offset += mesh->count[level];
+    }
+
+    lods->first_changed = lods->mesh_count;
+    lods->triangle_count = offset;
+    return offset;
+}
+
+void release_lods(lod_scene * lods) {
+    release_host_buffer(&lods->pool);
+    release_arena(&lods->memory);
+}
@@ -21,19 +21,130 @@
 #include "camera.h"
 #include "vector.h"
 #include "model.h"
+#include "options.h"
+#include "antialias.h"
+#include "light.h"
+#include "kernel_args.h"
+#include "compress.h"
+#include "nbody.h"
+#include "lbvh.h"
+#include "sah_bvh.h"
+#include "thread_pool.h"
+#include "reorder.h"
+#include "batch.h"
+#include "host_buffer.h"
+#include "tuner.h"
+#include "tonemap.h"
+#include "lod.h"
+#include "irradiance.h"
+#include "distribute.h"
 
 const char * window_title = "imrtcl";
-const char * ray_tracer_filename = "../kernels/ray_tracer.cl";
+const char * ray_tracer_filenames[] = {
+    "../kernels/lbvh.cl",
+    "../kernels/nbody_sim.cl",
+    "../kernels/ray_tracer.cl"
+};
+const char * nbody_filenames[] = {
+    "../kernels/lbvh.cl",
+    "../kernels/nbody_sim.cl"
+};
 
 cl_mem tex;
+
+// HDR frame the scene kernels write to, owned by the tonemap module, see tonemap_frame()
+static cl_mem render_target;
+
+// what changed since the frame on screen was rendered, see poll_changes()
+#define DIRTY_CAMERA     0x1
+#define DIRTY_LIGHT      0x2
+#define DIRTY_SCENE      0x4
+#define DIRTY_RESOLUTION 0x8
+
+// longest wait for input once the view has converged, in seconds
+#define IDLE_WAIT 0.25
+
+void upload_geometry(model * scene);
+void set_geometry_kernel_args(cl_kernel k);
+void set_scene_kernel_args(cl_kernel k, cl_mem mat, cl_mem mat_ids);
+void set_light_kernel_args(cl_kernel k, cl_mem lights, cl_mem light_table, size_t num_lights);
 void set_camera_kernel_args();
+void set_sphere_kernel_args(cl_kernel k);
+void update_bodies();
+void build_scene_bvh();
+void update_lods();
 vector4 get_cam_vel();
 vector4 get_cam_rot();
-void render_cl(float time);
+unsigned poll_changes();
+void init_persistent();
+void size_persistent();
+void tune_frame(const size_t * local);
+light default_light(vector4 pos);
+void enqueue_frame();
+void render_cl(float time, bool restart);
+void render_batch();
+void join_scene(int argc, const char ** argv);
+void render_tiles();
 void present_gl();
+int run_nbody();
 
 static cam_data camera;
 
+// rectangle of the frame the scene kernels render, in fractions of its
+// size (x, y, w, h), a single tile on workers, see crop_camera(...)
+static vector4 view = { 0.0f, 0.0f, 1.0f, 1.0f };
+static unsigned frame_w, frame_h; // size of the whole frame on workers
+
+// the default scene has a single light animated by render_cl(...),
+// the L key pauses and resumes it
+static bool animate_light = false;
+static bool light_paused = false;
+static cl_mem light_buffer;
+static vector4 light_center = { 0.0f, 0.0f, 8.0f, 0.0f };
+
+// simulated bodies rendered as spheres (--show), see update_bodies()
+static lbvh body_tree;
+static float body_radius;
+static int body_material;
+
+// scene geometry, see upload_geometry(...)
+static cl_mem geometry[3];
+static int geometry_count[2];
+static vector4 scene_lo, scene_hi;
+
+// triangle BVH over geometry[0] when options.use_bvh is set, either
+// built on the device in scene_tree or on the host with options.sah_bvh
+static lbvh scene_tree;
+static cl_kernel triangle_bounds_kernel;
+static cl_mem triangle_nodes;
+
+// levels of detail of every mesh with options.lod, swapped into geometry[0]
+// and scene_material_ids by update_lods()
+static lod_scene lods;
+static cl_mem scene_material_ids;
+
+// workers for host side builds
+static thread_pool * pool;
+
+// average still views over frames, see render_tonemap(...)
+static bool progressive = false;
+static unsigned accumulated = 1; // frames in the image on screen
+
+// work group size of the ray_tracer launch, picked by tune_work_group(...)
+static size_t frame_local[2];
+
+// tile counter and number of resident work groups with options.persistent_threads
+static cl_mem next_tile;
+static size_t persistent_groups;
+static cl_uint compute_units;
+
+// work groups launched per compute unit, enough to hide latency
+static const size_t groups_per_unit = 4;
+
+// every kernel sharing the ray_tracer camera and scene arguments
+static cl_kernel scene_kernels[3];
+static unsigned n_scene_kernels = 0;
+
 /**
  Application entry point. Here we will create the OpenCL context,
  load a sample program, and test the results for a given set of data.
@@ -42,86 +153,234 @@ int main(int argc, const char ** argv) {
     srand((int)time(NULL));
     int err = CL_SUCCESS;           // error code parameter for OpenCL functions
 
-    init_gl(window_title, 1);
-    init_cl(&ray_tracer_filename, 1);
+    parse_options(argc, argv);
+    if (options.nbody_count && !options.nbody_show) {
+        return run_nbody();
+    }
+    if (options.listen_address) {
+        return run_coordinator(argc, argv);
+    }
+    if (options.worker_address) {
+        join_scene(argc, argv);
+    }
+    double startup = wall_time();
+
+    // the pool also runs the host BVH build and the batch frame writers, first
+    // it parses the models while the window, the context and the program come
+    // up, only placing them in the geometry buffers waits for the context
+    model_import import;
+    pool = create_thread_pool(options.threads);
+    begin_import(options.model_files, options.model_count, pool, &import);
+
+    // batch renders and tiles go to an image read back by the host instead of a window
+    if (!options.batch_file && !options.worker_address) {
+        init_gl(window_title, 1);
+    }
+
+    // the context shares the window's OpenGL context, so it comes after it
+    init_cl_context();
+    char build_options[64];
+    snprintf(build_options, sizeof(build_options), "%s%s",
+             options.compressed_geometry ? "-DCOMPRESSED_GEOMETRY" :
+             options.use_bvh ? "-DUSE_BVH" : "",
+             options.tile_culling ? " -DTILE_CULLING" : "");
+    build_program(ray_tracer_filenames, 3, build_options);
+
+	/* --------
+	 * SURFACES
+	 * -------- */
+
+    model scene;
+    if (!finish_import(&import, &scene)) {
+        exit(EXIT_FAILURE);
+    }
+
+    wait_program();
+    const char * kernel_name = options.persistent_threads ? "ray_tracer_persistent" : "ray_tracer";
+    kernel = create_kernel(kernel_name);
+    if (options.persistent_threads) {
+        init_persistent();
+    }
 
+    scene_kernels[n_scene_kernels++] = kernel;
+    if (adaptive_aa) {
+        init_antialias(screen_w, screen_h);
+        scene_kernels[n_scene_kernels++] = refine_kernel;
+    } else {
+        // the ray tracer only records visibility for adaptive anti-aliasing
+        err = clSetKernelArg(kernel, ARG_KERNEL_SPECIFIC, sizeof(cl_mem), NULL);
+        cl_check_err(err, "clSetKernelArg(...)");
+    }
+
+    if (!window) {
+        // 8 bit sRGB for ppm frames, linear half floats for pfm frames
+        cl_image_format format = { CL_RGBA,
+            options.output_format == FRAME_PFM ? CL_HALF_FLOAT : CL_UNORM_INT8 };
+        cl_image_desc desc = { CL_MEM_OBJECT_IMAGE2D, screen_w, screen_h };
+        tex = clCreateImage(context, CL_MEM_READ_WRITE, &format, &desc, NULL, &err);
+        cl_check_err(err, "clCreateImage(...)");
+    } else {
 	// create the OpenCL reference to our OpenGL texture
 	// tex = clCreateFromGLTexture2D(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D,
     //                                    0, screen_tex, &err);
 	tex = clCreateFromGLTexture(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D,
 		0, screen_tex, &err);
 	cl_check_err(err, "clCreateFromGLTexture");
+    }
 
-    camera = init_camera(M_PI / 2.0f, 1.0f, screen_w / (float)screen_h);
+    init_tonemap(screen_w, screen_h, render_scale());
+    render_target = tonemap_frame();
+    progressive = window && options.progressive_frames > 1;
 
-	/* --------
-	 * SURFACES
-	 * -------- */
+    // the aspect of the whole frame, the screen of a worker is one tile of it
+    camera = init_camera(M_PI / 2.0f, 1.0f, (screen_w * view.w) / (screen_h * view.z));
 
-    size_t num_surfaces = 0;
-    cl_float * mesh = importModel("../models/box.obj", &num_surfaces);
-	size_t surf_val_count = TRIANGLE_SIZE * num_surfaces;
-	size_t surf_size = sizeof(cl_float) * surf_val_count;
+    upload_geometry(&scene);
 
-    cl_mem surfaces = clCreateBuffer(context, CL_MEM_READ_ONLY,
-                                     surf_size, NULL, &err);
-    cl_check_err(err, "clCreateBuffer(...)");
-    err = clEnqueueWriteBuffer(command_queue, surfaces, CL_TRUE, 0,
-                               surf_size, mesh, 0, NULL, NULL);
-    cl_check_err(err, "clEnqueueWriteBuffer(...)");
+    if (options.irradiance_cache) {
+        init_irradiance(scene_lo, scene_hi);
+    }
+
+    if (options.reorder_rays) {
+        init_reorder(screen_w * render_scale(), screen_h * render_scale(), scene_lo, scene_hi);
+        scene_kernels[n_scene_kernels++] = bounce_kernel;
+    } else {
+        disable_reorder();
+    }
 
-    free(mesh);
+    if (options.nbody_show) {
+        init_nbody(options.nbody_count);
+        set_nbody_solver(options.nbody_solver, options.nbody_theta);
+        init_lbvh(&body_tree, nbody_count(), false);
+
+        // spheres covering about a quarter of the disk, which has a radius near 1
+        body_radius = options.body_radius > 0.0f ?
+            options.body_radius : 0.5f / sqrtf((float)nbody_count());
+
+        // the bodies share one material, appended to the table
+        body_material = add_material(&scene,
+            specular_material(vector3_init(0.9f, 0.75f, 0.5f), 0.5f, 20.0f));
+
+        // look at the disk face on, lit from the camera side
+        camera.pos = vector3_init(0.0f, 0.0f, -2.5f);
+        light_center = vector3_init(0.0f, 0.0f, -4.0f);
+    }
 
 	/* ---------
 	 * MATERIALS
 	 * --------- */
 
-	int mat_val_count = num_surfaces * sizeof(material) / sizeof(cl_float);
-	material * materials = (material *)malloc(sizeof(material) * num_surfaces);
-	for (int i=0; i<num_surfaces; i++) {
-		materials[i] = rand_material();
+	// the material table is small enough to live in __constant memory
+	size_t mat_size = scene.material_count * sizeof(material);
+	cl_ulong max_constant = 0;
+	err = clGetDeviceInfo(device_id, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE,
+			sizeof(cl_ulong), &max_constant, NULL);
+	cl_check_err(err, "clGetDeviceInfo(...)");
+	if (mat_size > max_constant) {
+		fprintf(stderr, "%zu materials exceed the constant buffer size (%lu bytes)\n",
+				scene.material_count, (unsigned long)max_constant);
+		exit(EXIT_FAILURE);
+	}
+
+	cl_mem mat = upload_host_data(scene.materials, mat_size, CL_MEM_READ_ONLY);
+
+	// imported in place, keep the buffer past release_model(...)
+	unmap_host_buffer(&scene.material_id_buffer);
+	cl_mem mat_ids = scene.material_id_buffer.mem;
+	clRetainMemObject(mat_ids);
+	scene_material_ids = mat_ids;
+
+	release_model(&scene);
+
+	/* ------
+	 * LIGHTS
+	 * ------ */
+
+	size_t num_lights = 1;
+	light * lights;
+	if (options.light_file) {
+		lights = load_lights(options.light_file, &num_lights);
+	} else {
+		animate_light = true;
+		lights = (light *)malloc(sizeof(light));
+		lights[0] = make_point_light(zero_vector4(), vector3_init(1.0f, 1.0f, 1.0f), 15.0f);
 	}
 
-	cl_mem mat = clCreateBuffer(context, CL_MEM_READ_ONLY,
-			num_surfaces * sizeof(material), NULL, &err);
-	cl_check_err(err, "clCreateBuffer(...)");
-	err = clEnqueueWriteBuffer(command_queue, mat, CL_TRUE, 0,
-			num_surfaces * sizeof(material), materials, 0, NULL, NULL);
-	cl_check_err(err, "clEnqueueWriteBuffer(...)");
+	light_alias * light_table = (light_alias *)malloc(sizeof(light_alias) * num_lights);
+	build_light_table(lights, num_lights, light_table);
+
+	light_buffer = upload_host_data(lights, num_lights * sizeof(light), CL_MEM_READ_ONLY);
+	cl_mem table = upload_host_data(light_table, num_lights * sizeof(light_alias), CL_MEM_READ_ONLY);
 
-	free(materials);
+	free(lights);
+	free(light_table);
 
     // set up our surfaces
-    err  = clSetKernelArg(kernel, 6, sizeof(cl_mem), &surfaces);
-    err |= clSetKernelArg(kernel, 7, sizeof(cl_mem), &mat);
-	err |= clSetKernelArg(kernel, 8, surf_size, NULL);
-	err |= clSetKernelArg(kernel, 9, num_surfaces * sizeof(material), NULL);
-    err |= clSetKernelArg(kernel, 10, sizeof(int), &num_surfaces);
-    err |= clSetKernelArg(kernel, 11, sizeof(int), &surf_val_count);
-    err |= clSetKernelArg(kernel, 12, sizeof(int), &mat_val_count);
+    for (unsigned i = 0; i < n_scene_kernels; i++) {
+        set_geometry_kernel_args(scene_kernels[i]);
+        set_scene_kernel_args(scene_kernels[i], mat, mat_ids);
+        set_light_kernel_args(scene_kernels[i], light_buffer, table, num_lights);
+        set_sphere_kernel_args(scene_kernels[i]);
+    }
 
-    // set the output reference
-    err |= clSetKernelArg(kernel, 13, sizeof(cl_mem), &tex);
-    cl_check_err(err, "clSetKernelArg(...)");
+    update_lods();
+
+    // tuned on the starting view, which stands in for the frames to come
+    char variant[128];
+    snprintf(variant, sizeof(variant), "%s %s", kernel_name, build_options);
+    set_camera_kernel_args();
+    update_bodies();
+    tune_work_group(kernel, variant, screen_w * render_scale(), screen_h * render_scale(),
+                    options.retune, tune_frame, frame_local);
+    if (options.persistent_threads) {
+        size_persistent();
+        printf("Persistent threads: %zu work groups on %u compute units.\n",
+               persistent_groups, compute_units);
+    }
+    printf("Ready to render in %f seconds.\n", wall_time() - startup);
 
     float time = 1.8f;
 
+    if (options.batch_file) {
+        render_batch();
+    } else if (options.worker_address) {
+        render_tiles();
+    }
+
 #ifndef __REAL_TIME__
-    glfwSetTime(0.0f);
-    set_camera_kernel_args();
-    render_cl(time = 3.5);
-    printf("Rendered in %f seconds.\n", glfwGetTime());
+    if (window) {
+        glfwSetTime(0.0f);
+        set_camera_kernel_args();
+        update_bodies();
+        render_cl(time = 3.5, true);
+        printf("Rendered in %f seconds.\n", glfwGetTime());
+    }
 #endif
 
-    glfwSetTime(0.0f);
-    while (!glfwWindowShouldClose(window)) {
+    if (window) {
+        glfwSetTime(0.0f);
+    }
+    // nothing has been rendered at the window's resolution yet
+    unsigned dirty = DIRTY_RESOLUTION;
+    while (window && !glfwWindowShouldClose(window)) {
 #ifdef __REAL_TIME__
-        // update the camera position from the input
-        move_camera(&camera, get_cam_vel());
-        rotate_camera(&camera, get_cam_rot());
-        set_camera_kernel_args();
-
-        render_cl(time += 2/60.0f);
+        dirty |= poll_changes();
+        if (dirty) {
+            if (dirty & DIRTY_CAMERA) { set_camera_kernel_args(); update_lods(); }
+            if (dirty & DIRTY_SCENE) { update_bodies(); }
+            if (dirty & DIRTY_LIGHT) { time += 2/60.0f; }
+
+            render_cl(time, true);
+            dirty = 0;
+        } else if (progressive && accumulated < options.progressive_frames) {
+            // nothing moved, spend the frame on more samples of the same view
+            render_cl(time, false);
+        } else {
+            // the device has nothing left to do until something changes
+            glfwWaitEventsTimeout(IDLE_WAIT);
+            // movement is timed from here, not from the last frame
+            last_time = glfwGetTime();
+        }
 #endif
         present_gl();
 
@@ -133,7 +392,45 @@ int main(int argc, const char ** argv) {
      Application cleanup.
      ----------------------------------------------------------- */
 
-    clReleaseMemObject(surfaces);
+    for (unsigned i = 0; i < 3; i++) {
+        if (geometry[i]) { clReleaseMemObject(geometry[i]); }
+    }
+    clReleaseMemObject(mat);
+    clReleaseMemObject(mat_ids);
+    clReleaseMemObject(light_buffer);
+    clReleaseMemObject(table);
+    if (!window) {
+        clReleaseMemObject(tex);
+    }
+    release_tonemap();
+    if (options.irradiance_cache) {
+        release_irradiance();
+    }
+    if (adaptive_aa) {
+        release_antialias();
+    }
+    if (options.reorder_rays) {
+        release_reorder();
+    }
+    if (options.persistent_threads) {
+        clReleaseMemObject(next_tile);
+    }
+    if (options.lod) {
+        release_lods(&lods);
+    }
+    if (options.sah_bvh) {
+        clReleaseMemObject(triangle_nodes);
+    } else if (options.use_bvh) {
+        release_lbvh(&scene_tree);
+        clReleaseKernel(triangle_bounds_kernel);
+    }
+    if (pool) {
+        release_thread_pool(pool);
+    }
+    if (options.nbody_show) {
+        release_lbvh(&body_tree);
+        release_nbody();
+    }
     release_cl();
 
     return 0;
@@ -167,42 +464,524 @@ vector4 get_cam_rot() {
     return zero_vector4();
 }
 
+/**
+ Moves the camera by the input since the last frame and reports
+ what changed since the frame on screen was rendered.
+ \return A combination of the DIRTY_* flags, 0 if the view is still.
+ */
+unsigned poll_changes() {
+    static bool l_was_down = false;
+    unsigned dirty = 0;
+
+    vector4 vel = get_cam_vel();
+    vector4 rot = get_cam_rot();
+    if (length(vel) > 0.0f || length(rot) > 0.0f) {
+        move_camera(&camera, vel);
+        rotate_camera(&camera, rot);
+        dirty |= DIRTY_CAMERA;
+    }
+
+    // toggle once per key press, not once per frame it is held
+    bool l_down = glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS;
+    if (l_down && !l_was_down) {
+        light_paused = !light_paused;
+    }
+    l_was_down = l_down;
+
+    if (animate_light && !light_paused) {
+        dirty |= DIRTY_LIGHT;
+    }
+    if (options.nbody_show) {
+        dirty |= DIRTY_SCENE;
+    }
+
+    return dirty;
+}
+
+/**
+ Creates a read only buffer initialized with 'size' bytes of 'data'.
+ */
+static cl_mem upload_buffer(const void * data, size_t size) {
+    return upload_host_data(data, size, CL_MEM_READ_ONLY);
+}
+
+void upload_geometry(model * scene) {
+    // bounds of every triangle vertex, see make_triangle(...)
+    scene_lo = vector3_init(INFINITY, INFINITY, INFINITY);
+    scene_hi = vector3_init(-INFINITY, -INFINITY, -INFINITY);
+    for (size_t t = 0; t < scene->triangle_count; t++) {
+        const cl_float * p = scene->surfaces + t * TRIANGLE_SIZE + 1;
+        for (unsigned v = 0; v < 3; v++, p += 4) {
+            scene_lo = vector3_init(fminf(scene_lo.x, p[0]), fminf(scene_lo.y, p[1]), fminf(scene_lo.z, p[2]));
+            scene_hi = vector3_init(fmaxf(scene_hi.x, p[0]), fmaxf(scene_hi.y, p[1]), fmaxf(scene_hi.z, p[2]));
+        }
+    }
+
+    if (options.compressed_geometry) {
+        compressed_geometry packed;
+        compress_geometry(scene->surfaces, scene->triangle_count, &packed);
+
+        geometry[0] = upload_buffer(packed.chunks, sizeof(geometry_chunk) * packed.chunk_count);
+        geometry[1] = upload_buffer(packed.vertices, sizeof(cl_ushort) * 3 * packed.vertex_count);
+        geometry[2] = upload_buffer(packed.triangles,
+                sizeof(cl_ushort) * COMPRESSED_TRIANGLE_SIZE * packed.triangle_count);
+        geometry_count[0] = (int)packed.chunk_count;
+
+        size_t full = sizeof(cl_float) * TRIANGLE_SIZE * scene->triangle_count;
+        size_t compressed = sizeof(geometry_chunk) * packed.chunk_count +
+            sizeof(cl_ushort) * (3 * packed.vertex_count + COMPRESSED_TRIANGLE_SIZE * packed.triangle_count);
+        printf("compressed geometry: %zu -> %zu bytes (%.2fx)\n",
+               full, compressed, full / (double)compressed);
+
+        release_compressed_geometry(&packed);
+    } else {
+        // the triangles were imported into device memory, see importModel(...)
+        geometry[0] = scene->surface_buffer.mem;
+        clRetainMemObject(geometry[0]);
+        geometry_count[0] = (int)scene->triangle_count;
+        geometry_count[1] = TRIANGLE_SIZE * (int)scene->triangle_count;
+    }
+
+    if (options.sah_bvh) {
+        double start = wall_time();
+        size_t node_count = 0;
+        bvh_node * nodes = build_sah_bvh(scene->surfaces, scene->triangle_count,
+                                         options.spatial_splits, pool, &node_count);
+        printf("Built the SAH BVH over %zu triangles (%zu nodes) on %u threads in %f seconds.\n",
+               scene->triangle_count, node_count, pool->n_threads, wall_time() - start);
+
+        triangle_nodes = upload_buffer(nodes, sizeof(bvh_node) * node_count);
+        free(nodes);
+    }
+
+    if (options.lod) {
+        build_lods(scene, pool, &lods);
+    }
+
+    // kernels may only read the triangles once they are unmapped
+    unmap_host_buffer(&scene->surface_buffer);
+    scene->surfaces = NULL;
+
+    if (options.use_bvh && !options.sah_bvh) {
+        triangle_bounds_kernel = create_kernel("triangle_bounds");
+        init_lbvh(&scene_tree, scene->triangle_count, false);
+
+        double start = wall_time();
+        build_scene_bvh();
+        clFinish(command_queue);
+        printf("Built the BVH over %zu triangles in %f seconds.\n",
+               scene->triangle_count, wall_time() - start);
+        triangle_nodes = scene_tree.nodes;
+    }
+}
+
+/**
+ Enqueues a rebuild of the triangle BVH from the current contents of
+ geometry[0], nothing is read back to the host. Must be enqueued again
+ whenever the triangles change.
+ */
+void build_scene_bvh() {
+    int err = CL_SUCCESS;
+    err  = clSetKernelArg(triangle_bounds_kernel, 0, sizeof(cl_mem), &geometry[0]);
+    err |= clSetKernelArg(triangle_bounds_kernel, 1, sizeof(int), &geometry_count[0]);
+    err |= clSetKernelArg(triangle_bounds_kernel, 2, sizeof(cl_mem), &scene_tree.prims);
+    cl_check_err(err, "clSetKernelArg(...)");
+
+    size_t local = LBVH_GROUP;
+    size_t global = (scene_tree.count + local - 1) / local * local;
+    err = clEnqueueNDRangeKernel(command_queue, triangle_bounds_kernel, 1, NULL,
+                                 &global, &local, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueNDRangeKernel(...)");
+
+    build_lbvh(&scene_tree, NULL);
+}
+
+/**
+ Selects the level of detail of every mesh for the current camera.
+ When any level changed the selection is copied into geometry[0] and
+ the kernels and the BVH are updated to the new triangle count.
+ */
+void update_lods() {
+    // sized for the whole frame, not the tile rendered by a worker
+    if (!options.lod || !select_lods(&lods, &camera, screen_w * render_scale() / view.z)) {
+        return;
+    }
+
+    if (options.irradiance_cache) {
+        // light bounced off the old levels
+        invalidate_irradiance(lods.changed_lo, lods.changed_hi);
+    }
+
+    size_t count = enqueue_lods(&lods, geometry[0], scene_material_ids);
+    geometry_count[0] = (int)count;
+    geometry_count[1] = TRIANGLE_SIZE * (int)count;
+    for (unsigned i = 0; i < n_scene_kernels; i++) {
+        set_geometry_kernel_args(scene_kernels[i]);
+    }
+
+    if (options.use_bvh) {
+        // the nodes were allocated for every level 0 triangle
+        scene_tree.count = count;
+        build_scene_bvh();
+    }
+}
+
+void set_geometry_kernel_args(cl_kernel k) {
+    int err = CL_SUCCESS;
+
+    if (options.compressed_geometry) {
+        err  = clSetKernelArg(k, ARG_CHUNKS, sizeof(cl_mem), &geometry[0]);
+        err |= clSetKernelArg(k, ARG_COMPRESSED_VERTICES, sizeof(cl_mem), &geometry[1]);
+        err |= clSetKernelArg(k, ARG_COMPRESSED_TRIANGLES, sizeof(cl_mem), &geometry[2]);
+        err |= clSetKernelArg(k, ARG_N_CHUNKS, sizeof(int), &geometry_count[0]);
+    } else if (options.use_bvh) {
+        err  = clSetKernelArg(k, ARG_SURFACES, sizeof(cl_mem), &geometry[0]);
+        err |= clSetKernelArg(k, ARG_TRIANGLE_NODES, sizeof(cl_mem), &triangle_nodes);
+        err |= clSetKernelArg(k, ARG_N_SURFACES, sizeof(int), &geometry_count[0]);
+        err |= clSetKernelArg(k, ARG_N_SURF_VALS, sizeof(int), &geometry_count[1]);
+    } else {
+        err  = clSetKernelArg(k, ARG_SURFACES, sizeof(cl_mem), &geometry[0]);
+        err |= clSetKernelArg(k, ARG_LOCAL_SURFACES, geometry_count[1] * sizeof(cl_float), NULL);
+        err |= clSetKernelArg(k, ARG_N_SURFACES, sizeof(int), &geometry_count[0]);
+        err |= clSetKernelArg(k, ARG_N_SURF_VALS, sizeof(int), &geometry_count[1]);
+    }
+    cl_check_err(err, "clSetKernelArg(...)");
+}
+
+void set_scene_kernel_args(cl_kernel k, cl_mem mat, cl_mem mat_ids) {
+    int err = CL_SUCCESS;
+    int max_depth = (int)options.max_depth;
+    err  = clSetKernelArg(k, ARG_MATERIALS, sizeof(cl_mem), &mat);
+    err |= clSetKernelArg(k, ARG_MATERIAL_IDS, sizeof(cl_mem), &mat_ids);
+    err |= clSetKernelArg(k, ARG_MAX_DEPTH, sizeof(int), &max_depth);
+    set_irradiance_kernel_args(k);
+
+    // set the output reference
+    err |= clSetKernelArg(k, ARG_OUTPUT, sizeof(cl_mem), &render_target);
+    cl_check_err(err, "clSetKernelArg(...)");
+}
+
+void set_light_kernel_args(cl_kernel k, cl_mem lights, cl_mem light_table, size_t num_lights) {
+    int err = CL_SUCCESS;
+    int n_lights = (int)num_lights;
+    int light_samples = (int)options.light_samples;
+
+    err  = clSetKernelArg(k, ARG_LIGHTS, sizeof(cl_mem), &lights);
+    err |= clSetKernelArg(k, ARG_LIGHT_TABLE, sizeof(cl_mem), &light_table);
+    err |= clSetKernelArg(k, ARG_N_LIGHTS, sizeof(int), &n_lights);
+    err |= clSetKernelArg(k, ARG_LIGHT_SAMPLES, sizeof(int), &light_samples);
+    cl_check_err(err, "clSetKernelArg(...)");
+}
+
 void set_camera_kernel_args() {
     static int err = CL_SUCCESS;
-    err  = clSetKernelArg(kernel, 0, sizeof(vector4), &camera.pos);
-    err |= clSetKernelArg(kernel, 1, sizeof(vector4), &camera.look);
-    err |= clSetKernelArg(kernel, 2, sizeof(vector4), &camera.right);
-    err |= clSetKernelArg(kernel, 3, sizeof(vector4), &camera.up);
+    cam_data c = crop_camera(&camera, view);
+    for (unsigned i = 0; i < n_scene_kernels; i++) {
+        cl_kernel k = scene_kernels[i];
+        err  = clSetKernelArg(k, ARG_CAMERA_POS, sizeof(vector4), &c.pos);
+        err |= clSetKernelArg(k, ARG_CAMERA_LOOK, sizeof(vector4), &c.look);
+        err |= clSetKernelArg(k, ARG_CAMERA_RIGHT, sizeof(vector4), &c.right);
+        err |= clSetKernelArg(k, ARG_CAMERA_UP, sizeof(vector4), &c.up);
+        cl_check_err(err, "clSetKernelArg(...)");
+    }
+}
+
+void set_sphere_kernel_args(cl_kernel k) {
+    int err = CL_SUCCESS;
+    cl_mem nodes = options.nbody_show ? body_tree.nodes : NULL;
+
+    err  = clSetKernelArg(k, ARG_SPHERE_NODES, sizeof(cl_mem), nodes ? &nodes : NULL);
+    err |= clSetKernelArg(k, ARG_SPHERES, sizeof(cl_mem), NULL);
+    err |= clSetKernelArg(k, ARG_SPHERE_RADIUS, sizeof(float), &body_radius);
+    err |= clSetKernelArg(k, ARG_SPHERE_MATERIAL, sizeof(int), &body_material);
     cl_check_err(err, "clSetKernelArg(...)");
 }
 
-void render_cl(float time) {
-    static int err = CL_SUCCESS;
-    const size_t global[] = {screen_w * sample_rate, screen_h * sample_rate};
-    const size_t local[] = {8 * sample_rate, 8 * sample_rate};
+/**
+ Advances the simulation by one timestep and rebuilds the sphere BVH
+ over the new positions. Everything stays on the device, the spheres
+ are read straight from the simulation's position buffer.
+ */
+void update_bodies() {
+    if (!options.nbody_show) {
+        return;
+    }
 
-    glFinish();
-    unsigned seed = rand();
+    int err = CL_SUCCESS;
+    step_nbody(1, options.nbody_timestep);
+
+    cl_mem positions = nbody_positions();
+    point_bounds_lbvh(&body_tree, positions, body_radius);
+    build_lbvh(&body_tree, NULL);
+
+    // positions ping-pong between two buffers every step
+    for (unsigned i = 0; i < n_scene_kernels; i++) {
+        err = clSetKernelArg(scene_kernels[i], ARG_SPHERES, sizeof(cl_mem), &positions);
+        cl_check_err(err, "clSetKernelArg(...)");
+    }
+}
+
+/**
+ Binds the tile counter to the ray_tracer_persistent kernel,
+ the launch is sized by size_persistent(...).
+ */
+void init_persistent() {
+    int err = CL_SUCCESS;
+    err = clGetDeviceInfo(device_id, CL_DEVICE_MAX_COMPUTE_UNITS,
+                          sizeof(cl_uint), &compute_units, NULL);
+    cl_check_err(err, "clGetDeviceInfo(...)");
+
+    next_tile = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err);
+    cl_check_err(err, "clCreateBuffer(...)");
+    err = clSetKernelArg(kernel, ARG_KERNEL_SPECIFIC + 6, sizeof(cl_mem), &next_tile);
+    cl_check_err(err, "clSetKernelArg(...)");
+}
+
+/**
+ Sizes the persistent threads launch to the device and the
+ tiles of the current work group size.
+ */
+void size_persistent() {
+    // more groups than tiles would only fetch past the end
+    size_t tiles = ((screen_w * render_scale() + frame_local[0] - 1) / frame_local[0]) *
+                   ((screen_h * render_scale() + frame_local[1] - 1) / frame_local[1]);
+    persistent_groups = compute_units * groups_per_unit;
+    if (persistent_groups > tiles) {
+        persistent_groups = tiles;
+    }
+}
+
+/**
+ Renders a frame with a candidate work group size for tune_work_group(...).
+ */
+void tune_frame(const size_t * local) {
+    frame_local[0] = local[0];
+    frame_local[1] = local[1];
+    if (options.persistent_threads) {
+        size_persistent();
+    }
+
+    enqueue_frame();
+    clFinish(command_queue);
+}
+
+/**
+ The single light of the default scene placed at 'pos'.
+ */
+light default_light(vector4 pos) {
+    vector4 white = vector3_init(1.0f, 1.0f, 1.0f);
 #ifdef __REAL_TIME__
-    vector4 light_pos = vector4_init(2 * sin(time), 2 * cos(time), 8.0, 0.0);
+    light l = make_point_light(pos, white, 15.0f);
 #else
-    vector4 light_pos = vector4_init(2 * sin(time), 2 * cos(time), 8.0, 0.5);
+    light l = make_sphere_light(pos, 0.5f, white, 15.0f);
 #endif
-    err |= clSetKernelArg(kernel, 4, sizeof(unsigned), &seed);
-    err  = clSetKernelArg(kernel, 5, sizeof(vector4), &light_pos);
-    cl_check_err(err, "clSetKernelArg(...)");
+    l.pdf = 1.0f;
+    return l;
+}
 
-    err = clEnqueueAcquireGLObjects(command_queue, 1, &tex, 0, 0, NULL);
-    cl_check_err(err, "clEnqueueAcquireGLObjects(...)");
-    err = clEnqueueNDRangeKernel(command_queue, kernel, 2,
-                                 NULL, global, local, 0, NULL, NULL);
-    cl_check_err(err, "clEnqueueNDRangeKernel(...)");
-    err = clEnqueueReleaseGLObjects(command_queue, 1, &tex, 0, 0, NULL);
-    cl_check_err(err, "clEnqueueReleaseGLObjects(...)");
+/**
+ Renders a frame with the light at 'time' and waits for it.
+ \param restart Show the new frame on its own instead of averaging
+                it with the frames since the last restart.
+ */
+void render_cl(float time, bool restart) {
+    static int err = CL_SUCCESS;
+    accumulated = restart ? 1 : accumulated + 1;
 
+    glFinish();
+    if (animate_light) {
+        // kept static, the write may still be pending when we return
+        static light l;
+        l = default_light(vector3_init(light_center.x + 2 * sin(time),
+                                       light_center.y + 2 * cos(time), light_center.z));
+        err = clEnqueueWriteBuffer(command_queue, light_buffer, CL_FALSE, 0,
+                                   sizeof(light), &l, 0, NULL, NULL);
+        cl_check_err(err, "clEnqueueWriteBuffer(...)");
+    }
+
+    enqueue_frame();
     clFinish(command_queue);
 }
 
+/**
+ Enqueues every pass rendering a frame into the HDR frame with the
+ current camera and lights, and the tonemap pass resolving it into
+ 'tex', without waiting for any of them to finish. With progressive
+ refinement 'tex' shows the mean of the last 'accumulated' frames.
+ */
+void enqueue_frame() {
+    static int err = CL_SUCCESS;
+    const unsigned scale = render_scale();
+    const size_t * local = frame_local;
+
+    // whole work groups, the kernel skips work items past the image
+    const size_t global[] = {
+        (screen_w * scale + local[0] - 1) / local[0] * local[0],
+        (screen_h * scale + local[1] - 1) / local[1] * local[1]
+    };
+
+    unsigned seed = rand();
+    for (unsigned i = 0; i < n_scene_kernels; i++) {
+        err = clSetKernelArg(scene_kernels[i], ARG_SEED, sizeof(unsigned), &seed);
+        cl_check_err(err, "clSetKernelArg(...)");
+    }
+
+    if (window) {
+        err = clEnqueueAcquireGLObjects(command_queue, 1, &tex, 0, 0, NULL);
+        cl_check_err(err, "clEnqueueAcquireGLObjects(...)");
+    }
+    if (options.irradiance_cache) {
+        // the bodies move every frame, drop the light cached around them
+        refresh_irradiance(options.nbody_show ? body_tree.nodes : NULL);
+    }
+    if (options.persistent_threads) {
+        static const cl_uint zero = 0;
+        const size_t resident[] = {local[0] * persistent_groups, local[1]};
+        err = clEnqueueWriteBuffer(command_queue, next_tile, CL_FALSE, 0,
+                                   sizeof(cl_uint), &zero, 0, NULL, NULL);
+        cl_check_err(err, "clEnqueueWriteBuffer(...)");
+        err = clEnqueueNDRangeKernel(command_queue, kernel, 2,
+                                     NULL, resident, local, 0, NULL, NULL);
+    } else {
+        err = clEnqueueNDRangeKernel(command_queue, kernel, 2,
+                                     NULL, global, local, 0, NULL, NULL);
+    }
+    cl_check_err(err, "clEnqueueNDRangeKernel(...)");
+    if (options.reorder_rays) {
+        render_reorder();
+    }
+    if (adaptive_aa) {
+        render_antialias(screen_w, screen_h, options.edge_threshold, sample_rate);
+    }
+    render_tonemap(tex, window || options.output_format == FRAME_PPM ? TONEMAP_DISPLAY : TONEMAP_LINEAR,
+                   options.exposure, progressive ? accumulated : 1);
+    if (window) {
+        err = clEnqueueReleaseGLObjects(command_queue, 1, &tex, 0, 0, NULL);
+        cl_check_err(err, "clEnqueueReleaseGLObjects(...)");
+    }
+}
+
+/**
+ Renders the frames of options.batch_file back to back without a window.
+ Each frame is read back without blocking and saved by a writer thread,
+ so the device renders the next frames while earlier ones are written.
+ */
+void render_batch() {
+    int err = CL_SUCCESS;
+    size_t n_keys = 0;
+    keyframe * keys = load_keyframes(options.batch_file, &n_keys);
+
+    // either one frame per keyframe or frames evenly spaced over all of them
+    unsigned frames = options.batch_frames ? options.batch_frames : (unsigned)n_keys;
+    float start = keys[0].time;
+    float end = keys[n_keys - 1].time;
+
+    init_frame_writer(tex, screen_w, screen_h,
+                      options.output_prefix, options.output_format, pool);
+
+    // light of every frame in flight, reused once its frame is written
+    light staged[FRAME_SLOTS];
+
+    double begin = wall_time();
+    for (unsigned f = 0; f < frames; f++) {
+        keyframe k = !options.batch_frames ? keys[f] :
+            sample_keyframes(keys, n_keys, frames > 1 ? start + (end - start) * f / (frames - 1) : start);
+        unsigned slot = acquire_frame_slot(f);
+
+        look_at_camera(&camera, k.camera, k.target);
+        set_camera_kernel_args();
+        update_lods();
+
+        if (animate_light) {
+            staged[slot] = default_light(k.light);
+            err = clEnqueueWriteBuffer(command_queue, light_buffer, CL_FALSE, 0,
+                                       sizeof(light), &staged[slot], 0, NULL, NULL);
+            cl_check_err(err, "clEnqueueWriteBuffer(...)");
+        }
+
+        update_bodies();
+        enqueue_frame();
+        write_frame(f);
+    }
+    release_frame_writer();
+
+    double elapsed = wall_time() - begin;
+    printf("Rendered %u frames in %f seconds (%.2f frames per second).\n",
+           frames, elapsed, frames / elapsed);
+    free(keys);
+}
+
+/**
+ Takes the scene from the --listen coordinator options.worker_address
+ names. Its command line is parsed first and this process' own on top,
+ then the screen is shrunk to a tile of the coordinator's frame.
+ */
+void join_scene(int argc, const char ** argv) {
+    const char * address = options.worker_address;
+    int scene_argc = 0;
+    const char ** scene_argv = NULL;
+    join_coordinator(address, &scene_argc, &scene_argv, &frame_w, &frame_h);
+
+    // the coordinator's default model applies if it named none
+    options.worker_address = NULL;
+    parse_options(scene_argc, scene_argv);
+    parse_options(argc, argv);
+
+    // the coordinator's own role, and its frames are the tiles sent back
+    options.listen_address = NULL;
+    options.batch_file = NULL;
+
+    screen_w = TILE_SIZE;
+    screen_h = TILE_SIZE;
+    view = vector4_init(0.0f, 0.0f, TILE_SIZE / (float)frame_w, TILE_SIZE / (float)frame_h);
+}
+
+/**
+ Renders the tiles the coordinator hands out until it has none left.
+ Every tile is a frame of TILE_SIZE pixels square seen through the part
+ of the camera covering it, read back and sent while the next job waits.
+ */
+void render_tiles() {
+    int err = CL_SUCCESS;
+    cl_uchar * pixels = (cl_uchar *)malloc(4 * TILE_SIZE * TILE_SIZE);
+    const size_t origin[] = {0, 0, 0};
+    const size_t region[] = {TILE_SIZE, TILE_SIZE, 1};
+
+    unsigned tiles = 0;
+    double begin = wall_time();
+    tile_job job;
+    while (receive_job(&job)) {
+        view.x = job.x / (float)frame_w;
+        view.y = job.y / (float)frame_h;
+        look_at_camera(&camera, job.camera, job.target);
+        set_camera_kernel_args();
+        update_lods();
+
+        if (animate_light) {
+            light l = default_light(job.light);
+            err = clEnqueueWriteBuffer(command_queue, light_buffer, CL_TRUE, 0,
+                                       sizeof(light), &l, 0, NULL, NULL);
+            cl_check_err(err, "clEnqueueWriteBuffer(...)");
+        }
+
+        // enqueue_frame() seeds its samples from rand()
+        srand(job.seed);
+        enqueue_frame();
+
+        err = clEnqueueReadImage(command_queue, tex, CL_TRUE, origin, region,
+                                 0, 0, pixels, 0, NULL, NULL);
+        cl_check_err(err, "clEnqueueReadImage(...)");
+        if (!send_tile(&job, pixels)) {
+            break;
+        }
+        tiles++;
+    }
+    leave_coordinator();
+
+    printf("Rendered %u tiles in %f seconds.\n", tiles, wall_time() - begin);
+    free(pixels);
+}
+
 void present_gl() {
     // refresh the OpenGL context with the new texture updates
     glClearColor(1, 0.2, 0.5, 1);
@@ -210,3 +989,22 @@ void present_gl() {
 
     update_screen();
 }
+
+/**
+ Headless n-body benchmark, no window or OpenGL context is created.
+ */
+int run_nbody() {
+    init_cl(nbody_filenames, 2, NULL);
+    init_nbody(options.nbody_count);
+
+    if (options.nbody_compare) {
+        compare_nbody(options.nbody_steps, options.nbody_timestep, options.nbody_theta);
+    } else {
+        set_nbody_solver(options.nbody_solver, options.nbody_theta);
+        benchmark_nbody(options.nbody_steps, options.nbody_timestep);
+    }
+
+    release_nbody();
+    release_cl();
+    return 0;
+}
@@ -3,8 +3,6 @@
 //  Copyright © 2016 Ian Malerich. All rights reserved.
 //
 
-#include <stdlib.h>
-
 #include "mat4x4.h"
 
 mat4x4 mat_identity() {
@@ -26,20 +24,20 @@ mat4x4 mat_init(float * f) {
 }
 
 mat4x4 mat_multiply(mat4x4 a, mat4x4 b) {
-    float * m0 = (float *)&a.x.x;
-    float * m1 = (float *)&b.x.x;
-    float * p = (float *)malloc(sizeof(float) * 16);
+    const float * m0 = (const float *)&a.x.x;
+    const float * m1 = (const float *)&b.x.x;
+    float p[16];
 
+    // row major, element (r, c) is row r of a dotted with column c of b
     for (int r = 0; r < 4; r++) {
         for (int c = 0; c < 4; c++) {
-            // do stuff here
-            int i = r * 4 + c;
-            p[i] = m0[i] * m1[i];
+            float sum = 0.0f;
+            for (int k = 0; k < 4; k++) {
+                sum += m0[r * 4 + k] * m1[k * 4 + c];
+            }
+            p[r * 4 + c] = sum;
         }
     }
 
-    // convert the float pointer to a matrix and return the result
-    mat4x4 tmp = mat_init(p);
-    free(p);
-    return tmp;
+    return mat_init(p);
 }
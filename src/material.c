@@ -12,7 +12,8 @@ material rand_material() {
         (rand() % 1000) / 1000.0f,  // specular-scalar
         (float)(rand() % 32),  // specular-power
         (rand() % 1000) / 1000.0f,  // reflection
-        (rand() % 1000) / 1000.0f   // refraction
+        (rand() % 1000) / 1000.0f,  // refraction
+        DEFAULT_IOR
     };
 }
 
@@ -20,7 +21,8 @@ material diffuse_material(vector4 diffuse) {
     return (material) {
         diffuse,
         0.0f, 0.0f, // specular
-        0.0f, 0.0f  // reflection and refraction
+        0.0f, 0.0f, // reflection and refraction
+        DEFAULT_IOR
     };
 }
 
@@ -28,6 +30,7 @@ material specular_material(vector4 diffuse, float spec_scalar, float spec_power)
     return (material) {
         diffuse,
         spec_scalar, spec_power,
-        0.0f, 0.0f  // reflection and refraction
+        0.0f, 0.0f, // reflection and refraction
+        DEFAULT_IOR
     };
 }
@@ -1,52 +1,302 @@
+#include <string.h>
+#include <math.h>
+
 #include <assimp/scene.h>
 #include <assimp/cimport.h>
 #include <assimp/postprocess.h>
 
 #include "model.h"
 
-cl_float * importModel(const char * filename, size_t * triangle_count) {
-	const struct aiScene * scene = aiImportFile(filename,
+// faces converted by a single task
+#define CONVERT_FACES 16384
+
+/**
+ A file being imported, its materials are converted by the import
+ task and merged into the model's table afterwards.
+ */
+typedef struct asset {
+	const char * filename;
+	const struct aiScene * scene;
+	arena memory;
+
+	material * materials;     // converted assimp materials
+	cl_ushort * remap;        // assimp material index to the merged table
+	size_t triangle_count;
+	size_t triangle_offset;   // first triangle of the asset in the model
+} asset;
+
+/**
+ A range of faces of one mesh, written to the model at a known offset.
+ */
+typedef struct {
+	const struct aiMesh * mesh;
+	unsigned first;
+	unsigned count;
+	cl_ushort material_id;
+	cl_float * surfaces;
+	cl_ushort * material_ids;
+} convert_job;
+
+static material convert_material(const struct aiMaterial * mat);
+
+/**
+ Runs func(arg) on 'pool', or right away if there is no pool.
+ */
+static void run_task(thread_pool * pool, task_func func, void * arg) {
+	if (pool) {
+		submit_task(pool, func, arg);
+	} else {
+		func(arg);
+	}
+}
+
+/**
+ Only meshes of triangles are imported, SortByPType splits off points and lines.
+ Triangulated polygons may carry aiPrimitiveType_NGONEncodingFlag as well.
+ */
+static bool triangle_mesh(const struct aiMesh * mesh) {
+	return (mesh->mPrimitiveTypes & aiPrimitiveType_TRIANGLE) != 0;
+}
+
+/**
+ Imports the file of an asset, then converts its materials and
+ counts its triangles.
+ */
+static void import_asset(void * arg) {
+	asset * a = (asset *)arg;
+	a->scene = aiImportFile(a->filename,
 		aiProcess_Triangulate | aiProcess_JoinIdenticalVertices | aiProcess_SortByPType);
 
-	if (!scene) {
-		const char * err = aiGetErrorString();
-		fprintf(stderr, "%s\n", err);
-		return NULL;
+	if (!a->scene) {
+		fprintf(stderr, "%s: %s\n", a->filename, aiGetErrorString());
+		return;
+	}
+
+	const struct aiScene * scene = a->scene;
+	a->materials = arena_alloc(&a->memory, sizeof(material) * (scene->mNumMaterials + 1));
+	a->remap = arena_alloc(&a->memory, sizeof(cl_ushort) * (scene->mNumMaterials + 1));
+	for (unsigned i = 0; i<scene->mNumMaterials; i++) {
+		a->materials[i] = convert_material(scene->mMaterials[i]);
 	}
 
-	// loop over each mesh in the given scene
 	for (unsigned i = 0; i<scene->mNumMeshes; i++) {
-		struct aiMesh * mesh = scene->mMeshes[i];
+		if (triangle_mesh(scene->mMeshes[i])) {
+			a->triangle_count += scene->mMeshes[i]->mNumFaces;
+		}
+	}
+}
 
-		// TODO - Fix this for more than 1 mesh.
-		*triangle_count = mesh->mNumFaces;
-		cl_float * data = malloc(sizeof(cl_float) * (*triangle_count * TRIANGLE_SIZE));
-		cl_float * tmp = data;
+/**
+ Writes the faces of a job as triangle records, see make_triangle(...).
+ */
+static void convert_faces(void * arg) {
+	convert_job * job = (convert_job *)arg;
+	const struct aiVector3D * v = job->mesh->mVertices;
+	cl_float * out = job->surfaces;
 
-		// then for each mesh, loop over each face
-		for (unsigned k = 0; k<mesh->mNumFaces; k++) {
-			struct aiFace f = mesh->mFaces[k];
+	for (unsigned k = job->first; k < job->first + job->count; k++) {
+		// we asked assimp to triangulate faces
+		// therefore each face has three indices
+		const unsigned * index = job->mesh->mFaces[k].mIndices;
 
-			// we asked assimp to triangulate faces
-			// therefore each face has three indecies
-			struct aiVector3D v0 = mesh->mVertices[f.mIndices[0]];
-			struct aiVector3D v1 = mesh->mVertices[f.mIndices[1]];
-			struct aiVector3D v2 = mesh->mVertices[f.mIndices[2]];
+		*out++ = SURFACE_TRIANGLE;
+		for (unsigned c = 0; c < 3; c++) {
+			const struct aiVector3D p = v[index[c]];
+			*out++ = p.x;
+			*out++ = p.y;
+			*out++ = p.z;
+			*out++ = 1.0f;
+		}
+	}
 
-			// build a triangle which we can pass into our Ray Tracer
-			make_triangle(
-				vector3_init(v0.x, v0.y, v0.z),	
-				vector3_init(v1.x, v1.y, v1.z),	
-				vector3_init(v2.x, v2.y, v2.z),	
-				tmp);
-			tmp += TRIANGLE_SIZE;
+	for (unsigned k = 0; k < job->count; k++) {
+		job->material_ids[k] = job->material_id;
+	}
+}
+
+bool importModel(const char * filename, model * m) {
+	return import_models(&filename, 1, NULL, m);
+}
+
+bool import_models(const char ** filenames, size_t count, thread_pool * pool, model * m) {
+	model_import import;
+	begin_import(filenames, count, pool, &import);
+	return finish_import(&import, m);
+}
+
+void begin_import(const char ** filenames, size_t count, thread_pool * pool, model_import * import) {
+	import->start = wall_time();
+	import->count = count;
+	import->pool = pool;
+	import->assets = calloc(count, sizeof(asset));
+	for (size_t i = 0; i < count; i++) {
+		import->assets[i].filename = filenames[i];
+		init_arena(&import->assets[i].memory, 1 << 16);
+		run_task(pool, import_asset, &import->assets[i]);
+	}
+}
+
+bool finish_import(model_import * import, model * m) {
+	thread_pool * pool = import->pool;
+	size_t count = import->count;
+	asset * assets = import->assets;
+
+	memset(m, 0, sizeof(model));
+	init_arena(&m->memory, 0);
+	if (pool) { wait_thread_pool(pool); }
+
+	// merge identical materials in file order, and place the triangles of every asset
+	bool imported = true;
+	size_t job_count = 0;
+	for (size_t i = 0; i < count && imported; i++) {
+		asset * a = &assets[i];
+		if (!a->scene) {
+			imported = false;
+			break;
+		}
+
+		for (unsigned k = 0; k < a->scene->mNumMaterials; k++) {
+			a->remap[k] = add_material(m, a->materials[k]);
+		}
+		if (m->material_count > 0xFFFF) {
+			fprintf(stderr, "%s: too many materials (%zu)\n", a->filename, m->material_count);
+			imported = false;
 		}
 
-		// TODO - Fix this for more than 1 mesh.
-		aiReleaseImport(scene);
-		return data;
+		a->triangle_offset = m->triangle_count;
+		m->triangle_count += a->triangle_count;
+		for (unsigned k = 0; k < a->scene->mNumMeshes; k++) {
+			job_count += (a->scene->mMeshes[k]->mNumFaces + CONVERT_FACES - 1) / CONVERT_FACES;
+			m->mesh_count += triangle_mesh(a->scene->mMeshes[k]) && a->scene->mMeshes[k]->mNumFaces > 0;
+		}
+	}
+
+	// the table always has at least one entry
+	if (imported && m->material_count == 0) {
+		add_material(m, diffuse_material(vector4_init(0.6f, 0.6f, 0.6f, 1.0f)));
+	}
+
+	if (imported) {
+		// written in place, the host never holds a second copy to upload
+		init_host_buffer(&m->surface_buffer, sizeof(cl_float) * (m->triangle_count * TRIANGLE_SIZE), CL_MEM_READ_ONLY);
+		init_host_buffer(&m->material_id_buffer, sizeof(cl_ushort) * m->triangle_count, CL_MEM_READ_ONLY);
+		m->surfaces = map_host_buffer(&m->surface_buffer, CL_MAP_WRITE_INVALIDATE_REGION);
+		m->material_ids = map_host_buffer(&m->material_id_buffer, CL_MAP_WRITE_INVALIDATE_REGION);
+
+		// every job knows where its faces go, so they are converted in any order
+		convert_job * jobs = arena_alloc(&m->memory, sizeof(convert_job) * (job_count ? job_count : 1));
+		convert_job * job = jobs;
+		m->meshes = arena_alloc(&m->memory, sizeof(mesh_range) * (m->mesh_count ? m->mesh_count : 1));
+		mesh_range * range = m->meshes;
+		for (size_t i = 0; i < count; i++) {
+			const struct aiScene * scene = assets[i].scene;
+			size_t offset = assets[i].triangle_offset;
+
+			for (unsigned k = 0; k < scene->mNumMeshes; k++) {
+				const struct aiMesh * mesh = scene->mMeshes[k];
+				if (!triangle_mesh(mesh) || mesh->mNumFaces == 0) {
+					continue;
+				}
+				range->first = offset;
+				range->count = mesh->mNumFaces;
+				range++;
+
+				cl_ushort mat_id = mesh->mMaterialIndex < scene->mNumMaterials ?
+					assets[i].remap[mesh->mMaterialIndex] : 0;
+				for (unsigned first = 0; first < mesh->mNumFaces; first += CONVERT_FACES) {
+					job->mesh = mesh;
+					job->first = first;
+					job->count = mesh->mNumFaces - first < CONVERT_FACES ? mesh->mNumFaces - first : CONVERT_FACES;
+					job->material_id = mat_id;
+					job->surfaces = m->surfaces + (offset + first) * TRIANGLE_SIZE;
+					job->material_ids = m->material_ids + offset + first;
+					run_task(pool, convert_faces, job++);
+				}
+				offset += mesh->mNumFaces;
+			}
+		}
+		if (pool) { wait_thread_pool(pool); }
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (assets[i].scene) {
+			aiReleaseImport(assets[i].scene);
+		}
+		release_arena(&assets[i].memory);
+	}
+	free(assets);
+	import->assets = NULL;
+
+	if (!imported) {
+		release_model(m);
+		return false;
+	}
+
+	if (count > 1) {
+		printf("Imported %zu triangles from %zu files on %u threads in %f seconds.\n",
+		       m->triangle_count, count, pool ? pool->n_threads : 1, wall_time() - import->start);
+	}
+	return true;
+}
+
+void release_model(model * m) {
+	release_host_buffer(&m->surface_buffer);
+	release_host_buffer(&m->material_id_buffer);
+	release_arena(&m->memory);
+	memset(m, 0, sizeof(model));
+}
+
+/**
+ Builds our material representation from the properties of an
+ assimp material, missing properties keep their default value.
+ */
+static material convert_material(const struct aiMaterial * mat) {
+	material out = diffuse_material(vector4_init(0.6f, 0.6f, 0.6f, 1.0f));
+	struct aiColor4D color;
+	float value;
+
+	if (aiGetMaterialColor(mat, AI_MATKEY_COLOR_DIFFUSE, &color) == aiReturn_SUCCESS) {
+		out.diffuse = vector4_init(color.r, color.g, color.b, color.a);
+	}
+	if (aiGetMaterialColor(mat, AI_MATKEY_COLOR_SPECULAR, &color) == aiReturn_SUCCESS) {
+		out.spec_scalar = fmaxf(color.r, fmaxf(color.g, color.b));
+	}
+	if (aiGetMaterialFloatArray(mat, AI_MATKEY_SHININESS_STRENGTH, &value, NULL) == aiReturn_SUCCESS) {
+		out.spec_scalar *= value;
+	}
+	if (aiGetMaterialFloatArray(mat, AI_MATKEY_SHININESS, &value, NULL) == aiReturn_SUCCESS) {
+		out.spec_power = value;
+	}
+	if (aiGetMaterialFloatArray(mat, AI_MATKEY_REFLECTIVITY, &value, NULL) == aiReturn_SUCCESS) {
+		out.reflect = value;
+	}
+	if (aiGetMaterialFloatArray(mat, AI_MATKEY_OPACITY, &value, NULL) == aiReturn_SUCCESS) {
+		out.refract = 1.0f - value;
+	}
+	if (aiGetMaterialFloatArray(mat, AI_MATKEY_REFRACTI, &value, NULL) == aiReturn_SUCCESS && value > 0.0f) {
+		out.ior = value;
+	}
+
+	return out;
+}
+
+cl_ushort add_material(model * m, material mat) {
+	for (size_t i = 0; i < m->material_count; i++) {
+		if (!memcmp(&m->materials[i], &mat, sizeof(material))) {
+			return (cl_ushort)i;
+		}
+	}
+
+	if (m->material_count == m->material_capacity) {
+		// the old table stays behind in the arena, tables are small
+		m->material_capacity = m->material_capacity ? 2 * m->material_capacity : 16;
+		material * table = arena_alloc(&m->memory, sizeof(material) * m->material_capacity);
+		if (m->material_count) {
+			memcpy(table, m->materials, sizeof(material) * m->material_count);
+		}
+		m->materials = table;
 	}
 
-	aiReleaseImport(scene);
-	return NULL;
+	m->materials[m->material_count] = mat;
+	return (cl_ushort)m->material_count++;
 }
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "nbody.h"
+#include "vector.h"
+#include "lbvh.h"
+
+static cl_kernel nbody_kernel;
+static cl_kernel tree_kernel;
+static int solver = NBODY_DIRECT;
+static float opening_angle;
+static lbvh tree;
+static bool tree_created = false;
+static cl_mem positions[2];
+static cl_mem velocities;
+
+// positions[current] holds the result of the last enqueued step
+static unsigned current = 0;
+static size_t body_count;
+static size_t padded_count;
+static size_t local_size;
+
+// softening added to the squared distance, keeps close encounters finite
+static const float softening = 1e-4f;
+
+// upper bound for the work group size, also the size of the local cache
+static const size_t max_local_size = 256;
+
+void init_nbody(size_t n) {
+    int err = CL_SUCCESS;
+    nbody_kernel = create_kernel("nbody");
+
+    // largest power of two work group the kernel and device allow
+    size_t max_group = 0;
+    err = clGetKernelWorkGroupInfo(nbody_kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE,
+                                   sizeof(size_t), &max_group, NULL);
+    cl_check_err(err, "clGetKernelWorkGroupInfo(...)");
+    for (local_size = 1; local_size * 2 <= max_group &&
+            local_size * 2 <= max_local_size; local_size *= 2) { }
+
+    body_count = n;
+    padded_count = (n + local_size - 1) / local_size * local_size;
+
+    // bodies on a thin disk with roughly circular orbits, padding stays at the origin
+    vector4 * pos = (vector4 *)calloc(padded_count, sizeof(vector4));
+    vector4 * vel = (vector4 *)calloc(padded_count, sizeof(vector4));
+    for (size_t i = 0; i < n; i++) {
+        float r = sqrtf(rand() / (float)RAND_MAX) + 0.01f;
+        float theta = 2.0f * M_PI * (rand() / (float)RAND_MAX);
+        float z = 0.02f * (rand() / (float)RAND_MAX - 0.5f);
+        float speed = sqrtf(r);
+
+        pos[i] = vector4_init(r * cosf(theta), r * sinf(theta), z, 1.0f / n);
+        vel[i] = vector3_init(-speed * sinf(theta), speed * cosf(theta), 0.0f);
+    }
+
+    for (unsigned i = 0; i < 2; i++) {
+        positions[i] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                      sizeof(vector4) * padded_count, NULL, &err);
+        cl_check_err(err, "clCreateBuffer(...)");
+    }
+    velocities = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                sizeof(vector4) * padded_count, NULL, &err);
+    cl_check_err(err, "clCreateBuffer(...)");
+
+    err = clEnqueueWriteBuffer(command_queue, positions[0], CL_TRUE, 0,
+                               sizeof(vector4) * padded_count, pos, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueWriteBuffer(...)");
+    err = clEnqueueWriteBuffer(command_queue, velocities, CL_TRUE, 0,
+                               sizeof(vector4) * padded_count, vel, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueWriteBuffer(...)");
+    current = 0;
+
+    free(pos);
+    free(vel);
+
+    err  = clSetKernelArg(nbody_kernel, 1, sizeof(float), &softening);
+    err |= clSetKernelArg(nbody_kernel, 4, sizeof(cl_mem), &velocities);
+    err |= clSetKernelArg(nbody_kernel, 5, sizeof(vector4) * local_size, NULL);
+    cl_check_err(err, "clSetKernelArg(...)");
+}
+
+void set_nbody_solver(int s, float theta) {
+    solver = s;
+    opening_angle = theta;
+
+    if (solver == NBODY_TREE && !tree_created) {
+        int err = CL_SUCCESS;
+        tree_kernel = create_kernel("nbody_tree");
+        init_lbvh(&tree, padded_count, true);
+        tree_created = true;
+
+        err  = clSetKernelArg(tree_kernel, 1, sizeof(float), &softening);
+        err |= clSetKernelArg(tree_kernel, 5, sizeof(cl_mem), &velocities);
+        err |= clSetKernelArg(tree_kernel, 6, sizeof(cl_mem), &tree.nodes);
+        err |= clSetKernelArg(tree_kernel, 7, sizeof(cl_mem), &tree.node_mass);
+        cl_check_err(err, "clSetKernelArg(...)");
+    }
+}
+
+/**
+ Enqueues one Barnes-Hut step, the tree is rebuilt over the
+ current positions on the device before the force pass.
+ */
+static void step_tree(float delta) {
+    int err = CL_SUCCESS;
+
+    // positions double as {center of mass, mass} of the leaves
+    point_bounds_lbvh(&tree, positions[current], 0.0f);
+    build_lbvh(&tree, positions[current]);
+
+    err  = clSetKernelArg(tree_kernel, 0, sizeof(float), &delta);
+    err |= clSetKernelArg(tree_kernel, 2, sizeof(float), &opening_angle);
+    err |= clSetKernelArg(tree_kernel, 3, sizeof(cl_mem), &positions[current]);
+    err |= clSetKernelArg(tree_kernel, 4, sizeof(cl_mem), &positions[1 - current]);
+    cl_check_err(err, "clSetKernelArg(...)");
+
+    err = clEnqueueNDRangeKernel(command_queue, tree_kernel, 1, NULL,
+                                 &padded_count, NULL, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueNDRangeKernel(...)");
+    current = 1 - current;
+}
+
+void step_nbody(unsigned steps, float delta) {
+    int err = CL_SUCCESS;
+    if (solver == NBODY_TREE) {
+        for (unsigned i = 0; i < steps; i++) {
+            step_tree(delta);
+        }
+        return;
+    }
+
+    err = clSetKernelArg(nbody_kernel, 0, sizeof(float), &delta);
+    cl_check_err(err, "clSetKernelArg(...)");
+
+    // arguments are captured at enqueue time, so each step may swap them
+    for (unsigned i = 0; i < steps; i++) {
+        err  = clSetKernelArg(nbody_kernel, 2, sizeof(cl_mem), &positions[current]);
+        err |= clSetKernelArg(nbody_kernel, 3, sizeof(cl_mem), &positions[1 - current]);
+        cl_check_err(err, "clSetKernelArg(...)");
+
+        err = clEnqueueNDRangeKernel(command_queue, nbody_kernel, 1, NULL,
+                                     &padded_count, &local_size, 0, NULL, NULL);
+        cl_check_err(err, "clEnqueueNDRangeKernel(...)");
+        current = 1 - current;
+    }
+}
+
+cl_mem nbody_positions() {
+    return positions[current];
+}
+
+size_t nbody_count() {
+    return body_count;
+}
+
+void benchmark_nbody(unsigned steps, float delta) {
+    // the first launch pays for any lazy device setup, keep it out of the timing
+    step_nbody(1, delta);
+    clFinish(command_queue);
+
+    double start = wall_time();
+    step_nbody(steps, delta);
+    clFinish(command_queue);
+    double elapsed = wall_time() - start;
+
+    printf("%s solver: %zu bodies (%zu padded), %u steps in %.3f seconds\n",
+           solver == NBODY_TREE ? "tree" : "direct",
+           body_count, padded_count, steps, elapsed);
+
+    // the tree solver evaluates fewer pairs, report the all-pairs equivalent
+    double interactions = (double)padded_count * padded_count * steps;
+    printf("%.3f billion %sinteractions per second\n", interactions / elapsed * 1e-9,
+           solver == NBODY_TREE ? "all-pairs equivalent " : "");
+}
+
+/**
+ Copies 'size' bytes between two device buffers.
+ */
+static void copy_buffer(cl_mem src, cl_mem dst, size_t size) {
+    int err = clEnqueueCopyBuffer(command_queue, src, dst, 0, 0, size, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueCopyBuffer(...)");
+}
+
+/**
+ Runs a single step from the saved state and reads back the new positions,
+ the saved state is restored afterwards.
+ */
+static void single_step(cl_mem saved_pos, cl_mem saved_vel, float delta, vector4 * result) {
+    size_t size = sizeof(vector4) * padded_count;
+
+    step_nbody(1, delta);
+    int err = clEnqueueReadBuffer(command_queue, positions[current], CL_TRUE, 0,
+                                  size, result, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueReadBuffer(...)");
+
+    current = 0;
+    copy_buffer(saved_pos, positions[0], size);
+    copy_buffer(saved_vel, velocities, size);
+}
+
+void compare_nbody(unsigned steps, float delta, float theta) {
+    int err = CL_SUCCESS;
+    size_t size = sizeof(vector4) * padded_count;
+
+    cl_mem saved_pos = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+    cl_check_err(err, "clCreateBuffer(...)");
+    cl_mem saved_vel = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+    cl_check_err(err, "clCreateBuffer(...)");
+    copy_buffer(positions[current], saved_pos, size);
+    copy_buffer(velocities, saved_vel, size);
+
+    vector4 * start = (vector4 *)malloc(size);
+    vector4 * direct = (vector4 *)malloc(size);
+    vector4 * approx = (vector4 *)malloc(size);
+    err = clEnqueueReadBuffer(command_queue, saved_pos, CL_TRUE, 0, size, start, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueReadBuffer(...)");
+
+    set_nbody_solver(NBODY_DIRECT, theta);
+    single_step(saved_pos, saved_vel, delta, direct);
+    set_nbody_solver(NBODY_TREE, theta);
+    single_step(saved_pos, saved_vel, delta, approx);
+
+    // error of the tree step relative to the distance moved by the direct step
+    double error = 0.0, moved = 0.0;
+    for (size_t i = 0; i < body_count; i++) {
+        double ex = approx[i].x - direct[i].x, mx = direct[i].x - start[i].x;
+        double ey = approx[i].y - direct[i].y, my = direct[i].y - start[i].y;
+        double ez = approx[i].z - direct[i].z, mz = direct[i].z - start[i].z;
+        error += ex * ex + ey * ey + ez * ez;
+        moved += mx * mx + my * my + mz * mz;
+    }
+    printf("tree solver (theta %.2f) relative displacement error: %.3e\n",
+           theta, moved > 0.0 ? sqrt(error / moved) : 0.0);
+
+    free(start);
+    free(direct);
+    free(approx);
+    clReleaseMemObject(saved_pos);
+    clReleaseMemObject(saved_vel);
+
+    set_nbody_solver(NBODY_DIRECT, theta);
+    benchmark_nbody(steps, delta);
+    set_nbody_solver(NBODY_TREE, theta);
+    benchmark_nbody(steps, delta);
+}
+
+void release_nbody() {
+    clReleaseMemObject(positions[0]);
+    clReleaseMemObject(positions[1]);
+    clReleaseMemObject(velocities);
+    clReleaseKernel(nbody_kernel);
+    if (tree_created) {
+        release_lbvh(&tree);
+        clReleaseKernel(tree_kernel);
+        tree_created = false;
+    }
+}
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "options.h"
+#include "gl_util.h"
+#include "nbody.h"
+#include "batch.h"
+#include "file_io.h"
+
+// imported when no --model or --models is given
+#define DEFAULT_MODEL "../models/box.obj"
+
+app_options options = {
+    NULL,                   // model_files
+    0,                      // model_count
+    NULL,                   // light_file
+#ifdef __REAL_TIME__
+    1,                      // light_samples
+#else
+    32,                     // light_samples
+#endif
+    8,                      // max_depth
+    false,                  // compressed_geometry
+    false,                  // use_bvh
+    false,                  // sah_bvh
+    false,                  // spatial_splits
+    0,                      // threads
+    false,                  // lod
+    false,                  // reorder_rays
+    false,                  // irradiance_cache
+    false,                  // tile_culling
+    false,                  // persistent_threads
+    false,                  // retune
+    64,                     // progressive_frames
+    1.0f,                   // exposure
+    0.1f,                   // edge_threshold
+    NULL,                   // batch_file
+    0,                      // batch_frames
+    "frame",                // output_prefix
+    FRAME_PPM,              // output_format
+    NULL,                   // listen_address
+    1,                      // workers
+    NULL,                   // worker_address
+    0,                      // nbody_count
+    100,                    // nbody_steps
+    1e-3f,                  // nbody_timestep
+    NBODY_DIRECT,           // nbody_solver
+    false,                  // nbody_compare
+    0.5f,                   // nbody_theta
+    false,                  // nbody_show
+    0.0f                    // body_radius
+};
+
+static void usage(const char * program) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --model <file>           model to render, may be repeated (default %s)\n"
+        "  --models <file>          list of models to render, one file per line\n"
+        "  --lights <file>          light list, see load_lights(...)\n"
+        "  --light-samples <n>      lights sampled per shading point\n"
+        "  --max-depth <n>          bounces of a path at most (default 8)\n"
+        "  --compressed             store triangles quantized to 16 bits\n"
+        "  --bvh                    trace triangles through a BVH built on the device\n"
+        "  --sah-bvh                build the BVH on the host with the surface area heuristic\n"
+        "  --spatial-splits         let --sah-bvh split long triangles between nodes\n"
+        "  --threads <n>            worker threads for host side builds (default all cores)\n"
+        "  --lod                    trace simplified meshes when they are small on screen\n"
+        "  --reorder-rays           sort reflection rays by direction before tracing them\n"
+        "  --irradiance-cache       light diffuse surfaces by cached indirect light\n"
+        "  --tile-culling           cull surfaces against each tile's frustum first\n"
+        "  --persistent             balance tiles over resident work groups\n"
+        "  --retune                 time work group sizes again, ignoring the cache\n"
+        "  --progressive <n>        frames averaged while the view is still (default 64)\n"
+        "  --exposure <f>           scale of the rendered radiance before tone mapping (default 1)\n"
+        "  --samples <n>            samples per pixel along each axis\n"
+        "  --adaptive-aa            only supersample pixels on edges\n"
+        "  --edge-threshold <f>     discontinuity threshold for --adaptive-aa\n"
+        "  --batch <file>           render the keyframes of a file without a window\n"
+        "  --frames <n>             frames spread over the keyframes by --batch\n"
+        "  --output <prefix>        path prefix of the frames written by --batch\n"
+        "  --format <f>             ppm or pfm frames for --batch\n"
+        "  --listen <address>       render --batch on workers connecting to [host:]port or a socket path\n"
+        "  --workers <n>            workers --listen waits for (default 1)\n"
+        "  --worker <address>       render tiles for the --listen coordinator at address\n"
+        "  --nbody <n>              benchmark an n-body simulation without a window\n"
+        "  --steps <n>              timesteps simulated by --nbody\n"
+        "  --timestep <f>           length of a timestep for --nbody\n"
+        "  --solver <s>             direct, tree or compare for --nbody\n"
+        "  --theta <f>              opening angle of the tree solver\n"
+        "  --show                   render the --nbody simulation as spheres\n"
+        "  --body-radius <f>        sphere radius used by --show\n",
+        program, DEFAULT_MODEL);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ Appends 'filename' to the models imported into the scene.
+ */
+static void add_model(const char * filename) {
+    static size_t capacity = 0;
+    if (options.model_count == capacity) {
+        capacity = capacity ? 2 * capacity : 8;
+        options.model_files = (const char **)realloc(options.model_files, sizeof(char *) * capacity);
+    }
+    options.model_files[options.model_count++] = filename;
+}
+
+/**
+ Adds every line of a list file as a model, skipping empty lines
+ and lines starting with '#'. The file stays loaded for the names.
+ */
+static void add_model_list(const char * filename) {
+    char * list = read_file(filename);
+    for (char * line = strtok(list, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+        if (line[0] != '#') {
+            add_model(line);
+        }
+    }
+}
+
+void parse_options(int argc, const char ** argv) {
+    for (int i = 1; i < argc; i++) {
+        const char * arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (!strcmp(arg, "--model") && has_value) {
+            add_model(argv[++i]);
+        } else if (!strcmp(arg, "--models") && has_value) {
+            add_model_list(argv[++i]);
+        } else if (!strcmp(arg, "--lights") && has_value) {
+            options.light_file = argv[++i];
+        } else if (!strcmp(arg, "--light-samples") && has_value) {
+            options.light_samples = (unsigned)atoi(argv[++i]);
+        } else if (!strcmp(arg, "--max-depth") && has_value) {
+            options.max_depth = (unsigned)atoi(argv[++i]);
+        } else if (!strcmp(arg, "--compressed")) {
+            options.compressed_geometry = true;
+        } else if (!strcmp(arg, "--bvh")) {
+            options.use_bvh = true;
+        } else if (!strcmp(arg, "--sah-bvh")) {
+            options.use_bvh = options.sah_bvh = true;
+        } else if (!strcmp(arg, "--spatial-splits")) {
+            options.use_bvh = options.sah_bvh = options.spatial_splits = true;
+        } else if (!strcmp(arg, "--threads") && has_value) {
+            options.threads = (unsigned)atoi(argv[++i]);
+        } else if (!strcmp(arg, "--lod")) {
+            options.lod = true;
+        } else if (!strcmp(arg, "--reorder-rays")) {
+            options.reorder_rays = true;
+        } else if (!strcmp(arg, "--irradiance-cache")) {
+            options.irradiance_cache = true;
+        } else if (!strcmp(arg, "--tile-culling")) {
+            options.tile_culling = true;
+        } else if (!strcmp(arg, "--persistent")) {
+            options.persistent_threads = true;
+        } else if (!strcmp(arg, "--retune")) {
+            options.retune = true;
+        } else if (!strcmp(arg, "--progressive") && has_value) {
+            options.progressive_frames = (unsigned)atoi(argv[++i]);
+        } else if (!strcmp(arg, "--exposure") && has_value) {
+            options.exposure = (float)atof(argv[++i]);
+        } else if (!strcmp(arg, "--samples") && has_value) {
+            sample_rate = (unsigned)atoi(argv[++i]);
+        } else if (!strcmp(arg, "--adaptive-aa")) {
+            adaptive_aa = true;
+        } else if (!strcmp(arg, "--edge-threshold") && has_value) {
+            options.edge_threshold = (float)atof(argv[++i]);
+        } else if (!strcmp(arg, "--batch") && has_value) {
+            options.batch_file = argv[++i];
+        } else if (!strcmp(arg, "--frames") && has_value) {
+            options.batch_frames = (unsigned)atoi(argv[++i]);
+        } else if (!strcmp(arg, "--output") && has_value) {
+            options.output_prefix = argv[++i];
+        } else if (!strcmp(arg, "--format") && has_value) {
+            const char * format = argv[++i];
+            if (!strcmp(format, "ppm")) {
+                options.output_format = FRAME_PPM;
+            } else if (!strcmp(format, "pfm")) {
+                options.output_format = FRAME_PFM;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (!strcmp(arg, "--listen") && has_value) {
+            options.listen_address = argv[++i];
+        } else if (!strcmp(arg, "--workers") && has_value) {
+            options.workers = (unsigned)atoi(argv[++i]);
+        } else if (!strcmp(arg, "--worker") && has_value) {
+            options.worker_address = argv[++i];
+        } else if (!strcmp(arg, "--nbody") && has_value) {
+            options.nbody_count = (size_t)atol(argv[++i]);
+        } else if (!strcmp(arg, "--steps") && has_value) {
+            options.nbody_steps = (unsigned)atoi(argv[++i]);
+        } else if (!strcmp(arg, "--timestep") && has_value) {
+            options.nbody_timestep = (float)atof(argv[++i]);
+        } else if (!strcmp(arg, "--solver") && has_value) {
+            const char * solver = argv[++i];
+            if (!strcmp(solver, "direct")) {
+                options.nbody_solver = NBODY_DIRECT;
+            } else if (!strcmp(solver, "tree")) {
+                options.nbody_solver = NBODY_TREE;
+            } else if (!strcmp(solver, "compare")) {
+                options.nbody_compare = true;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (!strcmp(arg, "--theta") && has_value) {
+            options.nbody_theta = (float)atof(argv[++i]);
+        } else if (!strcmp(arg, "--show")) {
+            options.nbody_show = true;
+        } else if (!strcmp(arg, "--body-radius") && has_value) {
+            options.body_radius = (float)atof(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    // the geometry modes are exclusive, tile culling works on the local memory copy,
+    // levels of detail are swapped in on the device where the BVH is rebuilt
+    if (sample_rate == 0 || options.light_samples == 0 || options.max_depth == 0 ||
+            (options.compressed_geometry && options.use_bvh) ||
+            (options.lod && (options.compressed_geometry || options.sah_bvh)) ||
+            (options.tile_culling && (options.compressed_geometry || options.use_bvh))) {
+        usage(argv[0]);
+    }
+
+    // --show renders the bodies of --nbody, there must be some
+    if (options.nbody_show && options.nbody_count == 0) {
+        usage(argv[0]);
+    }
+
+    // tiles come back as 8 bit pixels, and a simulation can not be stepped per tile
+    if (options.listen_address && (!options.batch_file || options.workers == 0 ||
+            options.output_format == FRAME_PFM || options.nbody_show)) {
+        usage(argv[0]);
+    }
+    if (options.worker_address && (options.output_format == FRAME_PFM || options.nbody_show)) {
+        usage(argv[0]);
+    }
+
+    // a worker's models are those of the coordinator's command line
+    if (options.model_count == 0 && !options.worker_address) {
+        add_model(DEFAULT_MODEL);
+    }
+
+    // adaptive anti-aliasing defaults to 4x supersampling on edges
+    if (adaptive_aa && sample_rate == 1) {
+        sample_rate = 2;
+    }
+}
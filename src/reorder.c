@@ -0,0 +1,76 @@
+#include <math.h>
+
+#include "reorder.h"
+#include "kernel_args.h"
+#include "lbvh.h"
+
+cl_kernel bounce_kernel;
+
+static radix_sort sort;
+static cl_mem bounces;
+static size_t n_pixels;
+
+// work group size used for the 1D bounce pass
+static const size_t bounce_local = 64;
+
+/**
+ Sets the reordering arguments of the ray_tracer kernel.
+ */
+static void set_reorder_args(cl_mem * rays, cl_mem * keys, cl_mem * pixels,
+                             vector4 lo, vector4 scale) {
+    int err = CL_SUCCESS;
+    err  = clSetKernelArg(kernel, ARG_KERNEL_SPECIFIC + 1, sizeof(cl_mem), rays);
+    err |= clSetKernelArg(kernel, ARG_KERNEL_SPECIFIC + 2, sizeof(cl_mem), keys);
+    err |= clSetKernelArg(kernel, ARG_KERNEL_SPECIFIC + 3, sizeof(cl_mem), pixels);
+    err |= clSetKernelArg(kernel, ARG_KERNEL_SPECIFIC + 4, sizeof(vector4), &lo);
+    err |= clSetKernelArg(kernel, ARG_KERNEL_SPECIFIC + 5, sizeof(vector4), &scale);
+    cl_check_err(err, "clSetKernelArg(...)");
+}
+
+void init_reorder(unsigned w, unsigned h, vector4 lo, vector4 hi) {
+    int err = CL_SUCCESS;
+
+    bounce_kernel = create_kernel("trace_bounces");
+    n_pixels = (size_t)w * h;
+    init_radix_sort(&sort, n_pixels);
+
+    bounces = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                             sizeof(bounce_ray) * n_pixels, NULL, &err);
+    cl_check_err(err, "clCreateBuffer(...)");
+
+    // ray origins are quantized over the scene bounds
+    vector4 scale = vector3_init(1.0f / fmaxf(hi.x - lo.x, 1e-6f),
+                                 1.0f / fmaxf(hi.y - lo.y, 1e-6f),
+                                 1.0f / fmaxf(hi.z - lo.z, 1e-6f));
+    set_reorder_args(&bounces, &sort.keys[0], &sort.values[0], lo, scale);
+
+    cl_int n = (cl_int)n_pixels;
+    err  = clSetKernelArg(bounce_kernel, ARG_KERNEL_SPECIFIC, sizeof(cl_mem), &sort.keys[0]);
+    err |= clSetKernelArg(bounce_kernel, ARG_KERNEL_SPECIFIC + 1, sizeof(cl_mem), &sort.values[0]);
+    err |= clSetKernelArg(bounce_kernel, ARG_KERNEL_SPECIFIC + 2, sizeof(cl_mem), &bounces);
+    err |= clSetKernelArg(bounce_kernel, ARG_KERNEL_SPECIFIC + 3, sizeof(cl_int), &n);
+    cl_check_err(err, "clSetKernelArg(...)");
+}
+
+void disable_reorder() {
+    set_reorder_args(NULL, NULL, NULL, zero_vector4(), zero_vector4());
+}
+
+void render_reorder() {
+    // every pixel writes a key, so the whole batch is sorted without
+    // reading back how many reflections there are
+    sort_radix(&sort, n_pixels, RAY_KEY_BITS);
+
+    const size_t global[] = {
+        (n_pixels + bounce_local - 1) / bounce_local * bounce_local
+    };
+    int err = clEnqueueNDRangeKernel(command_queue, bounce_kernel, 1,
+                                     NULL, global, &bounce_local, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueNDRangeKernel(...)");
+}
+
+void release_reorder() {
+    release_radix_sort(&sort);
+    clReleaseMemObject(bounces);
+    clReleaseKernel(bounce_kernel);
+}
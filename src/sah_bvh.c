@@ -0,0 +1,519 @@
+#include <float.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sah_bvh.h"
+#include "surface.h"
+
+// bins used to evaluate object and spatial splits along each axis,
+// nodes with fewer references use one bin per reference
+#define SAH_BINS 32
+
+// subtrees with at least this many references are built as separate tasks
+#define TASK_THRESHOLD 4096
+
+// spatial splits are only tried when the children of the best object
+// split overlap by more than this fraction of the root surface area
+#define SPATIAL_OVERLAP 1e-5f
+
+// extra references spatial splits may create, relative to the triangle count
+#define SPATIAL_BUDGET 0.3f
+
+typedef struct {
+    float lo[3];
+    float hi[3];
+} aabb;
+
+// a triangle, or the part of it left after spatial splits
+typedef struct {
+    aabb box;
+    int prim;
+} sah_ref;
+
+typedef struct {
+    aabb box;
+    int left;   // children in the node pool, -1 for leaves
+    int right;
+    int prim;
+} sah_node;
+
+typedef struct {
+    const cl_float * surfaces;
+    bool spatial_splits;
+    float root_area;
+    thread_pool * pool;
+
+    sah_node * nodes;
+    atomic_int node_count;
+    atomic_int ref_budget;
+
+    // reference arrays created by spatial splits, freed once the build is done
+    pthread_mutex_t lock;
+    sah_ref ** allocations;
+    size_t n_allocations;
+    size_t max_allocations;
+} sah_builder;
+
+typedef struct {
+    sah_builder * builder;
+    int node;
+    sah_ref * refs;
+    int count;
+    aabb box;
+} build_task;
+
+typedef struct {
+    float cost;
+    int axis;
+    int bins;       // bins the split was evaluated with
+    int bin;        // children are split after this bin
+    bool spatial;
+    aabb left;
+    aabb right;
+    int n_left;
+    int n_right;
+} sah_split;
+
+static aabb empty_aabb() {
+    return (aabb){ { FLT_MAX, FLT_MAX, FLT_MAX }, { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+}
+
+static void grow_point(aabb * box, const float * p) {
+    for (int a = 0; a < 3; a++) {
+        if (p[a] < box->lo[a]) { box->lo[a] = p[a]; }
+        if (p[a] > box->hi[a]) { box->hi[a] = p[a]; }
+    }
+}
+
+static bool is_empty(const aabb * box);
+
+static void grow_aabb(aabb * box, const aabb * other) {
+    if (is_empty(other)) { return; }
+    grow_point(box, other->lo);
+    grow_point(box, other->hi);
+}
+
+static bool is_empty(const aabb * box) {
+    return box->lo[0] > box->hi[0] || box->lo[1] > box->hi[1] || box->lo[2] > box->hi[2];
+}
+
+static float half_area(const aabb * box) {
+    if (is_empty(box)) { return 0.0f; }
+
+    float dx = box->hi[0] - box->lo[0];
+    float dy = box->hi[1] - box->lo[1];
+    float dz = box->hi[2] - box->lo[2];
+    return dx * dy + dy * dz + dz * dx;
+}
+
+static aabb intersect_aabb(const aabb * a, const aabb * b) {
+    aabb box;
+    for (int i = 0; i < 3; i++) {
+        box.lo[i] = a->lo[i] > b->lo[i] ? a->lo[i] : b->lo[i];
+        box.hi[i] = a->hi[i] < b->hi[i] ? a->hi[i] : b->hi[i];
+    }
+    return box;
+}
+
+static const float * triangle_vertex(const sah_builder * b, int prim, int v) {
+    return b->surfaces + (size_t)prim * TRIANGLE_SIZE + 1 + 4 * v;
+}
+
+/**
+ Bounds of the part of triangle 'prim' between the planes
+ s0 and s1 along 'axis', limited to the reference bounds.
+ */
+static aabb clip_reference(const sah_builder * b, const sah_ref * ref,
+                           int axis, float s0, float s1) {
+    aabb box = empty_aabb();
+    const float planes[2] = { s0, s1 };
+
+    for (int e = 0; e < 3; e++) {
+        const float * p = triangle_vertex(b, ref->prim, e);
+        const float * q = triangle_vertex(b, ref->prim, (e + 1) % 3);
+
+        if (p[axis] >= s0 && p[axis] <= s1) {
+            grow_point(&box, p);
+        }
+
+        // edges crossing either plane
+        for (int k = 0; k < 2; k++) {
+            if ((p[axis] < planes[k]) != (q[axis] < planes[k])) {
+                float t = (planes[k] - p[axis]) / (q[axis] - p[axis]);
+                float x[3];
+                for (int a = 0; a < 3; a++) { x[a] = p[a] + t * (q[a] - p[a]); }
+                x[axis] = planes[k];
+                grow_point(&box, x);
+            }
+        }
+    }
+
+    aabb clipped = intersect_aabb(&box, &ref->box);
+    if (is_empty(&clipped)) {
+        // rounding, fall back to clipping the reference bounds
+        clipped = ref->box;
+        if (clipped.lo[axis] < s0) { clipped.lo[axis] = s0; }
+        if (clipped.hi[axis] > s1) { clipped.hi[axis] = s1; }
+    }
+
+    return clipped;
+}
+
+/**
+ Sweeps the bins from both sides and stores the cheapest
+ split that leaves references on either side in 'best'.
+ */
+static void sweep_bins(const aabb * bin_box, const int * n_enter, const int * n_exit,
+                       int bins, int axis, bool spatial, sah_split * best) {
+    aabb right_box[SAH_BINS];
+    int right_count[SAH_BINS];
+
+    aabb box = empty_aabb();
+    int count = 0;
+    for (int i = bins - 1; i > 0; i--) {
+        grow_aabb(&box, &bin_box[i]);
+        count += n_exit[i];
+        right_box[i] = box;
+        right_count[i] = count;
+    }
+
+    box = empty_aabb();
+    count = 0;
+    for (int i = 0; i < bins - 1; i++) {
+        grow_aabb(&box, &bin_box[i]);
+        count += n_enter[i];
+
+        if (count == 0 || right_count[i + 1] == 0) {
+            continue;
+        }
+
+        float cost = half_area(&box) * count + half_area(&right_box[i + 1]) * right_count[i + 1];
+        if (cost < best->cost) {
+            *best = (sah_split){ cost, axis, bins, i, spatial,
+                                 box, right_box[i + 1], count, right_count[i + 1] };
+        }
+    }
+}
+
+static int position_bin(float x, float lo, float scale, int bins) {
+    int bin = (int)((x - lo) * scale);
+    return bin < 0 ? 0 : bin >= bins ? bins - 1 : bin;
+}
+
+static int centroid_bin(const sah_ref * ref, int axis, float lo, float scale, int bins) {
+    return position_bin(0.5f * (ref->box.lo[axis] + ref->box.hi[axis]), lo, scale, bins);
+}
+
+static void object_split(const sah_ref * refs, int count, const aabb * centroids, sah_split * best) {
+    int bins = count < SAH_BINS ? count : SAH_BINS;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroids->hi[axis] - centroids->lo[axis];
+        if (extent <= 0.0f) {
+            continue;
+        }
+
+        aabb bin_box[SAH_BINS];
+        int bin_count[SAH_BINS] = { 0 };
+        for (int i = 0; i < bins; i++) { bin_box[i] = empty_aabb(); }
+
+        float scale = bins / extent;
+        for (int r = 0; r < count; r++) {
+            int bin = centroid_bin(&refs[r], axis, centroids->lo[axis], scale, bins);
+            grow_aabb(&bin_box[bin], &refs[r].box);
+            bin_count[bin]++;
+        }
+
+        sweep_bins(bin_box, bin_count, bin_count, bins, axis, false, best);
+    }
+}
+
+static void spatial_split(const sah_builder * b, const sah_ref * refs, int count,
+                          const aabb * box, sah_split * best) {
+    int bins = count < SAH_BINS ? count : SAH_BINS;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = box->hi[axis] - box->lo[axis];
+        if (extent <= 0.0f) {
+            continue;
+        }
+
+        aabb bin_box[SAH_BINS];
+        int n_enter[SAH_BINS] = { 0 };
+        int n_exit[SAH_BINS] = { 0 };
+        for (int i = 0; i < bins; i++) { bin_box[i] = empty_aabb(); }
+
+        float scale = bins / extent;
+        float width = extent / bins;
+        for (int r = 0; r < count; r++) {
+            int first = position_bin(refs[r].box.lo[axis], box->lo[axis], scale, bins);
+            int last = position_bin(refs[r].box.hi[axis], box->lo[axis], scale, bins);
+            n_enter[first]++;
+            n_exit[last]++;
+
+            for (int bin = first; bin <= last; bin++) {
+                if (first == last) {
+                    grow_aabb(&bin_box[bin], &refs[r].box);
+                } else {
+                    float s0 = box->lo[axis] + bin * width;
+                    aabb part = clip_reference(b, &refs[r], axis, s0, s0 + width);
+                    grow_aabb(&bin_box[bin], &part);
+                }
+            }
+        }
+
+        sweep_bins(bin_box, n_enter, n_exit, bins, axis, true, best);
+    }
+}
+
+static void record_allocation(sah_builder * b, sah_ref * refs) {
+    pthread_mutex_lock(&b->lock);
+    if (b->n_allocations == b->max_allocations) {
+        b->max_allocations = b->max_allocations ? 2 * b->max_allocations : 64;
+        b->allocations = (sah_ref **)realloc(b->allocations,
+                                             sizeof(sah_ref *) * b->max_allocations);
+    }
+    b->allocations[b->n_allocations++] = refs;
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void build_subtree(sah_builder * b, int node, sah_ref * refs, int count, aabb box);
+
+static void build_subtree_task(void * arg) {
+    build_task * t = (build_task *)arg;
+    build_subtree(t->builder, t->node, t->refs, t->count, t->box);
+    free(t);
+}
+
+/**
+ Builds the subtree rooted at nodes[node] over refs[0, count).
+ The larger child is built in a loop, the smaller one recursively
+ or as a task when it is large enough, so the stack depth stays
+ logarithmic.
+ */
+static void build_subtree(sah_builder * b, int node, sah_ref * refs, int count, aabb box) {
+    while (true) {
+        sah_node * n = &b->nodes[node];
+        n->box = box;
+
+        if (count == 1) {
+            n->left = n->right = -1;
+            n->prim = refs[0].prim;
+            return;
+        }
+
+        aabb centroids = empty_aabb();
+        for (int r = 0; r < count; r++) {
+            float c[3];
+            for (int a = 0; a < 3; a++) { c[a] = 0.5f * (refs[r].box.lo[a] + refs[r].box.hi[a]); }
+            grow_point(&centroids, c);
+        }
+
+        sah_split split = { FLT_MAX, -1 };
+        object_split(refs, count, &centroids, &split);
+
+        if (b->spatial_splits && atomic_load(&b->ref_budget) > 0) {
+            aabb overlap = intersect_aabb(&split.left, &split.right);
+            if (split.axis < 0 || half_area(&overlap) > SPATIAL_OVERLAP * b->root_area) {
+                spatial_split(b, refs, count, &box, &split);
+            }
+        }
+
+        sah_ref * left_refs = refs;
+        sah_ref * right_refs;
+        int n_left, n_right;
+        aabb left_box, right_box;
+
+        if (split.axis >= 0 && split.spatial &&
+                atomic_fetch_sub(&b->ref_budget, split.n_left + split.n_right - count) >=
+                split.n_left + split.n_right - count) {
+            // references straddling the plane are clipped into both children
+            int axis = split.axis;
+            float extent = box.hi[axis] - box.lo[axis];
+            float scale = split.bins / extent;
+            float plane = box.lo[axis] + (split.bin + 1) * (extent / split.bins);
+
+            left_refs = (sah_ref *)malloc(sizeof(sah_ref) * split.n_left);
+            right_refs = (sah_ref *)malloc(sizeof(sah_ref) * split.n_right);
+            record_allocation(b, left_refs);
+            record_allocation(b, right_refs);
+
+            n_left = n_right = 0;
+            left_box = right_box = empty_aabb();
+            for (int r = 0; r < count; r++) {
+                int first = position_bin(refs[r].box.lo[axis], box.lo[axis], scale, split.bins);
+                int last = position_bin(refs[r].box.hi[axis], box.lo[axis], scale, split.bins);
+
+                if (first <= split.bin) {
+                    sah_ref ref = refs[r];
+                    if (last > split.bin) {
+                        ref.box = clip_reference(b, &refs[r], axis, -FLT_MAX, plane);
+                    }
+                    grow_aabb(&left_box, &ref.box);
+                    left_refs[n_left++] = ref;
+                }
+                if (last > split.bin) {
+                    sah_ref ref = refs[r];
+                    if (first <= split.bin) {
+                        ref.box = clip_reference(b, &refs[r], axis, plane, FLT_MAX);
+                    }
+                    grow_aabb(&right_box, &ref.box);
+                    right_refs[n_right++] = ref;
+                }
+            }
+        } else {
+            if (split.axis >= 0 && split.spatial) {
+                // out of budget, give the references back and split by object
+                atomic_fetch_add(&b->ref_budget, split.n_left + split.n_right - count);
+                split = (sah_split){ FLT_MAX, -1 };
+                object_split(refs, count, &centroids, &split);
+            }
+
+            if (split.axis >= 0) {
+                // partition in place by centroid bin
+                int axis = split.axis;
+                float scale = split.bins / (centroids.hi[axis] - centroids.lo[axis]);
+                int i = 0, j = count - 1;
+                while (i <= j) {
+                    if (centroid_bin(&refs[i], axis, centroids.lo[axis], scale, split.bins) <= split.bin) {
+                        i++;
+                    } else {
+                        sah_ref tmp = refs[i];
+                        refs[i] = refs[j];
+                        refs[j--] = tmp;
+                    }
+                }
+                n_left = i;
+                left_box = split.left;
+                right_box = split.right;
+            } else {
+                // every centroid is the same point, split the references in half
+                n_left = count / 2;
+                left_box = right_box = empty_aabb();
+                for (int r = 0; r < count; r++) {
+                    grow_aabb(r < n_left ? &left_box : &right_box, &refs[r].box);
+                }
+            }
+
+            n_right = count - n_left;
+            right_refs = refs + n_left;
+        }
+
+        int child = atomic_fetch_add(&b->node_count, 2);
+        n->left = child;
+        n->right = child + 1;
+        n->prim = -1;
+
+        // continue with the larger child
+        bool left_larger = n_left >= n_right;
+        int small_node = left_larger ? child + 1 : child;
+        sah_ref * small_refs = left_larger ? right_refs : left_refs;
+        int small_count = left_larger ? n_right : n_left;
+        aabb small_box = left_larger ? right_box : left_box;
+
+        if (small_count >= TASK_THRESHOLD) {
+            build_task * t = (build_task *)malloc(sizeof(build_task));
+            *t = (build_task){ b, small_node, small_refs, small_count, small_box };
+            submit_task(b->pool, build_subtree_task, t);
+        } else {
+            build_subtree(b, small_node, small_refs, small_count, small_box);
+        }
+
+        node = left_larger ? child : child + 1;
+        refs = left_larger ? left_refs : right_refs;
+        count = left_larger ? n_left : n_right;
+        box = left_larger ? left_box : right_box;
+    }
+}
+
+/**
+ Writes the tree in depth first order, left child first, so a node's
+ left child directly follows it and its escape is the index just past
+ its subtree.
+ */
+static size_t flatten(const sah_builder * b, bvh_node * out) {
+    typedef struct { int node; cl_int escape; } entry;
+    int count = atomic_load(&b->node_count);
+
+    // children are always allocated after their parent
+    int * size = (int *)malloc(sizeof(int) * count);
+    for (int i = count - 1; i >= 0; i--) {
+        const sah_node * n = &b->nodes[i];
+        size[i] = n->left >= 0 ? 1 + size[n->left] + size[n->right] : 1;
+    }
+
+    entry * stack = (entry *)malloc(sizeof(entry) * count);
+    int sp = 0;
+    size_t next = 0;
+
+    stack[sp++] = (entry){ 0, -1 };
+    while (sp > 0) {
+        entry e = stack[--sp];
+        const sah_node * n = &b->nodes[e.node];
+        cl_int index = (cl_int)next++;
+
+        cl_int child = n->left >= 0 ? index + 1 : -(n->prim + 1);
+        out[index].lo = vector4_init(n->box.lo[0], n->box.lo[1], n->box.lo[2], 0.0f);
+        out[index].hi = vector4_init(n->box.hi[0], n->box.hi[1], n->box.hi[2], 0.0f);
+        memcpy(&out[index].lo.w, &child, sizeof(cl_int));
+        memcpy(&out[index].hi.w, &e.escape, sizeof(cl_int));
+
+        if (n->left >= 0) {
+            // the left child escapes to the right child, which escapes with its parent
+            stack[sp++] = (entry){ n->right, e.escape };
+            stack[sp++] = (entry){ n->left, index + 1 + size[n->left] };
+        }
+    }
+
+    free(stack);
+    free(size);
+    return next;
+}
+
+bvh_node * build_sah_bvh(const cl_float * surfaces, size_t triangle_count,
+                         bool spatial_splits, thread_pool * pool, size_t * node_count) {
+    if (triangle_count == 0) {
+        fprintf(stderr, "build_sah_bvh(...) needs at least one triangle\n");
+        exit(EXIT_FAILURE);
+    }
+
+    sah_builder b;
+    memset(&b, 0, sizeof(sah_builder));
+    b.surfaces = surfaces;
+    b.spatial_splits = spatial_splits;
+    b.pool = pool;
+    pthread_mutex_init(&b.lock, NULL);
+
+    int budget = spatial_splits ? (int)(SPATIAL_BUDGET * triangle_count) : 0;
+    atomic_init(&b.ref_budget, budget);
+    atomic_init(&b.node_count, 1);
+    b.nodes = (sah_node *)malloc(sizeof(sah_node) * (2 * (triangle_count + budget) - 1));
+
+    sah_ref * refs = (sah_ref *)malloc(sizeof(sah_ref) * triangle_count);
+    aabb box = empty_aabb();
+    for (size_t i = 0; i < triangle_count; i++) {
+        refs[i].prim = (int)i;
+        refs[i].box = empty_aabb();
+        for (int v = 0; v < 3; v++) {
+            grow_point(&refs[i].box, triangle_vertex(&b, (int)i, v));
+        }
+        grow_aabb(&box, &refs[i].box);
+    }
+    b.root_area = half_area(&box);
+
+    build_subtree(&b, 0, refs, (int)triangle_count, box);
+    wait_thread_pool(pool);
+
+    bvh_node * nodes = (bvh_node *)malloc(sizeof(bvh_node) * atomic_load(&b.node_count));
+    *node_count = flatten(&b, nodes);
+
+    free(refs);
+    for (size_t i = 0; i < b.n_allocations; i++) {
+        free(b.allocations[i]);
+    }
+    free(b.allocations);
+    free(b.nodes);
+    pthread_mutex_destroy(&b.lock);
+
+    return nodes;
+}
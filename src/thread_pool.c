@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+static void * worker(void * data) {
+    thread_pool * pool = (thread_pool *)data;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->head && !pool->stopping) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+
+        if (!pool->head) {
+            break; // stopping and nothing left to run
+        }
+
+        task * t = pool->head;
+        pool->head = t->next;
+        if (!pool->head) { pool->tail = NULL; }
+
+        pthread_mutex_unlock(&pool->lock);
+        t->func(t->arg);
+        free(t);
+        pthread_mutex_lock(&pool->lock);
+
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+thread_pool * create_thread_pool(unsigned n_threads) {
+    if (n_threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = cores > 0 ? (unsigned)cores : 1;
+    }
+
+    thread_pool * pool = (thread_pool *)calloc(1, sizeof(thread_pool));
+    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * n_threads);
+    pool->n_threads = n_threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    for (unsigned i = 0; i < n_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker, pool)) {
+            fprintf(stderr, "pthread_create(...) failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return pool;
+}
+
+void submit_task(thread_pool * pool, task_func func, void * arg) {
+    task * t = (task *)malloc(sizeof(task));
+    t->func = func;
+    t->arg = arg;
+    t->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail) {
+        pool->tail->next = t;
+    } else {
+        pool->head = t;
+    }
+    pool->tail = t;
+    pool->pending++;
+    pthread_cond_signal(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void wait_thread_pool(thread_pool * pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void release_thread_pool(thread_pool * pool) {
+    wait_thread_pool(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,59 @@
+#include "tonemap.h"
+
+static cl_kernel tonemap_kernel;
+static cl_mem frame;
+static cl_mem sum;
+static unsigned out_w, out_h;
+
+void init_tonemap(unsigned w, unsigned h, unsigned scale) {
+    int err = CL_SUCCESS;
+    cl_int s = (cl_int)scale;
+
+    out_w = w;
+    out_h = h;
+    tonemap_kernel = create_kernel("tonemap");
+
+    cl_image_format format = { CL_RGBA, CL_FLOAT };
+    cl_image_desc desc = { CL_MEM_OBJECT_IMAGE2D, w * scale, h * scale };
+    frame = clCreateImage(context, CL_MEM_READ_WRITE, &format, &desc, NULL, &err);
+    cl_check_err(err, "clCreateImage(...)");
+    sum = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                         sizeof(cl_float4) * w * h, NULL, &err);
+    cl_check_err(err, "clCreateBuffer(...)");
+
+    err  = clSetKernelArg(tonemap_kernel, 0, sizeof(cl_mem), &frame);
+    err |= clSetKernelArg(tonemap_kernel, 1, sizeof(cl_mem), &sum);
+    err |= clSetKernelArg(tonemap_kernel, 3, sizeof(cl_int), &s);
+    cl_check_err(err, "clSetKernelArg(...)");
+}
+
+cl_mem tonemap_frame() {
+    return frame;
+}
+
+void render_tonemap(cl_mem output, int encoding, float exposure, unsigned count) {
+    int err = CL_SUCCESS;
+    cl_int n = count > 1 ? (cl_int)count : 1;
+    cl_int e = encoding;
+
+    err  = clSetKernelArg(tonemap_kernel, 2, sizeof(cl_int), &n);
+    err |= clSetKernelArg(tonemap_kernel, 4, sizeof(float), &exposure);
+    err |= clSetKernelArg(tonemap_kernel, 5, sizeof(cl_int), &e);
+    err |= clSetKernelArg(tonemap_kernel, 6, sizeof(cl_mem), &output);
+    cl_check_err(err, "clSetKernelArg(...)");
+
+    const size_t local[] = {8, 8};
+    const size_t global[] = {
+        (out_w + local[0] - 1) / local[0] * local[0],
+        (out_h + local[1] - 1) / local[1] * local[1]
+    };
+    err = clEnqueueNDRangeKernel(command_queue, tonemap_kernel, 2,
+                                 NULL, global, local, 0, NULL, NULL);
+    cl_check_err(err, "clEnqueueNDRangeKernel(...)");
+}
+
+void release_tonemap() {
+    clReleaseKernel(tonemap_kernel);
+    clReleaseMemObject(frame);
+    clReleaseMemObject(sum);
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tuner.h"
+
+// longest line of the cache file, a key and its size
+#define TUNE_LINE 1024
+
+// widest tile shape tried, in either direction
+#define TUNE_MAX_ASPECT 8
+
+/**
+ Cache key of a launch: device, driver, kernel variant and resolution.
+ */
+static void tune_key(const char * variant, size_t w, size_t h, char * key, size_t size) {
+    char name[256] = "";
+    char driver[128] = "";
+    int err = clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    err |= clGetDeviceInfo(device_id, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+    cl_check_err(err, "clGetDeviceInfo(...)");
+
+    snprintf(key, size, "%s|%s|%s|%zux%zu", name, driver, variant, w, h);
+}
+
+/**
+ Finds the size stored for 'key' in TUNE_CACHE.
+ \return false if the file or the key does not exist.
+ */
+static bool load_tuned(const char * key, size_t * local) {
+    FILE * f = fopen(TUNE_CACHE, "r");
+    if (!f) {
+        return false;
+    }
+
+    char line[TUNE_LINE];
+    bool found = false;
+    while (fgets(line, sizeof(line), f)) {
+        char * tab = strchr(line, '\t');
+        if (!tab) { continue; }
+
+        *tab = '\0';
+        if (!strcmp(line, key) && sscanf(tab + 1, "%zu %zu", &local[0], &local[1]) == 2) {
+            found = true;
+        }
+    }
+
+    fclose(f);
+    return found;
+}
+
+/**
+ Stores the size for 'key' in TUNE_CACHE, replacing an older result.
+ The file is rewritten next to the old one and then moved over it,
+ so an interrupted run never leaves a partial cache behind.
+ */
+static void store_tuned(const char * key, const size_t * local) {
+    FILE * out = fopen(TUNE_CACHE ".tmp", "w");
+    if (!out) {
+        fprintf(stderr, "failed to write %s\n", TUNE_CACHE);
+        return;
+    }
+
+    FILE * in = fopen(TUNE_CACHE, "r");
+    if (in) {
+        char line[TUNE_LINE];
+        size_t key_length = strlen(key);
+        while (fgets(line, sizeof(line), in)) {
+            if (strncmp(line, key, key_length) || line[key_length] != '\t') {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+
+    fprintf(out, "%s\t%zu %zu\n", key, local[0], local[1]);
+    fclose(out);
+    rename(TUNE_CACHE ".tmp", TUNE_CACHE);
+}
+
+void tune_work_group(cl_kernel k, const char * variant, size_t w, size_t h,
+                     bool retune, tune_func render, size_t * local) {
+    int err = CL_SUCCESS;
+    size_t max_group = 0, multiple = 1;
+    size_t max_items[3] = { 1, 1, 1 };
+
+    // the kernel limit accounts for its registers and local memory
+    err  = clGetKernelWorkGroupInfo(k, device_id, CL_KERNEL_WORK_GROUP_SIZE,
+                                    sizeof(size_t), &max_group, NULL);
+    err |= clGetKernelWorkGroupInfo(k, device_id, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                                    sizeof(size_t), &multiple, NULL);
+    cl_check_err(err, "clGetKernelWorkGroupInfo(...)");
+    err = clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+                          sizeof(max_items), max_items, NULL);
+    cl_check_err(err, "clGetDeviceInfo(...)");
+
+    char key[TUNE_LINE / 2];
+    tune_key(variant, w, h, key, sizeof(key));
+    if (!retune && load_tuned(key, local) && local[0] * local[1] <= max_group &&
+            local[0] <= max_items[0] && local[1] <= max_items[1]) {
+        return;
+    }
+
+    printf("Tuning the work group size of %s at %zux%zu...\n", variant, w, h);
+    double best = 0.0;
+    bool found = false;
+
+    // without a shape filling whole multiples, take any shape within the limits
+    for (int strict = 1; strict >= 0 && !found; strict--) {
+        for (size_t x = 1; x <= max_items[0] && x <= max_group; x *= 2) {
+            for (size_t y = 1; y <= max_items[1] && x * y <= max_group; y *= 2) {
+                bool square_enough = x <= y * TUNE_MAX_ASPECT && y <= x * TUNE_MAX_ASPECT;
+                bool fits_image = (x == 1 || x <= w) && (y == 1 || y <= h);
+                if (!square_enough || !fits_image || (strict && (x * y) % multiple)) {
+                    continue;
+                }
+
+                const size_t candidate[] = { x, y };
+                render(candidate); // warm up, the first launch may compile or page in
+
+                double start = wall_time();
+                for (unsigned f = 0; f < TUNE_FRAMES; f++) {
+                    render(candidate);
+                }
+                double elapsed = (wall_time() - start) / TUNE_FRAMES;
+
+                if (!found || elapsed < best) {
+                    best = elapsed;
+                    local[0] = x;
+                    local[1] = y;
+                    found = true;
+                }
+            }
+        }
+    }
+
+    printf("Work groups of %zux%zu, %f seconds per frame.\n", local[0], local[1], best);
+    store_tuned(key, local);
+}